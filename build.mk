@@ -9,11 +9,16 @@ rayray_sources_$(d) += \
 	codec/image/bmp.cpp \
 	codec/image/exr.cpp \
         codec/mesh/ply.cpp \
+	codec/cache.cpp \
         codec/scene.cpp \
 	math/parametric/sphere.cpp \
         things/mesh.cpp \
+        things/particles.cpp \
         things/scene.cpp \
         traversal/bvh.cpp \
+        traversal/bvh4.cpp \
+        traversal/bvh8.cpp \
+        traversal/bvh16.cpp \
         material/diffuse.cpp \
         material/plastic.cpp \
         material/mirror.cpp \
@@ -23,10 +28,20 @@ rayray_sources_$(d) += \
 rayray_precompiled_$(d) :=
 rayray_target_dir_$(d)  := bin
 ifdef DEBUG
-rayray_cxx_flags_$(d)   := -std=c++14 -Isrc/ -g -Ivendor/rply/src -fno-inline -march=native -DDEBUG
+rayray_cxx_flags_$(d)   := -std=c++14 -Isrc/ -g -Ivendor/rply/src -fno-inline -msse4.2 -mpopcnt -DDEBUG
 else
-rayray_cxx_flags_$(d)   := -std=c++14 -Isrc/ -Ivendor/rply/src -I/usr/local/include -O3 -flto -march=native
+rayray_cxx_flags_$(d)   := -std=c++14 -Isrc/ -Ivendor/rply/src -I/usr/local/include -O3 -flto -msse4.2 -mpopcnt
 endif
+
+# the binary runs on every processor with SSE4.2. only the BVH backends
+# of wider nodes use AVX2 and AVX-512, and are picked at runtime. they
+# switch to their instruction set in the source (see TARGET_BEGIN), so
+# the inline functions all objects share are compiled for SSE4.2 alike
+
+ifdef STATS
+rayray_cxx_flags_$(d)   += -DTRAVERSAL_STATS
+endif
+
 rayray_ld_flags_$(d)    := -L/usr/local/lib -lIlmImf -lHalf -lIex -lOpenImageIO -lOpenImageIO_Util -L$(BUILD_DIR)/lib -lrply -flto -lassimp -Wl,-stack_size,1000000
 
 include $(TOP)/build/footer.mk
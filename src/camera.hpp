@@ -11,12 +11,17 @@
 #include "util/allocator.hpp"
 #include "util/color.hpp"
 #include "util/stats.hpp"
+#include "util/thread_pool.hpp"
+#include "traversal/sorting.hpp"
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace lenses {
   struct pinhole_t {
@@ -46,6 +51,28 @@ struct camera_t {
 
   stats_t::p stats;
 
+  // sort secondary and shadow rays of a patch into coherent streams
+  bool sort_rays;
+
+  /**
+   * The arena and integrator of a rendering thread. They are kept across
+   * snapshots, so repeated renders of a scene, e.g. turntables, don't
+   * allocate them again
+   *
+   */
+  struct worker_t {
+    allocator_t allocator;
+    Integrator  integrator;
+
+    inline worker_t()
+      : allocator(1024*1024*100)
+      , integrator(10)
+    {}
+  };
+
+  // indexed by the worker of the shared pool rendering a patch
+  std::vector<std::unique_ptr<worker_t>> workers;
+
   inline camera_t(
     const typename Film::p& film
   , const typename Lens::p& lens
@@ -54,6 +81,7 @@ struct camera_t {
     , film(film)
     , lens(lens)
     , stats(stats)
+    , sort_rays(true)
   {
     texture_t<color_t>::attach();
   }
@@ -77,8 +105,6 @@ struct camera_t {
   , active_t& active
   , uint32_t num_splats) const
   {
-    film->sample_film(patch, samples);
-
     auto segment = segments;
     for (auto i=0; i<num_splats; ++i, ++segment) {
       segments[i].p  = position;
@@ -106,6 +132,20 @@ struct camera_t {
     }
   }
 
+  inline bool has_live_paths(const active_t* actives, uint32_t num) const {
+    for (auto i=0; i<num; ++i) {
+      if (shading::has_live_paths(actives[i])) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Sort the path vertices found by the last intersection test by their
+   * material
+   *
+   */
   template<typename Scene>
   inline void find_next_path_vertices(
     const Scene& scene
@@ -114,9 +154,6 @@ struct camera_t {
   , active_t& active
   , splat_t* splats)
   {
-    // find intersection points following path vertices
-    scene.intersect(segments, active);
-
     for (auto i=0; i<active.num; ++i) {
       auto  index   = active.segment[i];
       auto& segment = segments[index];
@@ -124,88 +161,183 @@ struct camera_t {
       // intersection point, which is used to as a hack to determine if
       // the path segment is the result of a specular reflection for
       // environment lookups
-      auto mesh = scene.meshes[segment.mesh];
+      const auto& hit = scene.material(segment);
 
       if (segment.is_hit()) {
 	segment.follow();
-	segment.n = mesh->shading_normal(segment);
+	segment.n = scene.shading_normal(segment);
 	//mesh->st(segment);
       }
 
-      auto& material = m[mesh->material->id];
+      auto& material = m[hit->id];
       material.splats.segment[material.splats.num++] = index;
     }
   }
 
+  /**
+   * Render one pass over the film. Returns the number of patches that
+   * took samples, 0 once all pixels of an adaptive film converged
+   *
+   */
   template<typename Scene>
-  void snapshot(const Scene& scene) {
-    const auto num_splats = film->num_splats();
+  uint32_t snapshot(const Scene& scene) {
+    const auto num_materials = scene.materials.size();
+    const auto bounds        = scene.bounds();
+
+    auto& pool = thread_pool_t::shared();
+    if (workers.empty()) {
+      printf("Using %d threads for rendering\n", std::max(pool.size(), 1u));
+    }
 
-    // automatically use all cores for now
-    uint32_t cores = std::thread::hardware_concurrency();
-    printf("Using %d threads for rendering\n", cores);
+    // one slot per worker, and one for the thread waiting for the patches
+    workers.resize(pool.size() + 1);
 
-    std::thread threads[cores];
+    const auto num_patches = film->rewind();
+    stats->start_pass(num_patches);
 
-    for (auto t=0; t<cores; ++t) {
-      threads[t] = std::thread([&]() {
-	allocator_t allocator(1024*1024*100);
-	Integrator  integrator(10);
+    task_group_t tasks(pool);
 
-	patch_t  patch;
-	active_t active;
+    patch_t patch;
+    while (film->next_patch(patch)) {
+      tasks.spawn([&, patch]() {
+	auto& worker = workers[pool.worker()];
+	if (!worker) {
+	  worker.reset(new worker_t);
+	}
+
+	auto& allocator  = worker->allocator;
+	auto& integrator = worker->integrator;
 
-        while (film->next_patch(patch)) {
-	  // allocate patch buffers
-	  samples_t samples(allocator, num_splats);
+	// patches on the right and bottom edge of the film may be smaller,
+	// and in adaptive passes only some pixels take samples. the last
+	// stream of a patch is partial, if its samples are not a multiple of
+	// a stream
+	samples_t samples(allocator, film->num_splats(patch));
+	film->sample_film(patch, samples);
 
-	  auto segments = new(allocator) segment_t[num_splats];
-	  auto deferred = new(allocator) by_material_t[scene.materials.size()];
-	  auto splats   = new(allocator) splat_t[num_splats];
+	const auto num_splats  = samples.num;
+	const auto num_streams = (num_splats + SAMPLES_PER_ITERATION-1) / SAMPLES_PER_ITERATION;
 
-	  integrator.allocate(allocator, num_splats);
+	// allocate patch buffers
+	auto segments = new(allocator) segment_t[num_splats];
+	auto actives  = new(allocator) active_t[num_streams];
+	auto deferred = new(allocator) by_material_t[num_streams*num_materials];
+	auto splats   = new(allocator) splat_t[num_splats];
 
-	  // sample all rays for this patch
-	  sample_camera_vertices(patch, samples, segments, active, num_splats);
+	integrator.allocate(allocator, num_splats);
 
-	  // TODO: find first hit separately and compute direct light contribution
-	  // with stratified samples?
+	// sample all rays for this patch
+	sample_camera_vertices(patch, samples, segments, actives[0], num_splats);
 
-	  for (int i=0; i<num_splats; i+=SAMPLES_PER_ITERATION) {
-	    activate_samples(active, i, SAMPLES_PER_ITERATION);
+	// TODO: find first hit separately and compute direct light contribution
+	// with stratified samples?
+
+	for (int i=0; i<num_streams; ++i) {
+	  const auto start = i*SAMPLES_PER_ITERATION;
+	  activate_samples(actives[i], start, std::min(num_splats - start, (uint32_t) SAMPLES_PER_ITERATION));
+	}
 
-	    // run rendering pipeline for patch 
-	    while (shading::has_live_paths(active)) {
-	      reset_deferred_buffers(scene, deferred);
-	      find_next_path_vertices(scene, segments, deferred, active, splats);
+	// run rendering pipeline for patch. all streams of the patch move
+	// one path vertex further at a time, so their rays can be sorted
+	// into coherent streams for intersection tests
+	while (has_live_paths(actives, num_streams)) {
+	  stream::trace_sorted(bounds, segments, actives, num_streams, sort_rays,
+	    [&](const active_t& a) { scene.intersect(segments, a); });
+
+	  for (auto i=0; i<num_streams; ++i) {
+	    if (shading::has_live_paths(actives[i])) {
+	      auto m = deferred + i*num_materials;
+	      reset_deferred_buffers(scene, m);
+	      find_next_path_vertices(scene, segments, m, actives[i], splats);
+	      integrator.sample_lights(scene, segments, actives[i]);
+	    }
+	  }
 
-	      integrator.sample_lights(scene, segments, active);
-	      active.clear();
+	  stream::trace_sorted(bounds, integrator.shadows, actives, num_streams, sort_rays,
+	    [&](const active_t& a) { scene.occluded(integrator.shadows, a); });
 
-	      auto m = deferred;
-	      auto material_end = m+scene.materials.size();
-	      do {
-		if (shading::has_live_paths(m->splats)) {
-		  auto bxdf = m->material->at(allocator);
-		  integrator.shade(scene, bxdf, segments, m->splats, splats);
-		  integrator.sample_path_directions(bxdf, segments, m->splats, active);
-		}
-	      } while (++m != material_end);
+	  for (auto i=0; i<num_streams; ++i) {
+	    if (!shading::has_live_paths(actives[i])) {
+	      continue;
 	    }
+	    actives[i].clear();
+
+	    auto m = deferred + i*num_materials;
+	    auto material_end = m+num_materials;
+	    do {
+	      if (shading::has_live_paths(m->splats)) {
+		auto bxdf = m->material->at(allocator);
+		integrator.shade(scene, bxdf, segments, m->splats, splats);
+		integrator.sample_path_directions(bxdf, segments, m->splats, actives[i]);
+	      }
+	    } while (++m != material_end);
 	  }
+	}
 
-	  film->apply_splats(patch, samples, splats);
-	  stats->areas++;
+	film->apply_splats(patch, samples, splats);
 
-	  // free all memory allocated while rendering this patch, without
-	  // calling any destructors
-	  allocator.reset();
+#ifdef TRAVERSAL_STATS
+	if (film->heat) {
+	  film->apply_heat(samples, segments, integrator.shadows);
 	}
+#endif
+	stats->areas++;
+
+	// free all memory allocated while rendering this patch, without
+	// calling any destructors
+	allocator.reset();
+
+	TRAVERSAL_STAT(stats->merge_traversal());
       });
     }
 
-    for (int t=0; t<cores; ++t) {
-      threads[t].join();
+    tasks.wait();
+
+    TRAVERSAL_STAT(stats->traversal.print(std::clog));
+    return num_patches;
+  }
+
+  template<typename Scene>
+  uint32_t render(const Scene& scene, uint32_t passes, float_t seconds) {
+    return render(scene, passes, seconds, [](uint32_t) {});
+  }
+
+  /**
+   * Render passes until an adaptive film converged, 'passes' passes are
+   * done, or 'seconds' ran out, whichever comes first. A limit of 0 is
+   * no limit. A pass is only started if the last one would still fit
+   * into the time left. 'rendered' is called with the number of passes
+   * done after each of them, e.g. to look at the film in between.
+   * Returns the number of passes rendered
+   *
+   */
+  template<typename Scene, typename F>
+  uint32_t render(const Scene& scene, uint32_t passes, float_t seconds, const F& rendered) {
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+      return std::chrono::duration<float_t>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    uint32_t done = 0;
+    float_t  last = 0.0f;
+    while (passes == 0 || done < passes) {
+      if (seconds > 0.0f && elapsed() + last > seconds) {
+	break;
+      }
+
+      const auto before = elapsed();
+      const auto num    = snapshot(scene);
+      if (num == 0) {
+	break;
+      }
+      last = elapsed() - before;
+
+      std::clog
+	<< "Pass " << ++done << ": " << num << " patches in " << last << "s"
+	<< std::endl;
+
+      rendered(done);
     }
+    return done;
   }
 };
@@ -0,0 +1,332 @@
+#include "codec/cache.hpp"
+#include "util/buffer.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <string.h>
+#include <sys/stat.h>
+
+namespace codec {
+  namespace cache {
+    // change whenever the layout of cached data changes
+    static const uint32_t VERSION = 6;
+    static const char     MAGIC[8] = { 'p', 'h', 'c', 'a', 'c', 'h', 'e', 0 };
+
+    struct header_t {
+      char     magic[8];
+      uint64_t key;
+      // size of the whole file, to detect truncated caches
+      uint64_t size;
+      uint32_t instanced;
+      uint32_t padding;
+    };
+
+    // a file the scene was loaded from, its path is stored separately
+    struct input_record_t {
+      uint64_t size;
+      int64_t  modified;
+      uint32_t path;
+      uint32_t length;
+    };
+
+    struct mesh_record_t {
+      uint32_t index_vertices;
+      uint32_t index_faces;
+      uint32_t num_vertices;
+      uint32_t num_faces;
+      uint32_t material;
+    };
+
+    struct instance_record_t {
+      uint32_t    mesh;
+      transform_t to_world;
+    };
+
+    std::string path_of(const std::string& dir, uint64_t key) {
+      std::stringstream out;
+      out << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".cache";
+      return out.str();
+    }
+
+    uint64_t key(const std::string& path, const bvh_options_t& options) {
+      // 64 bit FNV-1a
+      uint64_t hash = 14695981039346656037ull;
+      auto mix = [&hash](const void* data, size_t size) {
+	auto bytes = (const unsigned char*) data;
+	for (size_t i=0; i<size; ++i) {
+	  hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+      };
+
+      std::ifstream in(path, std::ios::binary);
+      char chunk[1<<16];
+      while (in.read(chunk, sizeof(chunk)) || in.gcount() > 0) {
+	mix(chunk, in.gcount());
+      }
+
+      mix(&VERSION, sizeof(VERSION));
+      mix(&options.builder, sizeof(options.builder));
+      mix(&options.spatial_budget, sizeof(options.spatial_budget));
+      mix(&options.quantize, sizeof(options.quantize));
+      mix(&options.reorder, sizeof(options.reorder));
+      // each triangle test lays out its leaf blocks differently
+      mix(&options.intersector, sizeof(options.intersector));
+
+      // hierarchies of different widths can't be mapped by each other
+      const auto width = bvh_width(options);
+      mix(&width, sizeof(width));
+
+      return hash;
+    }
+
+    bool stat_input(const std::string& path, input_record_t& out) {
+      struct stat info;
+      if (stat(path.c_str(), &info) != 0) {
+	return false;
+      }
+      out.size     = info.st_size;
+      out.modified = info.st_mtime;
+      return true;
+    }
+
+    /**
+     * Check that a mesh refers to mapped vertices and faces, and to a
+     * material of the scene. Throws otherwise
+     *
+     */
+    void check(const mesh_record_t& record, const mesh_scene_t& scene) {
+      const auto vertices = (uint64_t) record.index_vertices + record.num_vertices;
+      if (vertices > mesh_t::vertices.size() || vertices > mesh_t::normals.size()) {
+	throw std::runtime_error("Mesh vertices exceed the cached vertices");
+      }
+
+      const auto faces = (uint64_t) record.index_faces + 3ull*record.num_faces;
+      if (faces > mesh_t::faces.size()) {
+	throw std::runtime_error("Mesh faces exceed the cached faces");
+      }
+
+      for (uint64_t i=record.index_faces; i<faces; ++i) {
+	if (mesh_t::faces[i] >= record.num_vertices) {
+	  throw std::runtime_error("Mesh face refers to an unknown vertex");
+	}
+      }
+
+      if (!scene.material(record.material)) {
+	throw std::runtime_error("Mesh of an unknown material");
+      }
+    }
+
+    /**
+     * Map the cached geometry at 'cursor' into the scene. Throws if the
+     * cache refers to data past its end
+     *
+     */
+    void map(char*& cursor, const char* end, const header_t& header, mesh_scene_t& scene) {
+      mesh_t::vertices.map(cursor, end);
+      mesh_t::normals.map(cursor, end);
+      mesh_t::u.map(cursor, end);
+      mesh_t::v.map(cursor, end);
+      mesh_t::faces.map(cursor, end);
+
+      buffer_t<mesh_record_t>     meshes;
+      buffer_t<instance_record_t> instances;
+      meshes.map(cursor, end);
+      instances.map(cursor, end);
+
+      for (const auto& record: meshes) {
+	check(record, scene);
+      }
+
+      for (const auto& record: instances) {
+	if (record.mesh >= meshes.size()) {
+	  throw std::runtime_error("Instance of an unknown mesh");
+	}
+      }
+
+      if (!header.instanced) {
+	scene.accel.map(cursor, end);
+      }
+
+      for (const auto& record: meshes) {
+	auto mesh = mesh_t::p(new mesh_t(scene.material(record.material)));
+
+	mesh->index_vertices = record.index_vertices;
+	mesh->index_faces    = record.index_faces;
+	mesh->num_vertices   = record.num_vertices;
+	mesh->num_faces      = record.num_faces;
+
+	scene.add(mesh);
+      }
+
+      for (const auto& record: instances) {
+	scene.add(instance_t::p(new instance_t(scene.meshes[record.mesh], record.to_world)));
+      }
+
+      if (header.instanced || scene.two_level()) {
+	// instances refer to each other by pointer, so their hierarchies
+	// are not cached. neither are particles, which are not part of the
+	// scene file
+	scene.preprocess();
+      }
+    }
+
+    mapped_file_t::p load(const std::string& dir, uint64_t key, mesh_scene_t& scene) {
+      const auto path = path_of(dir, key);
+
+      struct stat info;
+      if (stat(path.c_str(), &info) != 0) {
+	return nullptr;
+      }
+
+      auto file = std::make_shared<mapped_file_t>(path);
+
+      header_t header;
+      if (file->size < sizeof(header)) {
+	return nullptr;
+      }
+      memcpy(&header, file->data, sizeof(header));
+
+      if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+	  header.key != key ||
+	  header.size != file->size) {
+	std::clog << "Ignoring invalid cache: " << path << std::endl;
+	return nullptr;
+      }
+
+      auto cursor = file->data + sizeof(header);
+      auto end    = file->data + file->size;
+
+      try {
+	buffer_t<input_record_t> inputs;
+	buffer_t<char>           paths;
+	inputs.map(cursor, end);
+	paths.map(cursor, end);
+
+	// companion files of the scene are not part of the key
+	for (const auto& input: inputs) {
+	  if ((uint64_t) input.path + input.length > paths.size()) {
+	    throw std::runtime_error("Input path out of range");
+	  }
+
+	  const std::string name(paths.begin() + input.path, input.length);
+
+	  input_record_t current;
+	  if (!stat_input(name, current) ||
+	      current.size != input.size ||
+	      current.modified != input.modified) {
+	    std::clog << "Ignoring outdated cache: " << path << ", " << name << " changed" << std::endl;
+	    return nullptr;
+	  }
+	}
+
+	printf("Loading cache: %s\n", path.c_str());
+	map(cursor, end, header, scene);
+      }
+      catch (const std::runtime_error& e) {
+	std::clog << "Ignoring invalid cache: " << path << ", " << e.what() << std::endl;
+
+	// nothing may refer to the mapping once it is released
+	mesh_t::vertices.clear();
+	mesh_t::normals.clear();
+	mesh_t::u.clear();
+	mesh_t::v.clear();
+	mesh_t::faces.clear();
+	return nullptr;
+      }
+
+      return file;
+    }
+
+    void save(
+      const std::string& dir
+    , uint64_t key
+    , const mesh_scene_t& scene
+    , const std::vector<std::string>& files)
+    {
+      const auto path = path_of(dir, key);
+      const auto tmp  = path + ".tmp";
+
+      mkdir(dir.c_str(), 0755);
+
+      header_t header;
+      memcpy(header.magic, MAGIC, sizeof(MAGIC));
+      header.key       = key;
+      header.size      = 0;
+      header.instanced = scene.two_level();
+      header.padding   = 0;
+
+      buffer_t<input_record_t> inputs;
+      buffer_t<char>           paths;
+      for (const auto& file: files) {
+	input_record_t input;
+	if (!stat_input(file, input)) {
+	  std::clog << "Not caching, can't stat input: " << file << std::endl;
+	  return;
+	}
+	input.path   = paths.size();
+	input.length = file.size();
+	inputs.push_back(input);
+
+	for (auto c: file) {
+	  paths.push_back(c);
+	}
+      }
+
+      buffer_t<mesh_record_t> meshes;
+      for (const auto& mesh: scene.meshes) {
+	meshes.push_back({
+	  mesh->index_vertices,
+	  mesh->index_faces,
+	  mesh->num_vertices,
+	  mesh->num_faces,
+	  mesh->material ? mesh->material->id : 0
+	});
+      }
+
+      buffer_t<instance_record_t> instances;
+      for (const auto& instance: scene.instances) {
+	if (instance->mesh) {
+	  instances.push_back({ instance->mesh->id, instance->to_world });
+	}
+      }
+
+      std::ofstream out(tmp, std::ios::binary);
+      out.write((const char*) &header, sizeof(header));
+
+      inputs.write(out);
+      paths.write(out);
+
+      mesh_t::vertices.write(out);
+      mesh_t::normals.write(out);
+      mesh_t::u.write(out);
+      mesh_t::v.write(out);
+      mesh_t::faces.write(out);
+
+      meshes.write(out);
+      instances.write(out);
+
+      if (!header.instanced) {
+	scene.accel.write(out);
+      }
+
+      header.size = out.tellp();
+      out.seekp(0);
+      out.write((const char*) &header, sizeof(header));
+      out.close();
+
+      if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+	std::clog << "Failed to write cache: " << path << std::endl;
+	std::remove(tmp.c_str());
+	return;
+      }
+
+      std::clog << "Wrote cache: " << path << std::endl;
+    }
+  }
+}
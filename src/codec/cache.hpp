@@ -0,0 +1,49 @@
+#pragma once
+
+#include "things/scene.hpp"
+#include "util/mapped_file.hpp"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * A binary cache of the preprocessed scene geometry. It holds the global
+ * mesh buffers and the hierarchy of the scene, and is mapped into memory
+ * instead of being read, so the pages of large scenes are loaded lazily
+ * while rendering
+ *
+ */
+namespace codec {
+  namespace cache {
+    /**
+     * Hash the contents of a scene file together with all options, that
+     * change the hierarchy built for it. Companion files of the scene
+     * are checked by load() instead, since only loading the scene tells
+     * which files it reads
+     *
+     */
+    uint64_t key(const std::string& path, const bvh_options_t& options);
+
+    /**
+     * Load the cached scene with the given key from a directory. Returns
+     * the mapping, which must outlive the scene, or nullptr if there is
+     * no valid cache for the key, one of the files the scene was loaded
+     * from changed, or the cache is corrupt
+     *
+     */
+    mapped_file_t::p load(const std::string& dir, uint64_t key, mesh_scene_t& scene);
+
+    /**
+     * Store a preprocessed scene in a directory, together with the sizes
+     * and modification times of the files it was loaded from
+     *
+     */
+    void save(
+      const std::string& dir
+    , uint64_t key
+    , const mesh_scene_t& scene
+    , const std::vector<std::string>& files);
+  }
+}
@@ -1,21 +1,171 @@
 #include "exr.hpp"
 #include "camera.hpp"
 #include "film.hpp"
+#include "util/thread_pool.hpp"
 
 #pragma clang diagnostic ignored "-Wdeprecated-register"
+#include "OpenEXR/ImfChannelList.h"
+#include "OpenEXR/ImfFrameBuffer.h"
+#include "OpenEXR/ImfOutputFile.h"
 #include "OpenEXR/ImfRgbaFile.h"
 
+#include <cstdio>
+#include <vector>
+
+#include <stddef.h>
+
 using namespace Imf;
 
-void codec::image::exr::save(const std::string& path, const film_t::p& film) {
-  Rgba data[film->width*film->height];
+/**
+ * Convert the rows of the film on the shared pool, 'f' is called with
+ * the index of each row
+ *
+ */
+template<typename F>
+void for_each_row(const film_t::p& film, const F& f) {
+  task_group_t tasks(thread_pool_t::shared());
   for (auto y=0; y<film->height; ++y) {
+    tasks.spawn([&f, y]() { f(y); });
+  }
+  tasks.wait();
+}
+
+struct heat_pixel_t {
+  float r, g, b;
+  float nodes, primitives, depth;
+};
+
+/**
+ * Write the beauty image with the cost heatmap as extra channels, so
+ * both can be compared in the same viewer
+ *
+ */
+void save_with_heat(const std::string& path, const film_t::p& film) {
+  const auto w = film->width;
+  const auto h = film->height;
+
+  std::vector<heat_pixel_t> data(w*h);
+  for_each_row(film, [&](uint32_t y) {
+    for (auto x=0; x<w; ++x) {
+      auto& pixel = film->pixel(x, y);
+      auto& heat  = film->heat[y*w+x];
+      data[y*w+x] = {
+	(float) pixel.r, (float) pixel.g, (float) pixel.b,
+	(float) heat.nodes, (float) heat.primitives, (float) heat.depth
+      };
+    }
+  });
+
+  static const struct {
+    const char* name;
+    size_t      offset;
+  } channels[] = {
+    { "R",               offsetof(heat_pixel_t, r) },
+    { "G",               offsetof(heat_pixel_t, g) },
+    { "B",               offsetof(heat_pixel_t, b) },
+    { "heat.nodes",      offsetof(heat_pixel_t, nodes) },
+    { "heat.primitives", offsetof(heat_pixel_t, primitives) },
+    { "heat.depth",      offsetof(heat_pixel_t, depth) }
+  };
+
+  Header      header(w, h);
+  FrameBuffer buffer;
+  for (const auto& channel: channels) {
+    header.channels().insert(channel.name, Channel(FLOAT));
+    buffer.insert(channel.name, Slice(
+      FLOAT,
+      (char*) data.data() + channel.offset,
+      sizeof(heat_pixel_t),
+      sizeof(heat_pixel_t) * w));
+  }
+
+  OutputFile file(path.c_str(), header);
+  file.setFrameBuffer(buffer);
+  file.writePixels(h);
+}
+
+void codec::image::exr::save(const std::string& path, const film_t::p& film) {
+  if (film->heat) {
+    save_with_heat(path, film);
+    return;
+  }
+
+  std::vector<Rgba> data(film->width*film->height);
+  for_each_row(film, [&](uint32_t y) {
     for (auto x=0; x<film->width; ++x) {
       auto& pixel = film->pixel(x, y);
       data[y*film->width+x] = {(float)pixel.r, (float)pixel.g, (float)pixel.b, 1.0f};
     }
-  }
+  });
   RgbaOutputFile file(path.c_str(), film->width, film->height, WRITE_RGBA);
-  file.setFrameBuffer(data, 1, film->width);
+  file.setFrameBuffer(data.data(), 1, film->width);
   file.writePixels(film->height);
 }
+
+codec::image::exr::background_t::background_t(const std::string& path)
+  : path(path)
+  , width(0)
+  , height(0)
+  , waiting(false)
+  , done(false)
+{
+  thread = std::thread([this]() {
+    std::vector<color_t> copy;
+    std::vector<Rgba>    data;
+
+    while (true) {
+      uint32_t w, h;
+      {
+	std::unique_lock<std::mutex> guard(lock);
+	wakeup.wait(guard, [this]() { return done || waiting; });
+	if (!waiting) {
+	  return;
+	}
+	copy.swap(pixels);
+	w       = width;
+	h       = height;
+	waiting = false;
+      }
+
+      // converted on this thread, since waiting on the shared pool from
+      // here would compete with the rendering thread for its slot
+      data.resize(w*h);
+      for (auto i=0; i<w*h; ++i) {
+	data[i] = {(float) copy[i].r, (float) copy[i].g, (float) copy[i].b, 1.0f};
+      }
+
+      const auto partial = this->path + ".partial";
+      {
+	RgbaOutputFile file(partial.c_str(), w, h, WRITE_RGBA);
+	file.setFrameBuffer(data.data(), 1, w);
+	file.writePixels(h);
+      }
+      std::rename(partial.c_str(), this->path.c_str());
+    }
+  });
+}
+
+codec::image::exr::background_t::~background_t() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+  }
+  wakeup.notify_all();
+  thread.join();
+}
+
+void codec::image::exr::background_t::save(const film_t::p& film) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    width  = film->width;
+    height = film->height;
+    pixels.resize(width*height);
+    for (auto y=0; y<height; ++y) {
+      for (auto x=0; x<width; ++x) {
+	pixels[y*width+x] = film->pixel(x, y);
+      }
+    }
+    waiting = true;
+  }
+  wakeup.notify_one();
+}
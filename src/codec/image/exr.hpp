@@ -1,6 +1,13 @@
 #pragma once
 
+#include "util/color.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 struct film_t;
 
@@ -8,6 +15,34 @@ namespace codec {
   namespace image {
     namespace exr {
       void save(const std::string& path, const std::shared_ptr<film_t>& film);
+
+      /**
+       * Writes copies of a film on a thread of its own, so rendering goes
+       * on while interim images are saved. Only the latest copy is
+       * written, a copy handed in while another one waits replaces it.
+       * Images are written next to 'path' first and then moved there, so
+       * a viewer never reads a partial file
+       *
+       */
+      struct background_t {
+	std::string path;
+
+	std::thread             thread;
+	std::mutex              lock;
+	std::condition_variable wakeup;
+
+	uint32_t             width;
+	uint32_t             height;
+	std::vector<color_t> pixels;
+	bool                 waiting;
+	bool                 done;
+
+	background_t(const std::string& path);
+	// writes the copy still waiting, if any
+	~background_t();
+
+	void save(const std::shared_ptr<film_t>& film);
+      };
     };
   }
 }
@@ -3,6 +3,8 @@
 
 #include <rply.h>
 
+#include <stdexcept>
+
 int add_vertex(p_ply_argument argument) {
   long index, axis;
   mesh_t* m;
@@ -29,6 +31,21 @@ int add_face(p_ply_argument argument) {
   return 1;
 }
 
+int add_particle(p_ply_argument argument) {
+  long index, axis;
+  particles_t* p;
+  ply_get_argument_user_data(argument, (void**) &p, &axis);
+  ply_get_argument_element(argument, NULL, &index);
+  float_t v = ply_get_argument_value(argument);
+  if (axis < 3) {
+    p->centers[index].v[axis] = v;
+  }
+  else {
+    p->radii[index] = v;
+  }
+  return 1;
+}
+
 mesh_t::p codec::mesh::ply::load(const std::string& path, const material_t::p& default_material) {
   auto mesh = new mesh_t(default_material);
 
@@ -61,3 +78,35 @@ mesh_t::p codec::mesh::ply::load(const std::string& path, const material_t::p& d
 
   return mesh_t::p(mesh);
 }
+
+particles_t::p codec::mesh::ply::load_particles(const std::string& path, const material_t::p& material, float_t radius) {
+  auto ply = ply_open(path.c_str(), NULL, 0, NULL);
+  if (!ply) {
+    throw std::runtime_error("Can't open particles: " + path);
+  }
+
+  if (!ply_read_header(ply)) {
+    ply_close(ply);
+    throw std::runtime_error("Failed to open particles header: " + path);
+  }
+
+  auto particles = new particles_t(material);
+
+  const auto num = ply_set_read_cb(ply, "vertex", "x", add_particle, particles, 0);
+  ply_set_read_cb(ply, "vertex", "y", add_particle, particles, 1);
+  ply_set_read_cb(ply, "vertex", "z", add_particle, particles, 2);
+  ply_set_read_cb(ply, "vertex", "radius", add_particle, particles, 3);
+
+  particles->centers.resize(num);
+  particles->radii.resize(num, radius);
+
+  const auto read = ply_read(ply);
+  ply_close(ply);
+
+  if (!read) {
+    delete particles;
+    throw std::runtime_error("Failed to read particles: " + path);
+  }
+
+  return particles;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "things/mesh.hpp"
+#include "things/particles.hpp"
 
 #include <string>
 
@@ -8,6 +9,13 @@ namespace codec {
   namespace mesh {
     namespace ply {
       mesh_t::p load(const std::string& path, const material_t::p&);
+
+      /**
+       * Load the vertices of a point cloud as particles. Points take the
+       * radius of their "radius" property, or 'radius' if there is none
+       *
+       */
+      particles_t::p load_particles(const std::string& path, const material_t::p&, float_t radius);
     }
   }
 }
@@ -1,10 +1,18 @@
 #include "codec/scene.hpp"
 #include "things/scene.hpp"
 
+#include <assimp/cfileio.h>
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <limits.h>
+#include <stdlib.h>
+
 // void add_materials(scene_t& scene, const aiScene* aiScene) {
 //   printf("Import materials: %d\n", aiScene->mNumMaterials);
 
@@ -13,71 +21,200 @@
 //   }
 // }
 
-void add_meshes(scene_t& scene, const aiScene* aiScene, const aiNode* node) {
-  printf("Node: %s\n", node->mName.C_Str());
+transform_t to_transform(const aiMatrix4x4& m) {
+  const float_t rows[12] = {
+    m.a1, m.a2, m.a3, m.a4,
+    m.b1, m.b2, m.b3, m.b4,
+    m.c1, m.c2, m.c3, m.c4
+  };
+  return transform_t(rows);
+}
 
-  for (auto i=0; i<node->mNumMeshes; ++i) { 
-    auto mesh = aiScene->mMeshes[node->mMeshes[i]];
-    auto mat  = scene.material(mesh->mMaterialIndex);
-    auto out  = mesh_t::p(new mesh_t(mat ? mat : scene.material(0)));
+// count how often each mesh is referenced by the nodes of the scene
+void count_references(const aiNode* node, std::vector<uint32_t>& references) {
+  for (auto i=0; i<node->mNumMeshes; ++i) {
+    references[node->mMeshes[i]]++;
+  }
+
+  for (auto i=0; i<node->mNumChildren; ++i) {
+    count_references(node->mChildren[i], references);
+  }
+}
 
-    printf("Loading mesh %s: %d, %d\n", mesh->mName.C_Str(), mesh->mNumFaces, mesh->mMaterialIndex);
+mesh_t::p load_mesh(scene_t& scene, const aiMesh* mesh, const transform_t& t) {
+  auto mat  = scene.material(mesh->mMaterialIndex);
+  auto out  = mesh_t::p(new mesh_t(mat ? mat : scene.material(0)));
 
-    out->num_faces    = mesh->mNumFaces;
-    out->num_vertices = mesh->mNumVertices;
+  printf("Loading mesh %s: %d, %d\n", mesh->mName.C_Str(), mesh->mNumFaces, mesh->mMaterialIndex);
 
-    for (auto j=0; j<mesh->mNumFaces; ++j) {
-      auto face = &mesh->mFaces[j];
+  out->num_faces    = mesh->mNumFaces;
+  out->num_vertices = mesh->mNumVertices;
 
-      if (face->mNumIndices == 3) {
-	for (auto k=0; k<face->mNumIndices; ++k) {
-	  mesh_t::faces.push_back(face->mIndices[2-k]);
-	}
-      }
-      else {
-	printf("Only triangles are supported right now: %d\n", face->mNumIndices);
-	out->num_faces--;
+  for (auto j=0; j<mesh->mNumFaces; ++j) {
+    auto face = &mesh->mFaces[j];
+
+    if (face->mNumIndices == 3) {
+      for (auto k=0; k<face->mNumIndices; ++k) {
+	mesh_t::faces.push_back(face->mIndices[2-k]);
       }
     }
+    else {
+      printf("Only triangles are supported right now: %d\n", face->mNumIndices);
+      out->num_faces--;
+    }
+  }
 
-    if (out->num_faces > 0) {
+  if (out->num_faces > 0) {
+    for (auto k=0; k<mesh->mNumVertices; ++k) {
+      auto& v = mesh->mVertices[k];
+      mesh_t::vertices.push_back(t.point({v.x, v.y, v.z}));
+    }
+
+    if (mesh->mNormals) {
+      const auto inverse = t.inverse();
       for (auto k=0; k<mesh->mNumVertices; ++k) {
-	auto& v = mesh->mVertices[k];
-	mesh_t::vertices.push_back({v.x, v.y, v.z});
-      }
-      
-      if (mesh->mNormals) {
-	for (auto k=0; k<mesh->mNumVertices; ++k) {
-	  auto& n = mesh->mNormals[k];
-	  mesh_t::normals.push_back({n.x, n.y, n.z});
-	}
+	auto& n = mesh->mNormals[k];
+	mesh_t::normals.push_back(inverse.normal({n.x, n.y, n.z}).normalize());
       }
-      else {
-	out->compute_normals();
-      }
-
-      scene.add(out);
-      printf("id: %d\n", out->id);
     }
     else {
-      printf("skipping empty mesh\n");
-      delete out;
+      out->compute_normals();
+    }
+
+    scene.add(out);
+    printf("id: %d\n", out->id);
+  }
+  else {
+    printf("skipping empty mesh\n");
+    delete out;
+    out = nullptr;
+  }
+
+  return out;
+}
+
+/**
+ * Add the meshes of a node and its children to the scene. Meshes
+ * referenced by a single node are transformed into world space, meshes
+ * referenced by several nodes are loaded once and instanced
+ *
+ */
+void add_meshes(
+  scene_t& scene
+, const aiScene* aiScene
+, const aiNode* node
+, const transform_t& parent
+, const std::vector<uint32_t>& references
+, std::vector<mesh_t::p>& prototypes)
+{
+  printf("Node: %s\n", node->mName.C_Str());
+
+  const auto t = parent * to_transform(node->mTransformation);
+
+  for (auto i=0; i<node->mNumMeshes; ++i) { 
+    auto index = node->mMeshes[i];
+    auto mesh  = aiScene->mMeshes[index];
+
+    if (references[index] == 1) {
+      load_mesh(scene, mesh, t);
+      continue;
+    }
+
+    auto& prototype = prototypes[index];
+    if (!prototype) {
+      prototype = load_mesh(scene, mesh, transform_t());
+    }
+
+    if (prototype) {
+      scene.add(instance_t::p(new instance_t(prototype, t)));
     }
   }
 
   for (auto i=0; i<node->mNumChildren; ++i) {
-    add_meshes(scene, aiScene, node->mChildren[i]);
+    add_meshes(scene, aiScene, node->mChildren[i], t, references, prototypes);
+  }
+}
+
+/**
+ * File access for assimp, which reads files from disk like its default
+ * one, but records the resolved path of every file it opens, since
+ * importers pull in companion files on their own
+ *
+ */
+size_t file_read(aiFile* file, char* buffer, size_t size, size_t count) {
+  return fread(buffer, size, count, (FILE*) file->UserData);
+}
+
+size_t file_write(aiFile* file, const char* buffer, size_t size, size_t count) {
+  return fwrite(buffer, size, count, (FILE*) file->UserData);
+}
+
+size_t file_tell(aiFile* file) {
+  return ftell((FILE*) file->UserData);
+}
+
+size_t file_size(aiFile* file) {
+  auto fp  = (FILE*) file->UserData;
+  auto cur = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  auto out = ftell(fp);
+  fseek(fp, cur, SEEK_SET);
+  return out;
+}
+
+aiReturn file_seek(aiFile* file, size_t offset, aiOrigin origin) {
+  const int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+  return fseek((FILE*) file->UserData, offset, whence[origin]) == 0 ? aiReturn_SUCCESS : aiReturn_FAILURE;
+}
+
+void file_flush(aiFile* file) {
+  fflush((FILE*) file->UserData);
+}
+
+aiFile* file_open(aiFileIO* io, const char* path, const char* mode) {
+  auto fp = fopen(path, mode);
+  if (!fp) {
+    return nullptr;
+  }
+
+  auto& files = *(std::vector<std::string>*) io->UserData;
+
+  char resolved[PATH_MAX];
+  const std::string file = realpath(path, resolved) ? resolved : path;
+  if (std::find(files.begin(), files.end(), file) == files.end()) {
+    files.push_back(file);
   }
+
+  return new aiFile {
+    file_read, file_write, file_tell, file_size, file_seek, file_flush,
+    (aiUserData) fp
+  };
+}
+
+void file_close(aiFileIO*, aiFile* file) {
+  fclose((FILE*) file->UserData);
+  delete file;
 }
 
 namespace codec {
   namespace scene {
-    void load(const std::string& path, scene_t& scene) {
+    std::vector<std::string> load(const std::string& path, scene_t& scene) {
+      std::vector<std::string> files;
+      aiFileIO io = { file_open, file_close, (aiUserData) &files };
+
       printf("Loading scene: %s\n", path.c_str());
-      auto import = aiImportFile(
+      auto import = aiImportFileEx(
         path.c_str(),
-	aiProcessPreset_TargetRealtime_MaxQuality /*| aiProcess_Triangulate*/);
-      add_meshes(scene, import, import->mRootNode);
+	aiProcessPreset_TargetRealtime_MaxQuality /*| aiProcess_Triangulate*/,
+	&io);
+
+      std::vector<uint32_t>  references(import->mNumMeshes, 0);
+      std::vector<mesh_t::p> prototypes(import->mNumMeshes, nullptr);
+
+      count_references(import->mRootNode, references);
+      add_meshes(scene, import, import->mRootNode, transform_t(), references, prototypes);
+
+      return files;
     }
   }
 }
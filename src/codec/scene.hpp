@@ -1,11 +1,18 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 struct scene_t;
 
 namespace codec {
   namespace scene {
-    void load(const std::string& path, scene_t& scene);
+    /**
+     * Add the meshes of a scene file to the scene. Returns the paths of
+     * all files read, the scene file and companions like materials or
+     * external buffers
+     *
+     */
+    std::vector<std::string> load(const std::string& path, scene_t& scene);
   }
 }
@@ -15,20 +15,23 @@
 #include "material/glass.hpp"
 #include "material/paint.hpp"
 #include "math/sampling.hpp"
+#include "codec/cache.hpp"
 #include "codec/image/exr.hpp"
 #include "codec/mesh/ply.hpp"
 #include "codec/scene.hpp"
 #include "util/stats.hpp"
+#include "util/thread_pool.hpp"
 #include "texture.hpp"
 
+#include <fstream>
+
 #include <dirent.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 typedef camera_t<film_t, lenses::pinhole_t, single_path_t> pinhole_camera_t;
 
-const uint32_t film_t::PATCH_SIZE = 16;
-
+// default resolution of the image
 const uint32_t WIDTH=1024;
 const uint32_t HEIGHT=768;
 
@@ -49,14 +52,239 @@ int main(int argc, char** argv) {
 
   texture_t<color_t>::boot();
 
-  auto path    = argv[1];
-  auto samples = argc > 2 ? atoi(argv[2]) : 1;
+  mesh_bvh_t::options_t options;
+  // by default the BVH is built on all cores
+  options.threads = std::thread::hardware_concurrency();
+
+  // directory of cached scenes. scenes are not cached, if it is empty
+  std::string cache;
+  // file the traversal statistics are written to as JSON
+  std::string statistics;
+  // write the traversal cost per pixel next to the image
+  bool heatmap = false;
+  // sort secondary and shadow rays into coherent streams
+  bool sort_rays = true;
+  // pin the threads of the pool to one core each
+  bool pin = false;
+  // resolution of the image, any size works, edge patches are cut to it
+  uint32_t width  = WIDTH;
+  uint32_t height = HEIGHT;
+  // size of the patches the film is rendered in, 0 picks one for the threads
+  uint32_t patch_size = 16;
+  // order the patches are rendered in
+  film_t::ordering_t ordering = film_t::HILBERT;
+  // relative error pixels are sampled to in adaptive passes, 0 gives all
+  // pixels the same samples
+  float_t target_error = 0.0f;
+  // passes of the given samples accumulated into the image, 0 picks one,
+  // 16 for adaptive passes, or as many as fit into the budget
+  uint32_t passes = 0;
+  // seconds rendering may take, 0 is no limit
+  float_t  budget = 0.0f;
+  // point cloud rendered as particles next to the scene, and the radius
+  // of points that don't give their own
+  std::string particles;
+  float_t     radius = 0.01f;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:d:j:Pbqc:s:mut:pw:i:x:z:o:r:e:n:l:g:y:")) != -1) {
+    switch (opt) {
+    case 'a':
+      if (std::string(optarg) == "sbvh") {
+	options.builder = mesh_bvh_t::options_t::SBVH;
+      }
+      else if (std::string(optarg) == "lbvh") {
+	options.builder = mesh_bvh_t::options_t::LBVH;
+      }
+      break;
+    case 'd':
+      options.spatial_budget = atof(optarg);
+      break;
+    case 'j':
+      options.threads = atoi(optarg);
+      break;
+    case 'P':
+      pin = true;
+      break;
+    case 'b':
+      options.report = true;
+      break;
+    case 'q':
+      options.quantize = true;
+      break;
+    case 'c':
+      cache = optarg;
+      break;
+    case 's':
+      statistics = optarg;
+      break;
+    case 'm':
+      heatmap = true;
+      break;
+    case 'u':
+      sort_rays = false;
+      break;
+    case 't':
+      options.single_ray_threshold = atoi(optarg);
+      break;
+    case 'p':
+      options.packets = false;
+      break;
+    case 'w':
+      options.width = atoi(optarg);
+      break;
+    case 'i':
+      options.interleave = atoi(optarg);
+      break;
+    case 'x':
+      if (std::string(optarg) == "watertight") {
+	options.intersector = mesh_bvh_t::options_t::WATERTIGHT;
+      }
+      else if (std::string(optarg) == "bw") {
+	options.intersector = mesh_bvh_t::options_t::BALDWIN_WEBER;
+      }
+      break;
+    case 'z':
+      if (atoi(optarg) < 0) {
+	std::cerr << "Patch size must not be negative" << std::endl;
+	return 1;
+      }
+      patch_size = atoi(optarg);
+      break;
+    case 'o':
+      if (std::string(optarg) == "scanline") {
+	ordering = film_t::SCANLINE;
+      }
+      else if (std::string(optarg) == "spiral") {
+	ordering = film_t::SPIRAL;
+      }
+      break;
+    case 'r':
+      if (sscanf(optarg, "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+	std::cerr << "Resolution must be given as WIDTHxHEIGHT, e.g. 1920x1080" << std::endl;
+	return 1;
+      }
+      break;
+    case 'e':
+      target_error = atof(optarg);
+      break;
+    case 'n':
+      passes = atoi(optarg);
+      break;
+    case 'l':
+      budget = atof(optarg);
+      break;
+    case 'g':
+      particles = optarg;
+      break;
+    case 'y':
+      radius = atof(optarg);
+      if (radius <= 0.0f) {
+	std::cerr << "Particle radius must be positive" << std::endl;
+	return 1;
+      }
+      break;
+    default:
+      std::cerr
+	<< "usage: " << argv[0] << " [-a sah|sbvh|lbvh] [-d budget] [-j threads] [-P] [-b] [-q] [-c dir] [-s file] [-m] [-u] [-t rays] [-p] [-w width] [-i rays] [-x mt|watertight|bw] [-z size] [-o scanline|hilbert|spiral] [-r WxH] [-e error] [-n passes] [-l seconds] [-g file] [-y radius] scene [samples]"
+	<< std::endl
+	<< "  -a  BVH builder, binned SAH, spatial splits or Morton codes (sah)"
+	<< std::endl
+	<< "  -d  references spatial splits may duplicate, per triangle (0.3)"
+	<< std::endl
+	<< "  -j  number of threads rendering and building the BVH (0 builds serially)"
+	<< std::endl
+	<< "  -P  pin each thread to a core"
+	<< std::endl
+	<< "  -b  report the BVH build speedup against the serial builder"
+	<< std::endl
+	<< "  -q  quantize BVH nodes to 8 bits, compared against full precision with -b"
+	<< std::endl
+	<< "  -c  cache preprocessed scenes in a directory"
+	<< std::endl
+	<< "  -s  write traversal statistics as JSON, needs a build with STATS=1"
+	<< std::endl
+	<< "  -m  add per pixel cost heatmap channels to the image, needs STATS=1"
+	<< std::endl
+	<< "  -u  trace secondary and shadow rays unsorted, e.g. to compare lane fill"
+	<< std::endl
+	<< "  -t  rays below which stream traversal continues rays one by one (8)"
+	<< std::endl
+	<< "  -p  trace camera rays in streams instead of packets"
+	<< std::endl
+	<< "  -w  BVH width, 4, 8 or 16 (widest the processor supports)"
+	<< std::endl
+	<< "  -i  trace incoherent streams ray by ray, with this many interleaved rays in flight"
+	<< std::endl
+	<< "  -x  triangle test, Moeller Trumbore, watertight or Baldwin Weber (mt)"
+	<< std::endl
+	<< "  -z  patch size in pixels, 0 picks one for the number of threads (16)"
+	<< std::endl
+	<< "  -o  order patches are rendered in, rows, Hilbert curve or spiral (hilbert)"
+	<< std::endl
+	<< "  -r  resolution of the image (1024x768)"
+	<< std::endl
+	<< "  -e  sample only pixels above this relative error after the first two passes"
+	<< std::endl
+	<< "  -n  passes of the given samples, with interim images after each (1, 16 with -e)"
+	<< std::endl
+	<< "  -l  seconds passes may take at most, no pass starts that wouldn't fit (0)"
+	<< std::endl
+	<< "  -g  add the points of a PLY point cloud to the scene as spheres"
+	<< std::endl
+	<< "  -y  radius of points without a radius property (0.01)"
+	<< std::endl;
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    std::cerr << "No scene given" << std::endl;
+    return 1;
+  }
+
+  // all stages share one pool of threads, started once for the process
+  thread_pool_t::shared(
+    options.threads > 0 ? options.threads : std::thread::hardware_concurrency(), pin);
 
-  auto film    = film_t::p(new film_t(WIDTH, HEIGHT, samples));
+  auto path    = argv[optind];
+  auto samples = argc > optind+1 ? atoi(argv[optind+1]) : 1;
+
+  // the buffers of a patch are allocated from a fixed amount of memory per
+  // worker, so patches are cut to the samples it holds
+  const auto max_patch_size = film_t::max_patch_size(samples*samples);
+  if (max_patch_size == 0) {
+    std::cerr
+      << "Too many samples per pixel, a patch takes at most "
+      << film_t::MAX_SAMPLES_IN_PATCH << std::endl;
+    return 1;
+  }
+
+  if (patch_size == 0) {
+    patch_size = film_t::auto_patch_size(
+      width, height, samples*samples, std::max(thread_pool_t::shared().size(), 1u));
+    printf("Rendering in patches of %dx%d pixels\n", patch_size, patch_size);
+  }
+  else if (patch_size > max_patch_size) {
+    patch_size = max_patch_size;
+    printf("Patches take too many samples, rendering in patches of %dx%d pixels\n", patch_size, patch_size);
+  }
+
+  auto film    = film_t::p(new film_t(width, height, samples, patch_size, ordering));
   auto pinhole = lenses::pinhole_t::p(new lenses::pinhole_t);
+
+  if (heatmap) {
+#ifdef TRAVERSAL_STATS
+    film->enable_heatmap();
+#else
+    std::cerr << "Heatmaps are disabled, build with STATS=1" << std::endl;
+#endif
+  }
   auto light0  = light_t::p(new light::area_t({0, 2.3f, 0}, surface_t::p(new things::sphere_t(0.05f)), L));
 
   mesh_scene_t scene(stats);
+  scene.accel.options = options;
+
   scene.add(def);
   scene.add(left);
   scene.add(right);
@@ -66,12 +294,33 @@ int main(int argc, char** argv) {
   scene.add(test2);
   scene.add(light0);
 
-  codec::scene::load(path, scene);
+  // particles are not part of the scene file, so they are added before the
+  // cache is looked at, which then builds the hierarchy of the scene
+  if (!particles.empty()) {
+    scene.add(codec::mesh::ply::load_particles(particles, scene.material(0), radius));
+  }
+
+  uint64_t         key = 0;
+  mapped_file_t::p cached;
+
+  if (!cache.empty()) {
+    key    = codec::cache::key(path, options);
+    cached = codec::cache::load(cache, key, scene);
+  }
+
+  if (!cached) {
+    const auto files = codec::scene::load(path, scene);
 
-  printf("Preprocessing geometry\n");
-  scene.preprocess();
+    printf("Preprocessing geometry\n");
+    scene.preprocess();
+
+    if (!cache.empty()) {
+      codec::cache::save(cache, key, scene, files);
+    }
+  }
 
   pinhole_camera_t::p camera(new pinhole_camera_t(film, pinhole, stats));
+  camera->sort_rays = sort_rays;
   camera->look_at({0, 1.25f, -3.8}, {0,1.25f,0});
 
   auto done = false;
@@ -82,9 +331,12 @@ int main(int argc, char** argv) {
       usleep(1000000);
       timeval now;
       gettimeofday(&now, 0);
-      auto progress = (((float)stats->areas / (float)film->num_patches) * 100.0f);
+      // of the current pass, adaptive passes only hold some patches
+      const uint32_t patches = stats->patches;
+      auto progress = patches > 0 ? (((float)stats->areas / (float)patches) * 100.0f) : 100.0f;
       std::cout
-	<< "\rprogess: " << progress
+	<< "\rpass: " << stats->pass
+	<< ", progess: " << progress
 	<< ", rays/s: " << stats->rays / (now.tv_sec - start.tv_sec)
 	<< std::flush;
     }
@@ -96,7 +348,22 @@ int main(int argc, char** argv) {
   timeval start, end;
   gettimeofday(&start, 0);
 
-  camera->snapshot(scene);
+  if (passes == 0 && budget == 0.0f) {
+    passes = target_error > 0.0f ? 16 : 1;
+  }
+
+  if (passes != 1 || budget > 0.0f) {
+    // progressive rendering, the image is written after every pass
+    codec::image::exr::background_t interim("out.exr");
+
+    film->enable_adaptive(target_error);
+    camera->render(scene, passes, budget, [&](uint32_t) {
+      interim.save(film);
+    });
+  }
+  else {
+    camera->snapshot(scene);
+  }
   done = true;
 
   gettimeofday(&end, 0);
@@ -109,6 +376,15 @@ int main(int argc, char** argv) {
 
   codec::image::exr::save("out.exr", film);
 
+  if (!statistics.empty()) {
+#ifdef TRAVERSAL_STATS
+    std::ofstream out(statistics);
+    stats->traversal.json(out);
+#else
+    std::cerr << "Traversal statistics are disabled, build with STATS=1" << std::endl;
+#endif
+  }
+
   std::cout << std::endl << "rendering time: " << time << std::endl;
   std::cout << std::endl << "Phosphoros is Venus" << std::endl;
 
@@ -3,17 +3,51 @@
 #include "util/algo.hpp"
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
 
 struct film_t {
   typedef std::shared_ptr<film_t> p;
 
-  static const uint32_t PATCH_SIZE;
+  /**
+   * The order patches are handed out in. Threads working on patches
+   * next to each other trace rays into the same parts of the scene, and
+   * share more of the hierarchy and textures in the caches. Scanlines
+   * keep neighbours in a row only, a Hilbert curve keeps consecutive
+   * patches next to each other in both directions, and a spiral starts
+   * at the center of the image and keeps the patches in flight on a ring
+   * around it
+   *
+   */
+  enum ordering_t {
+    SCANLINE,
+    HILBERT,
+    SPIRAL
+  };
 
   struct pixel_t {
     color_t  c;
     uint32_t padding;
   };
 
+  // average traversal cost and path depth of the samples of a pixel
+  struct heat_t {
+    float_t  nodes;
+    float_t  primitives;
+    float_t  depth;
+    // samples in the averages so far
+    uint32_t n;
+  };
+
+  // running sums over the samples of a pixel, to estimate its error
+  struct moments_t {
+    color_t  sum;
+    // of the squared luminance
+    float_t  sum2;
+    uint32_t n;
+  };
+
   struct patch_t {
     uint32_t x, y, w, h;
   };
@@ -24,12 +58,18 @@ struct film_t {
   };
 
   struct samples_t {
-    float_t* x;
-    float_t* y;
+    float_t*  x;
+    float_t*  y;
+    // the pixel each sample belongs to
+    uint32_t* pixel;
+    uint32_t  num;
 
-    inline samples_t(allocator_t& a, uint32_t num) {
-      x = new(a) float_t[num];
-      y = new(a) float_t[num];
+    inline samples_t(allocator_t& a, uint32_t num)
+      : num(0)
+    {
+      x     = new(a) float_t[num];
+      y     = new(a) float_t[num];
+      pixel = new(a) uint32_t[num];
     }
   };
 
@@ -42,21 +82,49 @@ struct film_t {
   uint32_t spd;
   uint32_t num_samples;
   uint32_t num_patches;
+  // width and height of a patch in pixels
+  uint32_t patch_size;
+
+  pixel_t*   pixels;
+  // cost heatmap next to the pixels, only allocated in heatmap mode
+  heat_t*    heat;
+  // sample moments next to the pixels, only allocated when the film
+  // takes several passes
+  moments_t* moments;
+  sample_t*  stratified_pattern;
 
-  pixel_t*  pixels;
-  sample_t* stratified_pattern;
+  // relative error below which pixels take no more samples, with 0 all
+  // pixels take samples in every pass
+  float_t  target_error;
+  // passes over the film started so far
+  uint32_t passes;
 
-  std::atomic_int patch;
+  // all patches of the image, in the order they are rendered
+  std::vector<patch_t>  patches;
+  // the patches of the current pass, as indices into patches
+  std::vector<uint32_t> pending;
+  std::atomic_int       patch;
 
-  inline film_t(uint32_t w, uint32_t h, uint32_t spd)
+  inline film_t(
+    uint32_t w
+  , uint32_t h
+  , uint32_t spd
+  , uint32_t patch_size = 16
+  , ordering_t ordering = HILBERT)
     : width(w)
     , height(h)
     , spd(spd)
     , spp(spd*spd)
+    , patch_size(patch_size)
+    , heat(nullptr)
+    , moments(nullptr)
+    , target_error(0.0f)
+    , passes(0)
     , patch(0)
   {
     num_samples = w*h*spp;
-    num_patches = (w/PATCH_SIZE)*(h/PATCH_SIZE);
+
+    order_patches(ordering);
 
     ratio = (float_t) width / (float_t) height;
     stepx = 1.0f/width;
@@ -75,36 +143,241 @@ struct film_t {
     pixels = new pixel_t[w*h];
   }
 
+  /**
+   * Start the next pass over the film, and hand out its patches from the
+   * first one. In adaptive mode a pass only holds the patches with pixels
+   * above the target error. Returns the number of patches in the pass
+   *
+   */
+  inline uint32_t rewind() {
+    if (passes > 0) {
+      // jitter the samples again, so passes don't repeat the camera rays
+      sampling::strategies::stratified_2d(stratified_pattern, spd);
+    }
+
+    pending.clear();
+    for (auto i=0; i<patches.size(); ++i) {
+      if (needs_samples(patches[i])) {
+	pending.push_back(i);
+      }
+    }
+
+    ++passes;
+    patch = 0;
+    return pending.size();
+  }
+
   inline bool next_patch(patch_t& out) {
     auto p = patch++;
-    if (p < num_patches) {
-      out.x = (p * PATCH_SIZE) % width;
-      out.y = ((p * PATCH_SIZE) / width) * PATCH_SIZE;
-      out.w = PATCH_SIZE;
-      out.h = PATCH_SIZE;
-
+    if (p < pending.size()) {
+      out = patches[pending[p]];
       return true;
     }
     return false;
   }
 
+  /**
+   * Keep the mean of all samples of each pixel, so passes accumulate into
+   * the pixels, and the film can be looked at between them
+   *
+   */
+  inline void enable_progressive() {
+    if (!moments) {
+      moments = new moments_t[width*height]();
+    }
+  }
+
+  /**
+   * Keep the mean and variance of each pixel, so passes after the first
+   * two only sample pixels whose relative error is above 'target'
+   *
+   */
+  inline void enable_adaptive(float_t target) {
+    enable_progressive();
+    target_error = target;
+  }
+
+  /**
+   * The standard error of the mean luminance of a pixel, relative to the
+   * mean. Dark pixels are measured against a floor, so noise in black
+   * areas doesn't keep them sampling forever
+   *
+   */
+  inline float_t error(uint32_t pixel) const {
+    const auto& m = moments[pixel];
+    if (m.n < 2) {
+      return std::numeric_limits<float_t>::max();
+    }
+
+    const auto mean     = m.sum.y() / m.n;
+    const auto variance = std::max(0.0f, (m.sum2 / m.n - square(mean)) * m.n / (m.n - 1));
+    return std::sqrt(variance / m.n) / std::max(mean, 0.01f);
+  }
+
+  // every pixel takes samples in the first two passes
+  inline bool needs_samples(uint32_t pixel) const {
+    return
+      target_error == 0.0f || moments[pixel].n < 2*spp || error(pixel) > target_error;
+  }
+
+  inline bool needs_samples(const patch_t& patch) const {
+    for (auto y=patch.y; y<patch.y+patch.h; ++y) {
+      for (auto x=patch.x; x<patch.x+patch.w; ++x) {
+	if (needs_samples(y*width+x)) {
+	  return true;
+	}
+      }
+    }
+    return false;
+  }
+
+  // samples of a patch, so the buffers of its paths fit into the memory
+  // of a worker
+  static const uint32_t MAX_SAMPLES_IN_PATCH = 16384;
+
+  /**
+   * The largest patch size, whose samples fit into a patch. 0 if not even
+   * the samples of a single pixel fit
+   *
+   */
+  static inline uint32_t max_patch_size(uint32_t spp) {
+    uint32_t size = 0;
+    while (square(size+1) * std::max(spp, 1u) <= MAX_SAMPLES_IN_PATCH) {
+      ++size;
+    }
+    return size;
+  }
+
+  /**
+   * Pick a patch size for rendering on a number of threads. Patches are
+   * as large as possible, so their streams hold many coherent rays, as
+   * long as each thread gets at least 8 patches to balance the load, and
+   * a patch needs no more than 64 streams of samples
+   *
+   */
+  static inline uint32_t auto_patch_size(
+    uint32_t w
+  , uint32_t h
+  , uint32_t spp
+  , uint32_t threads)
+  {
+    uint32_t size = 64;
+    while (size > 8) {
+      const auto num = ((w + size-1) / size) * ((h + size-1) / size);
+      if (num >= 8*std::max(threads, 1u) && square(size)*spp <= MAX_SAMPLES_IN_PATCH) {
+	break;
+      }
+      size /= 2;
+    }
+    return std::min(size, max_patch_size(spp));
+  }
+
+  /**
+   * Index of tile (x, y) along a Hilbert curve through a grid of n by n
+   * tiles, n a power of 2
+   *
+   */
+  static inline uint32_t hilbert(uint32_t n, uint32_t x, uint32_t y) {
+    uint32_t d = 0;
+    for (auto s=n/2; s>0; s/=2) {
+      const uint32_t rx = (x & s) > 0;
+      const uint32_t ry = (y & s) > 0;
+      d += s * s * ((3 * rx) ^ ry);
+
+      // rotate the quadrant, so the curve continues where it left off
+      if (ry == 0) {
+	if (rx == 1) {
+	  x = n-1 - x;
+	  y = n-1 - y;
+	}
+	std::swap(x, y);
+      }
+    }
+    return d;
+  }
+
+  /**
+   * Cover the film with patches, in the given order. Patches on the right
+   * and bottom edge are cut to the film, if its size is not a multiple of
+   * the patch size
+   *
+   */
+  inline void order_patches(ordering_t ordering) {
+    const auto nx = (width + patch_size-1) / patch_size;
+    const auto ny = (height + patch_size-1) / patch_size;
+
+    uint32_t n = 1;
+    while (n < std::max(nx, ny)) {
+      n *= 2;
+    }
+
+    struct keyed_t {
+      float_t major, minor;
+      patch_t patch;
+    };
+
+    std::vector<keyed_t> keyed;
+    for (auto y=0; y<ny; ++y) {
+      for (auto x=0; x<nx; ++x) {
+	keyed_t k = {
+	  (float_t) (y*nx+x), 0.0f,
+	  {
+	    x*patch_size, y*patch_size,
+	    std::min(patch_size, width - x*patch_size),
+	    std::min(patch_size, height - y*patch_size)
+	  }
+	};
+
+	if (ordering == HILBERT) {
+	  k.major = hilbert(n, x, y);
+	}
+	else if (ordering == SPIRAL) {
+	  // rings of tiles around the center, each walked around by angle
+	  const auto dx = (x + 0.5f) - nx * 0.5f;
+	  const auto dy = (y + 0.5f) - ny * 0.5f;
+	  k.major = std::floor(std::max(std::fabs(dx), std::fabs(dy)));
+	  k.minor = std::atan2(dy, dx);
+	}
+	keyed.push_back(k);
+      }
+    }
+
+    std::sort(keyed.begin(), keyed.end(), [](const keyed_t& a, const keyed_t& b) {
+      return a.major < b.major || (a.major == b.major && a.minor < b.minor);
+    });
+
+    patches.clear();
+    for (const auto& k: keyed) {
+      patches.push_back(k.patch);
+    }
+    num_patches = patches.size();
+  }
+
+  // the samples of the pixels in a patch that need samples
   inline void sample_film(const patch_t& patch, samples_t& out) const {
     auto j=0;
     for (auto y=patch.y; y<patch.y+patch.h; ++y) {
       const auto ndcy = 0.5f - y * stepy;
 
       for (auto x=patch.x; x<patch.x+patch.w; ++x) {
-	const auto ndcx = (-0.5f + x * stepx) * ratio;
+	const auto ndcx  = (-0.5f + x * stepx) * ratio;
+	const auto pixel = y*width+x;
+
+	if (!needs_samples(pixel)) {
+	  continue;
+	}
 
 	for (auto i=0; i<spp; ++i, ++j) {
 	  const auto sx = stratified_pattern[i].u - 0.5f;
 	  const auto sy = stratified_pattern[i].v - 0.5f;
 
-	  out.x[j]  = ndcx + stepx * sx;
-	  out.y[j]  = ndcy + stepy * sy;
+	  out.x[j]     = ndcx + stepx * sx;
+	  out.y[j]     = ndcy + stepy * sy;
+	  out.pixel[j] = pixel;
 	}
       }
     }
+    out.num = j;
   }
 
   inline void filter(color_t& c, const splat_t& splat) const {
@@ -115,27 +388,76 @@ struct film_t {
     */
   }
 
+  // samples of the largest patch
   inline uint32_t num_splats() const {
-    return square(PATCH_SIZE) * spp;
+    return square(patch_size) * spp;
+  }
+
+  inline uint32_t num_splats(const patch_t& patch) const {
+    return patch.w * patch.h * spp;
   }
 
+  /**
+   * Add the splats to their pixels. Films taking several passes hold the
+   * mean of all samples of a pixel so far, since passes may end early,
+   * and pixels may take different numbers of samples
+   *
+   */
   inline void apply_splats(
     const patch_t& patch
   , const samples_t& samples
   , splat_t* const splats)
   {
-    auto s = splats;
-    for (auto y=patch.y; y<patch.y+patch.h; ++y) {
-      for (auto x=patch.x; x<patch.x+patch.w; ++x) {
-	auto pixel = y*width+x;
+    for (auto i=0; i<samples.num; ++i) {
+      const auto pixel = samples.pixel[i];
 
-	for (auto i=0; i<spp; ++i, ++s) {
-	  color_t c;
-	  filter(c, *s);
+      color_t c;
+      filter(c, splats[i]);
 
-	  pixels[pixel].c += c.scale(1.0f/spp);
-	}
+      if (moments) {
+	auto& m = moments[pixel];
+	m.sum  += c;
+	m.sum2 += square(c.y());
+	m.n++;
+
+	pixels[pixel].c = color_t(m.sum).scale(1.0f/m.n);
       }
+      else {
+	pixels[pixel].c += c.scale(1.0f/spp);
+      }
+    }
+  }
+
+  inline void enable_heatmap() {
+    if (!heat) {
+      heat = new heat_t[width*height]();
+    }
+  }
+
+  /**
+   * Accumulate the traversal cost of the paths and shadow rays of all
+   * samples in a patch, which are stored in the same order as splats.
+   * Pixels hold the mean over all their samples so far, so pixels taking
+   * more samples or passes don't look more costly
+   *
+   */
+  template<typename Segment, typename Shadow>
+  inline void apply_heat(
+    const samples_t& samples
+  , const Segment* const segments
+  , const Shadow* const shadows)
+  {
+    for (auto i=0; i<samples.num; ++i) {
+      auto& h = heat[samples.pixel[i]];
+
+      const auto nodes      = (float_t) (segments[i].nodes + shadows[i].nodes);
+      const auto primitives = (float_t) (segments[i].primitives + shadows[i].primitives);
+      const auto depth      = (float_t) segments[i].depth;
+
+      const auto w = 1.0f/++h.n;
+      h.nodes      += (nodes - h.nodes) * w;
+      h.primitives += (primitives - h.primitives) * w;
+      h.depth      += (depth - h.depth) * w;
     }
   }
 
@@ -29,6 +29,12 @@ struct single_path_t {
     tagent_spaces = new(a) invertible_base_t[n];
   }
 
+  /**
+   * Sample a point on a light source for every path vertex, and set up
+   * the shadow rays towards them in 'shadows'. The caller traces them,
+   * so shadow rays of many streams can be traced together
+   *
+   */
   template<typename Scene>
   inline void sample_lights(
     const Scene& scene
@@ -67,9 +73,12 @@ struct single_path_t {
 
 	new(ts+index) invertible_base_t(segment.n);
       }
+      else {
+	// paths that left the scene cast no shadow ray. the query is left
+	// from an earlier patch, which may have used the memory differently
+	shadows[index].mask();
+      }
     }
-
-    scene.occluded(shadows, active);
   }
 
   template<typename Scene, typename Splat>
@@ -55,6 +55,10 @@ struct aabb_t {
     return min.v[axis] == max.v[axis];
   }
 
+  inline bool valid() const {
+    return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+  }
+
 #ifdef DOUBLE_PRECISION
   inline bool intersect(const ray_t& ray, const float_t* const ood, float_t& t) const {
     static const float_t g = std::tgamma(3.0);
@@ -156,6 +160,15 @@ namespace bounds {
     return out;
   }
 
+  inline aabb_t clip(const aabb_t& l, const aabb_t& r) {
+    aabb_t out;
+    for (auto i=0; i<3; ++i) {
+      out.min.v[i] = std::max(l.min.v[i], r.min.v[i]);
+      out.max.v[i] = std::min(l.max.v[i], r.max.v[i]);
+    }
+    return out;
+  }
+
   inline vector_t offset(const aabb_t& l, const vector_t& r) {
     auto o = r - l.min;
     if (l.max.x > l.min.x) { o.x /= (l.max.x - l.min.x); } 
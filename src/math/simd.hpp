@@ -2,9 +2,18 @@
 
 #include "simd/float4.hpp"
 #include "simd/float8.hpp"
+#include "simd/float16.hpp"
 #include "simd/vector4.hpp"
 #include "simd/vector8.hpp"
+#include "simd/vector16.hpp"
 
+/**
+ * The types of each SIMD width. Four lanes need SSE4, eight lanes AVX2
+ * and sixteen lanes AVX-512. The wider types are compiled for their
+ * instruction set in every object, so code using a width has to be
+ * compiled for it too, e.g. between TARGET_BEGIN and TARGET_END
+ *
+ */
 template<int Width>
 struct simd_t {
 };
@@ -13,10 +22,58 @@ template<>
 struct simd_t<4>{
   typedef float4_t  float_t;
   typedef vector4_t vector_t;
+
+  static inline float_t load(float v) {
+    return float4::load(v);
+  }
+
+  static inline float_t load(const float* const v) {
+    return float4::load(v);
+  }
 };
 
+TARGET_BEGIN(AVX2_TARGET)
 template<>
 struct simd_t<8>{
   typedef float8_t  float_t;
   typedef vector8_t vector_t;
+
+  static inline float_t load(float v) {
+    return float8::load(v);
+  }
+
+  static inline float_t load(const float* const v) {
+    return float8::load(v);
+  }
+};
+TARGET_END
+
+TARGET_BEGIN(AVX512_TARGET)
+template<>
+struct simd_t<16>{
+  typedef float16_t  float_t;
+  typedef vector16_t vector_t;
+
+  static inline float_t load(float v) {
+    return float16::load(v);
+  }
+
+  static inline float_t load(const float* const v) {
+    return float16::load(v);
+  }
 };
+TARGET_END
+
+/**
+ * All other operations are overloaded on the types, so width independent
+ * code calls them through this namespace
+ *
+ */
+namespace simd {
+  using namespace float4;
+  using namespace vector4;
+  using namespace float8;
+  using namespace vector8;
+  using namespace float16;
+  using namespace vector16;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "util/compiler.hpp"
+
+#include <immintrin.h>
+
+TARGET_BEGIN(AVX512_TARGET)
+
+typedef __m512 float16_t;
+
+/**
+ * Comparisons return lanes with all bits set, like the narrower types,
+ * rather than mask registers. Code written against the narrower types
+ * then works unchanged on sixteen lanes
+ *
+ */
+namespace float16 {
+  inline float16_t load(float v) {
+    return _mm512_set1_ps(v);
+  }
+
+  inline float16_t load(
+    float a, float b, float c, float d, float e, float f, float g, float h,
+    float i, float j, float k, float l, float m, float n, float o, float p) {
+    return _mm512_set_ps(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p);
+  }
+
+  inline float16_t load(const float* const v) {
+    return _mm512_load_ps(v);
+  }
+
+  inline void store(const float16_t& l, float* mem) {
+    _mm512_store_ps(mem, l);
+  }
+
+  inline float16_t msub(const float16_t& a, const float16_t& b, const float16_t& c) {
+    return _mm512_fmsub_ps(a, b, c);
+  }
+
+  inline float16_t madd(const float16_t& a, const float16_t& b, const float16_t& c) {
+    return _mm512_fmadd_ps(a, b, c);
+  }
+
+  inline float16_t add(const float16_t& l, const float16_t& r) {
+    return _mm512_add_ps(l, r);
+  }
+
+  inline float16_t sub(const float16_t& l, const float16_t& r) {
+    return _mm512_sub_ps(l, r);
+  }
+
+  inline float16_t mul(const float16_t& l, const float16_t& r) {
+    return _mm512_mul_ps(l, r);
+  }
+
+  inline float16_t div(const float16_t& l, const float16_t& r) {
+    return _mm512_div_ps(l, r);
+  }
+
+  inline float16_t sqrt(const float16_t& x) {
+    return _mm512_sqrt_ps(x);
+  }
+
+  inline float16_t min(const float16_t& l, const float16_t& r) {
+    return _mm512_min_ps(l, r);
+  }
+
+  inline float16_t max(const float16_t& l, const float16_t& r) {
+    return _mm512_max_ps(l, r);
+  }
+
+  inline float16_t mask(__mmask16 m) {
+    return _mm512_castsi512_ps(_mm512_maskz_set1_epi32(m, -1));
+  }
+
+  inline float16_t lt(const float16_t& l, const float16_t& r) {
+    return mask(_mm512_cmp_ps_mask(l, r, _CMP_LT_OS));
+  }
+
+  inline float16_t lte(const float16_t& l, const float16_t& r) {
+    return mask(_mm512_cmp_ps_mask(l, r, _CMP_LE_OS));
+  }
+
+  inline float16_t gt(const float16_t& l, const float16_t& r) {
+    return mask(_mm512_cmp_ps_mask(l, r, _CMP_GT_OS));
+  }
+
+  inline float16_t gte(const float16_t& l, const float16_t& r) {
+    return mask(_mm512_cmp_ps_mask(l, r, _CMP_GE_OS));
+  }
+
+  inline float16_t mor(const float16_t l, const float16_t& r) {
+    return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(l), _mm512_castps_si512(r)));
+  }
+
+  inline float16_t mand(const float16_t l, const float16_t& r) {
+    return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(l), _mm512_castps_si512(r)));
+  }
+
+  inline float16_t andnot(const float16_t l, const float16_t& r) {
+    return _mm512_castsi512_ps(_mm512_andnot_si512(_mm512_castps_si512(l), _mm512_castps_si512(r)));
+  }
+
+  inline size_t movemask(const float16_t& mask) {
+    return _mm512_cmplt_epi32_mask(_mm512_castps_si512(mask), _mm512_setzero_si512());
+  }
+
+  inline float16_t select(const float16_t& m, const float16_t& l, const float16_t& r) {
+    return _mm512_mask_blend_ps(movemask(m), l, r);
+  }
+
+  inline float16_t rcp(const float16_t& x) {
+    return _mm512_rcp14_ps(x);
+  }
+}
+
+TARGET_END
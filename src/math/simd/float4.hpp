@@ -78,6 +78,10 @@ namespace float4 {
     return _mm_div_ps(l, r);
   }
 
+  inline float4_t sqrt(const float4_t& x) {
+    return _mm_sqrt_ps(x);
+  }
+
   inline float4_t min(const float4_t& l, const float4_t& r) {
     return _mm_min_ps(l, r);
   }
@@ -110,6 +114,14 @@ namespace float4 {
     return _mm_and_ps(l, r);
   }
 
+  inline float4_t andnot(const float4_t l, const float4_t& r) {
+    return _mm_andnot_ps(l, r);
+  }
+
+  inline float4_t select(const float4_t& m, const float4_t& l, const float4_t& r) {
+    return _mm_blendv_ps(l, r, m);
+  }
+
   inline size_t movemask(const float4_t& mask) {
     return _mm_movemask_ps(mask);
   }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "bool4.hpp"
+#include "util/compiler.hpp"
 
 #include <limits>
 
@@ -20,6 +21,8 @@ namespace float8 {
 
 //#if defined(__AVX__)
 
+TARGET_BEGIN(AVX2_TARGET)
+
 typedef __m256 float8_t;
 
 namespace float8 {
@@ -35,6 +38,11 @@ namespace float8 {
     return _mm256_load_ps(v);
   }
 
+  // convert eight unsigned bytes to floats
+  inline float8_t load(const uint8_t* const v) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) v)));
+  }
+
   inline void store(const float8_t& l, float* mem) {
     _mm256_store_ps(mem, l);
   }
@@ -63,6 +71,10 @@ namespace float8 {
     return _mm256_div_ps(l, r);
   }
 
+  inline float8_t sqrt(const float8_t& x) {
+    return _mm256_sqrt_ps(x);
+  }
+
   inline float8_t min(const float8_t& l, const float8_t& r) {
     return _mm256_min_ps(l, r);
   }
@@ -112,6 +124,8 @@ namespace float8 {
   }
 }
 
+TARGET_END
+
 //#else
 //#error "No streaming float type defined"
 //#endif
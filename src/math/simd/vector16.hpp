@@ -0,0 +1,90 @@
+#pragma once
+
+#include "float16.hpp"
+#include "../vector.hpp"
+
+TARGET_BEGIN(AVX512_TARGET)
+
+struct vector16_t {
+  float16_t x, y, z;
+
+  inline vector16_t()
+  {}
+
+  inline vector16_t(const vector16_t& cpy)
+    : x(cpy.x), y(cpy.y), z(cpy.z)
+  {}
+
+  inline vector16_t(const vector_t& v) {
+    x = float16::load(v.x);
+    y = float16::load(v.y);
+    z = float16::load(v.z);
+  }
+
+  inline vector16_t(const vector_t v[16]) {
+    x = float16::load(
+      v[ 0].x, v[ 1].x, v[ 2].x, v[ 3].x, v[ 4].x, v[ 5].x, v[ 6].x, v[ 7].x,
+      v[ 8].x, v[ 9].x, v[10].x, v[11].x, v[12].x, v[13].x, v[14].x, v[15].x);
+    y = float16::load(
+      v[ 0].y, v[ 1].y, v[ 2].y, v[ 3].y, v[ 4].y, v[ 5].y, v[ 6].y, v[ 7].y,
+      v[ 8].y, v[ 9].y, v[10].y, v[11].y, v[12].y, v[13].y, v[14].y, v[15].y);
+    z = float16::load(
+      v[ 0].z, v[ 1].z, v[ 2].z, v[ 3].z, v[ 4].z, v[ 5].z, v[ 6].z, v[ 7].z,
+      v[ 8].z, v[ 9].z, v[10].z, v[11].z, v[12].z, v[13].z, v[14].z, v[15].z);
+  }
+
+  inline vector16_t(const float16_t& x, const float16_t& y, const float16_t& z)
+    : x(x), y(y), z(z)
+  {}
+
+  inline vector16_t& operator=(const vector16_t& r) {
+    x = r.x; y = r.y; z =r.z;
+    return *this;
+  }
+};
+
+namespace vector16 {
+  using namespace float16;
+
+  inline vector16_t add(const vector16_t& l, const vector16_t& r) {
+    vector16_t out = {
+      float16::add(l.x, r.x),
+      float16::add(l.y, r.y),
+      float16::add(l.z, r.z)
+    };
+    return out;
+  }
+
+  inline vector16_t sub(const vector16_t& l, const vector16_t& r) {
+    vector16_t out = {
+      float16::sub(l.x, r.x),
+      float16::sub(l.y, r.y),
+      float16::sub(l.z, r.z)
+    };
+    return out;
+  }
+
+  inline vector16_t mul(const vector16_t& l, const vector16_t& r) {
+    vector16_t out = {
+      float16::mul(l.x, r.x),
+      float16::mul(l.y, r.y),
+      float16::mul(l.z, r.z)
+    };
+    return out;
+  }
+
+  inline float16_t dot(const vector16_t& l, const vector16_t& r) {
+    return madd(l.x, r.x, madd(l.y, r.y, float16::mul(l.z, r.z)));
+  }
+
+  inline vector16_t cross(const vector16_t& l, const vector16_t& r) {
+    vector16_t out = {
+      msub(l.y, r.z, float16::mul(l.z, r.y)),
+      msub(l.z, r.x, float16::mul(l.x, r.z)),
+      msub(l.x, r.y, float16::mul(l.y, r.x))
+    };
+    return out;
+  }
+}
+
+TARGET_END
@@ -28,6 +28,11 @@ struct vector4_t {
   inline vector4_t(const float4_t& x, const float4_t& y, const float4_t& z)
     : x(x), y(y), z(z)
   {}
+
+  inline vector4_t& operator=(const vector4_t& r) {
+    x = r.x; y = r.y; z =r.z;
+    return *this;
+  }
 };
 
 namespace vector4 {
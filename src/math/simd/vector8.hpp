@@ -3,6 +3,8 @@
 #include "float8.hpp"
 #include "../vector.hpp"
 
+TARGET_BEGIN(AVX2_TARGET)
+
 struct vector8_t {
   float8_t x, y, z;
 
@@ -84,3 +86,5 @@ namespace vector8 {
 #error "No SIMD implementation for vector8_t available"
 #endif
 }
+
+TARGET_END
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "vector.hpp"
+
+/**
+ * An affine transformation, stored as the upper three rows of a 4x4
+ * matrix
+ *
+ */
+struct transform_t {
+  float_t m[3][4];
+
+  inline transform_t()
+    : m{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} }
+  {}
+
+  inline transform_t(const float_t rows[12]) {
+    for (auto i=0; i<3; ++i) {
+      for (auto j=0; j<4; ++j) {
+	m[i][j] = rows[i*4+j];
+      }
+    }
+  }
+
+  inline vector_t point(const vector_t& p) const {
+    return vector_t(
+      m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+      m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+      m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+  }
+
+  inline vector_t vector(const vector_t& v) const {
+    return vector_t(
+      m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+      m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+      m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+  }
+
+  /**
+   * Transform a normal by the transposed linear part of the matrix.
+   * Applied to the inverse of a transformation, this maps normals into
+   * the space the transformation maps points into
+   *
+   */
+  inline vector_t normal(const vector_t& n) const {
+    return vector_t(
+      m[0][0]*n.x + m[1][0]*n.y + m[2][0]*n.z,
+      m[0][1]*n.x + m[1][1]*n.y + m[2][1]*n.z,
+      m[0][2]*n.x + m[1][2]*n.y + m[2][2]*n.z);
+  }
+
+  // the bounds of the transformed corners of 'b'
+  inline aabb_t bounds(const aabb_t& b) const {
+    aabb_t out;
+    for (auto i=0; i<8; ++i) {
+      vector_t corner(
+	(i & 1) ? b.max.x : b.min.x,
+	(i & 2) ? b.max.y : b.min.y,
+	(i & 4) ? b.max.z : b.min.z);
+      ::bounds::merge(out, point(corner));
+    }
+    return out;
+  }
+
+  inline transform_t inverse() const {
+    transform_t out;
+
+    // inverse of the linear part from its cofactors
+    auto det =
+      m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1]) -
+      m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0]) +
+      m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    auto ood = 1.0f / det;
+
+    out.m[0][0] = (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * ood;
+    out.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * ood;
+    out.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * ood;
+    out.m[1][0] = (m[1][2]*m[2][0] - m[1][0]*m[2][2]) * ood;
+    out.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * ood;
+    out.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * ood;
+    out.m[2][0] = (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * ood;
+    out.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * ood;
+    out.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * ood;
+
+    // and the translation moved back by the inverted linear part
+    auto t = out.vector(vector_t(m[0][3], m[1][3], m[2][3]));
+    out.m[0][3] = -t.x;
+    out.m[1][3] = -t.y;
+    out.m[2][3] = -t.z;
+
+    return out;
+  }
+};
+
+inline transform_t operator*(const transform_t& l, const transform_t& r) {
+  transform_t out;
+  for (auto i=0; i<3; ++i) {
+    for (auto j=0; j<4; ++j) {
+      out.m[i][j] =
+	l.m[i][0]*r.m[0][j] +
+	l.m[i][1]*r.m[1][j] +
+	l.m[i][2]*r.m[2][j] +
+	(j == 3 ? l.m[i][3] : 0.0f);
+    }
+  }
+  return out;
+}
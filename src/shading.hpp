@@ -29,14 +29,22 @@ struct segment_t {
   vector_t  wo; // 80
   float_t   s;
   float_t   t;
+  uint32_t  instance;
+  // nodes and primitives tested along the path, counted in builds with
+  // TRAVERSAL_STATS
+  uint32_t  nodes;
+  uint32_t  primitives;
   // TODO: ray differentials, light contribution
-  char     padding[40];
+  char     padding[28];
 
   inline segment_t()
     : beta(1.0f)
     , d(std::numeric_limits<float>::max())
+    , mesh(0)
     , flags((uint8_t) ALIVE)
     , depth(0)
+    , nodes(0)
+    , primitives(0)
   {}
 
   inline void kill() {
@@ -67,16 +75,26 @@ struct segment_t {
     return false;
   }
 
+  // camera rays of a patch start at the same point into similar
+  // directions, and are traced in the order they were generated
+  inline bool coherent() const {
+    return depth == 0;
+  }
+
   inline void follow() {
     p = p + d * wi;
     d = std::numeric_limits<float>::max();
   }
 
   inline void shading(float u, float v, uint32_t m, uint32_t f) {
-    u    = u;
-    v    = v;
-    mesh = m;
-    face = f;
+    this->u = u;
+    this->v = v;
+    mesh    = m;
+    face    = f;
+  }
+
+  inline void instanced(uint32_t id) {
+    instance = id;
   }
 };
 
@@ -90,12 +108,16 @@ struct occlusion_query_t {
   uint32_t flags; // 32
   color_t  e;     // 44
   float    pdf;   // 48
+  uint32_t nodes;      // 52
+  uint32_t primitives; // 56
 
-  char padding[16]; // pad to 64 bytes
+  char padding[8]; // pad to 64 bytes
 
   occlusion_query_t()
     : d(std::numeric_limits<float>::max())
     , flags(0)
+    , nodes(0)
+    , primitives(0)
   {}
 
   inline void mask() {
@@ -134,8 +156,15 @@ struct occlusion_query_t {
     return is_hit() | masked();
   }
 
+  inline constexpr bool coherent() const {
+    return false;
+  }
+
   inline void shading(float u, float v, uint32_t m, uint32_t f)
   {}
+
+  inline void instanced(uint32_t id)
+  {}
 };
 
 struct active_t {
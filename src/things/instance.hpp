@@ -0,0 +1,58 @@
+#pragma once
+
+#include "mesh.hpp"
+#include "particles.hpp"
+#include "math/transform.hpp"
+#include "traversal/bvh.hpp"
+
+/**
+ * A placement of a mesh or of particles in the scene. All instances of a
+ * mesh share its vertices and its bottom level hierarchy, which is built
+ * in object space. Instances of particles share their hierarchy over
+ * spheres the same way
+ *
+ */
+struct instance_t {
+  typedef instance_t* p;
+
+  uint32_t id;
+
+  // the instanced mesh, or nullptr for the instance of all meshes, that
+  // are not instanced
+  mesh_t::p mesh;
+
+  // the instanced particles, or nullptr for instances of meshes
+  particles_t::p particles;
+
+  // the bottom level hierarchy of the mesh or of the particles, set when
+  // the scene is preprocessed
+  const mesh_bvh_t*   bvh;
+  const sphere_bvh_t* spheres;
+
+  transform_t to_world;
+  transform_t to_object;
+
+  inline instance_t(const mesh_t::p& mesh, const transform_t& t)
+    : id(0)
+    , mesh(mesh)
+    , particles(nullptr)
+    , bvh(nullptr)
+    , spheres(nullptr)
+    , to_world(t)
+    , to_object(t.inverse())
+  {}
+
+  inline instance_t(const particles_t::p& particles, const transform_t& t)
+    : id(0)
+    , mesh(nullptr)
+    , particles(particles)
+    , bvh(nullptr)
+    , spheres(nullptr)
+    , to_world(t)
+    , to_object(t.inverse())
+  {}
+
+  inline aabb_t bounds() const {
+    return to_world.bounds(spheres ? spheres->bounds() : bvh->bounds());
+  }
+};
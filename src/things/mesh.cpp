@@ -1,11 +1,11 @@
 #include "mesh.hpp"
 #include "shading.hpp"
 
-std::vector<vector_t> mesh_t::vertices;
-std::vector<vector_t> mesh_t::normals;
-std::vector<float_t>  mesh_t::u;
-std::vector<float_t>  mesh_t::v;
-std::vector<uint32_t> mesh_t::faces;
+buffer_t<vector_t> mesh_t::vertices;
+buffer_t<vector_t> mesh_t::normals;
+buffer_t<float_t>  mesh_t::u;
+buffer_t<float_t>  mesh_t::v;
+buffer_t<uint32_t> mesh_t::faces;
 
 mesh_t::mesh_t(const material_t::p& m)
   : index_vertices(vertices.size())
@@ -5,6 +5,7 @@
 #include "triangle.hpp"
 #include "material.hpp"
 #include "shading.hpp"
+#include "util/buffer.hpp"
 
 #include <algorithm>
 
@@ -17,11 +18,11 @@ struct mesh_t : public thing_t {
 
   // global buffers for mesh data. we can definetely do better here but this
   // is as simple a pool as it gets for now
-  static std::vector<vector_t> vertices;
-  static std::vector<vector_t> normals;
-  static std::vector<float_t>  u;
-  static std::vector<float_t>  v;
-  static std::vector<uint32_t> faces;
+  static buffer_t<vector_t> vertices;
+  static buffer_t<vector_t> normals;
+  static buffer_t<float_t>  u;
+  static buffer_t<float_t>  v;
+  static buffer_t<uint32_t> faces;
 
   uint32_t id;
   
@@ -0,0 +1,24 @@
+#include "particles.hpp"
+
+void particles_t::spheres(std::vector<sphere_t::p>& out) const {
+  for (auto i=0; i<size(); ++i) {
+    out.emplace_back(new sphere_t(this, i));
+  }
+}
+
+sphere_t::sphere_t(const particles_t* p, uint32_t id)
+  : particles(p), id(id)
+{}
+
+aabb_t sphere_t::bounds() const {
+  const auto r = vector_t(radius());
+  return aabb_t(center() - r, center() + r);
+}
+
+const vector_t& sphere_t::center() const {
+  return particles->centers[id];
+}
+
+float_t sphere_t::radius() const {
+  return particles->radii[id];
+}
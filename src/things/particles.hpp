@@ -0,0 +1,44 @@
+#pragma once
+
+#include "sphere.hpp"
+#include "material.hpp"
+#include "shading.hpp"
+
+#include <vector>
+
+/**
+ * A set of spheres sharing a material, like the particles of a simulation
+ * or the points of a point cloud. Spheres are intersected analytically,
+ * so they don't need to be tesselated into triangles
+ *
+ */
+struct particles_t {
+  typedef particles_t* p;
+
+  uint32_t id;
+
+  std::vector<vector_t> centers;
+  std::vector<float_t>  radii;
+
+  material_t::p material;
+
+  inline particles_t(const material_t::p& m)
+    : id(0), material(m)
+  {}
+
+  inline void add(const vector_t& center, float_t radius) {
+    centers.push_back(center);
+    radii.push_back(radius);
+  }
+
+  inline uint32_t size() const {
+    return centers.size();
+  }
+
+  void spheres(std::vector<sphere_t::p>&) const;
+
+  // the normal at the point 'p' on the sphere of the hit 's'
+  inline vector_t shading_normal(const segment_t& s, const vector_t& p) const {
+    return normalize(p - centers[s.face]);
+  }
+};
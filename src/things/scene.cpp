@@ -1,5 +1,33 @@
 #include "scene.hpp"
 #include "traversal/bvh.hpp"
+#include "util/thread_pool.hpp"
+
+/**
+ * Tesselate the meshes 'include' selects with one task per mesh on the
+ * shared pool. The triangles are appended in the order of the meshes,
+ * so the hierarchy doesn't depend on which task finished first
+ *
+ */
+template<typename F>
+void tesselate(
+  const std::vector<mesh_t::p>& meshes
+, const F& include
+, std::vector<triangle_t::p>& out)
+{
+  std::vector<std::vector<triangle_t::p>> parts(meshes.size());
+  {
+    task_group_t tasks(thread_pool_t::shared());
+    for (auto i=0; i<meshes.size(); ++i) {
+      if (include(meshes[i])) {
+	tasks.spawn([&, i]() { meshes[i]->tesselate(parts[i]); });
+      }
+    }
+  }
+
+  for (auto& part: parts) {
+    out.insert(out.end(), part.begin(), part.end());
+  }
+}
 
 template<typename T>
 scene_impl_t<T>::~scene_impl_t()
@@ -12,6 +40,14 @@ scene_impl_t<T>::~scene_impl_t()
     delete m;
   }
 
+  for (auto& i : instances) {
+    delete i;
+  }
+
+  for (auto& p : particles) {
+    delete p;
+  }
+
   for (auto& m : materials) {
     delete m;
   }
@@ -19,35 +55,163 @@ scene_impl_t<T>::~scene_impl_t()
 
 template<typename T>
 void scene_impl_t<T>::preprocess() {
+  if (!two_level()) {
+    std::vector<triangle_t::p> triangles;
+    tesselate(meshes, [](const mesh_t::p&) { return true; }, triangles);
+
+    accel.build(triangles);
+    return;
+  }
+
+  // build one bottom level hierarchy per instanced mesh and particles,
+  // and one for all remaining meshes and particles each
+  std::vector<const T*>            by_mesh(meshes.size(), nullptr);
+  std::vector<const sphere_bvh_t*> by_particles(particles.size(), nullptr);
+  std::vector<bool>                instanced(meshes.size(), false);
+  std::vector<bool>                instanced_particles(particles.size(), false);
+  for (const auto& instance: instances) {
+    if (instance->particles) {
+      instanced_particles[instance->particles->id] = true;
+    }
+    else {
+      instanced[instance->mesh->id] = true;
+    }
+  }
+
+  bottom.clear();
+  spheres.clear();
+
+  auto make_bottom = [&](const std::vector<triangle_t::p>& triangles) {
+    bottom.emplace_back(new T());
+    bottom.back()->options = accel.options;
+    bottom.back()->build(triangles);
+    return bottom.back().get();
+  };
+
+  auto make_spheres = [&](const std::vector<sphere_t::p>& things) {
+    spheres.emplace_back(new sphere_bvh_t());
+    spheres.back()->options = accel.options;
+    spheres.back()->build(things);
+    return spheres.back().get();
+  };
+
   std::vector<triangle_t::p> triangles;
-  for (const auto& thing: meshes) {
-    thing->tesselate(triangles);
+  tesselate(meshes, [&](const mesh_t::p& mesh) { return !instanced[mesh->id]; }, triangles);
+
+  std::vector<instance_t::p> things(instances);
+
+  remaining.reset();
+  if (!triangles.empty()) {
+    remaining.reset(new instance_t(mesh_t::p(nullptr), transform_t()));
+    remaining->id  = instances.size();
+    remaining->bvh = make_bottom(triangles);
+    things.push_back(remaining.get());
   }
 
-  accel.build(triangles);
+  std::vector<sphere_t::p> particle_spheres;
+  for (const auto& p: particles) {
+    if (!instanced_particles[p->id]) {
+      p->spheres(particle_spheres);
+    }
+  }
+
+  remaining_particles.reset();
+  if (!particle_spheres.empty()) {
+    remaining_particles.reset(new instance_t(particles_t::p(nullptr), transform_t()));
+    remaining_particles->id      = instances.size() + 1;
+    remaining_particles->spheres = make_spheres(particle_spheres);
+    things.push_back(remaining_particles.get());
+  }
+
+  for (auto& instance: instances) {
+    if (instance->particles) {
+      auto& bvh = by_particles[instance->particles->id];
+      if (!bvh) {
+	particle_spheres.clear();
+	instance->particles->spheres(particle_spheres);
+	bvh = make_spheres(particle_spheres);
+      }
+      instance->spheres = bvh;
+      continue;
+    }
+
+    auto& bvh = by_mesh[instance->mesh->id];
+    if (!bvh) {
+      triangles.clear();
+      instance->mesh->tesselate(triangles);
+      bvh = make_bottom(triangles);
+    }
+    instance->bvh = bvh;
+  }
+
+  std::clog
+    << "Built " << bottom.size() + spheres.size() << " bottom level hierarchies for "
+    << instances.size() << " instances"
+    << std::endl;
+
+  top.options = accel.options;
+  top.build(things);
+}
+
+template<typename T>
+void scene_impl_t<T>::refit() {
+  if (!two_level()) {
+    if (!accel.refit(meshes)) {
+      std::clog << "Refitted BVH degraded, rebuilding" << std::endl;
+      preprocess();
+    }
+    return;
+  }
+
+  // particles don't move with the vertices of meshes, so only the
+  // hierarchies over meshes are refitted
+  bool degraded = false;
+  for (auto& bvh: bottom) {
+    degraded |= !bvh->refit(meshes);
+  }
+  degraded |= !top.refit(meshes);
+
+  if (degraded) {
+    std::clog << "Refitted BVH degraded, rebuilding" << std::endl;
+    preprocess();
+  }
 }
 
 template<typename T>
 bool scene_impl_t<T>::intersect(segment_t& segment, float_t& d) const {
   stats->rays++;
-  return accel.intersect(segment, d);
+  return !two_level()
+    ? accel.intersect(segment, d)
+    : top.intersect(segment, d);
 }
 
 template<typename T>
 void scene_impl_t<T>::intersect(segment_t* stream, const active_t& active) const {
-  accel.intersect(stream, active);
+  if (!two_level()) {
+    accel.intersect(stream, active);
+  }
+  else {
+    top.intersect(stream, active);
+  }
   stats->rays += active.num;
 }
 
 template<typename T>
 bool scene_impl_t<T>::occluded(segment_t& segment, const vector_t& dir, float_t d) const {
   stats->rays++;
-  return accel.occluded(segment, dir, d);
+  return !two_level()
+    ? accel.occluded(segment, dir, d)
+    : top.occluded(segment, dir, d);
 }
 
 template<typename T>
 void scene_impl_t<T>::occluded(occlusion_query_t* stream, const active_t& active) const {
-  accel.occluded(stream, active);
+  if (!two_level()) {
+    accel.occluded(stream, active);
+  }
+  else {
+    top.occluded(stream, active);
+  }
   stats->rays += active.num;
 }
 
@@ -1,17 +1,24 @@
 #pragma once
 
 #include "mesh.hpp"
+#include "instance.hpp"
 #include "light.hpp"
+#include "particles.hpp"
 #include "lights/environment.hpp"
 #include "thing.hpp"
 #include "util/stats.hpp"
 #include "traversal/bvh.hpp"
 
+#include <memory>
 #include <vector>
 
 struct scene_t {
   virtual void add(const mesh_t::p&) = 0;
 
+  virtual void add(const instance_t::p&) = 0;
+
+  virtual void add(const particles_t::p&) = 0;
+
   virtual material_t::p material(uint32_t id) const = 0;
 };
 
@@ -19,9 +26,23 @@ template<typename Accel>
 struct scene_impl_t : public scene_t {
   Accel accel;
 
-  std::vector<light_t::p>    lights;
-  std::vector<mesh_t::p>     meshes;
-  std::vector<material_t::p> materials;
+  // bottom level hierarchies of instanced meshes and of particles, and
+  // the top level hierarchy over their instances. only used if the scene
+  // has instances or particles
+  std::vector<typename Accel::p>   bottom;
+  std::vector<sphere_bvh_t::p>     spheres;
+  instance_bvh_t                   top;
+
+  std::vector<light_t::p>     lights;
+  std::vector<mesh_t::p>      meshes;
+  std::vector<instance_t::p>  instances;
+  std::vector<particles_t::p> particles;
+  std::vector<material_t::p>  materials;
+
+  // instance of all meshes, that are not instanced explicitly
+  std::unique_ptr<instance_t> remaining;
+  // instance of all particles, that are not instanced explicitly
+  std::unique_ptr<instance_t> remaining_particles;
 
   light::environment_t::p environment;
 
@@ -35,6 +56,14 @@ struct scene_impl_t : public scene_t {
 
   void preprocess();
 
+  /**
+   * Update the acceleration structure after vertices of the meshes
+   * moved. Falls back to a full rebuild, if refitting degraded it too
+   * much
+   *
+   */
+  void refit();
+
   bool intersect(segment_t& segment, float_t& d) const;
 
   void intersect(segment_t* stream, const active_t& active) const;
@@ -48,6 +77,16 @@ struct scene_impl_t : public scene_t {
     meshes.push_back(thing);
   }
 
+  inline void add(const instance_t::p& instance) {
+    instance->id = instances.size();
+    instances.push_back(instance);
+  }
+
+  inline void add(const particles_t::p& thing) {
+    thing->id = particles.size();
+    particles.push_back(thing);
+  }
+
   inline void add(const light_t::p& light) {
     lights.push_back(light);
     // TODO: push light into things as well, so they get added
@@ -63,6 +102,45 @@ struct scene_impl_t : public scene_t {
     return id < materials.size() ? materials[id] : nullptr;
   }
 
+  // the material of the mesh or particles 'segment' hit
+  inline const material_t::p& material(const segment_t& segment) const {
+    return (segment.mesh & sphere_t::PARTICLES)
+      ? particles[segment.mesh & ~sphere_t::PARTICLES]->material
+      : meshes[segment.mesh]->material;
+  }
+
+  // whether rays are traced through the top level hierarchy
+  inline bool two_level() const {
+    return !instances.empty() || !particles.empty();
+  }
+
+  inline vector_t shading_normal(const segment_t& segment) const {
+    const auto instanced = two_level() && segment.instance < instances.size();
+
+    vector_t n;
+    if (segment.mesh & sphere_t::PARTICLES) {
+      // the hit point in the object space of the particles
+      const auto p = instanced
+	? instances[segment.instance]->to_object.point(segment.p)
+	: segment.p;
+      n = particles[segment.mesh & ~sphere_t::PARTICLES]->shading_normal(segment, p);
+    }
+    else {
+      n = meshes[segment.mesh]->shading_normal(segment);
+    }
+
+    if (instanced) {
+      n = instances[segment.instance]->to_object.normal(n);
+      n.normalize();
+    }
+    return n;
+  }
+
+  // the bounds of all geometry in the scene
+  inline aabb_t bounds() const {
+    return two_level() ? top.bounds() : accel.bounds();
+  }
+
   inline bool has_environment() const {
     return environment;
   }
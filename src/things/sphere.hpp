@@ -0,0 +1,31 @@
+#pragma once
+
+#include "math/aabb.hpp"
+
+#include <memory>
+
+struct particles_t;
+
+/**
+ * One sphere of a set of particles, to build hierarchies over spheres
+ * like triangle_t does over the faces of meshes
+ *
+ */
+struct sphere_t {
+  typedef std::shared_ptr<sphere_t> p;
+
+  // hits on spheres report the id of their particles with this bit set
+  // as mesh, so they can be told apart from hits on triangles
+  static const uint32_t PARTICLES = 1u << 31;
+
+  const particles_t* particles;
+  uint32_t           id;
+
+  sphere_t(const particles_t* p, uint32_t id);
+
+  aabb_t bounds() const;
+
+  const vector_t& center() const;
+
+  float_t radius() const;
+};
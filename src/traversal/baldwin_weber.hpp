@@ -0,0 +1,211 @@
+#pragma once
+
+#include "ray.hpp"
+#include "math/simd.hpp"
+#include "things/mesh.hpp"
+
+#include <cmath>
+
+/**
+ * Triangle intersection tests after Baldwin and Weber, with an affine
+ * transformation per triangle precomputed at build time. It maps the
+ * triangle to the unit triangle in the xy plane, so a ray is intersected
+ * with the plane of the triangle by the third row, and the barycentric
+ * coordinates of the hit point are the first two rows. This trades the
+ * cross products of moeller_trumbore_t for a larger block.
+ *
+ * The rows are stored per lane, lane x holds triangle x. Empty lanes
+ * hold a plane no ray can hit
+ *
+ */
+template<int N>
+struct baldwin_weber_t {
+  typedef simd_t<N> wide;
+
+  // three rows of four, the last column is the translation
+  typename wide::float_t m[12];
+
+  uint32_t num;
+
+  uint32_t meshid[N];
+  uint32_t faceid[N];
+
+  inline baldwin_weber_t(triangle_t::p* tris, uint32_t num)
+    : num(num) {
+    for (int i=0; i<num; ++i) {
+      faceid[i] = tris[i]->id;
+      meshid[i] = tris[i]->mesh->id;
+    }
+
+    load([&](uint32_t i) { return *tris[i]; });
+  };
+
+  inline aabb_t refit(const std::vector<mesh_t::p>& meshes) {
+    aabb_t out;
+    for (int i=0; i<num; ++i) {
+      out = bounds::merge(out, triangle_t(meshes[meshid[i]], faceid[i]).bounds());
+    }
+
+    load([&](uint32_t i) { return triangle_t(meshes[meshid[i]], faceid[i]); });
+    return out;
+  }
+
+  /**
+   * Compute the transformation of each triangle 'triangle(i)' returns.
+   * The rows are divided by the largest component of the normal, whose
+   * column is then fixed to 0, 0 and 1
+   *
+   */
+  template<typename F>
+  inline void load(const F& triangle) {
+    __aligned(64) float rows[12][N];
+
+    for (int i=0; i<N; ++i) {
+      for (int j=0; j<12; ++j) {
+	rows[j][i] = 0.0f;
+      }
+      // no ray hits the plane 1 = 0
+      rows[11][i] = 1.0f;
+
+      if (i >= num) {
+	continue;
+      }
+
+      const triangle_t t = triangle(i);
+
+      const auto v0 = t.v0(), v1 = t.v1(), v2 = t.v2();
+      const auto e1 = v1 - v0, e2 = v2 - v0;
+      const auto n  = cross(e1, e2);
+      const auto c1 = cross(v1, v0), c2 = cross(v2, v0);
+
+      const auto nx = std::fabs(n.x), ny = std::fabs(n.y), nz = std::fabs(n.z);
+
+      float r[12];
+      if (nx > ny && nx > nz) {
+	r[0] = 0.0f;         r[1] = e2.z / n.x;   r[2]  = -e2.y / n.x;  r[3]  = c2.x / n.x;
+	r[4] = 0.0f;         r[5] = -e1.z / n.x;  r[6]  = e1.y / n.x;   r[7]  = -c1.x / n.x;
+	r[8] = 1.0f;         r[9] = n.y / n.x;    r[10] = n.z / n.x;    r[11] = -dot(n, v0) / n.x;
+      }
+      else if (ny > nz) {
+	r[0] = -e2.z / n.y;  r[1] = 0.0f;         r[2]  = e2.x / n.y;   r[3]  = c2.y / n.y;
+	r[4] = e1.z / n.y;   r[5] = 0.0f;         r[6]  = -e1.x / n.y;  r[7]  = -c1.y / n.y;
+	r[8] = n.x / n.y;    r[9] = 1.0f;         r[10] = n.z / n.y;    r[11] = -dot(n, v0) / n.y;
+      }
+      else if (nz > 0.0f) {
+	r[0] = e2.y / n.z;   r[1] = -e2.x / n.z;  r[2]  = 0.0f;         r[3]  = c2.z / n.z;
+	r[4] = -e1.y / n.z;  r[5] = e1.x / n.z;   r[6]  = 0.0f;         r[7]  = -c1.z / n.z;
+	r[8] = n.x / n.z;    r[9] = n.y / n.z;    r[10] = 1.0f;         r[11] = -dot(n, v0) / n.z;
+      }
+      else {
+	// degenerate triangles keep the plane no ray hits
+	continue;
+      }
+
+      for (int j=0; j<12; ++j) {
+	rows[j][i] = r[j];
+      }
+    }
+
+    for (int j=0; j<12; ++j) {
+      m[j] = wide::load(rows[j]);
+    }
+  }
+
+  // the lanes holding triangles
+  inline size_t valid() const {
+    return (size_t(1) << num) - 1;
+  }
+
+  /**
+   * Test the ray against all triangles. Returns the lanes hit before the
+   * end of the ray, with their distances and barycentric coordinates
+   *
+   */
+  template<typename T>
+  inline typename wide::float_t test(
+    const traversal_ray_t<T, N>& ray
+  , typename wide::float_t& ds
+  , typename wide::float_t& us
+  , typename wide::float_t& vs) const
+  {
+    using namespace simd;
+
+    const auto
+      one  = wide::load(1.0f),
+      zero = wide::load(0.0f);
+
+    const auto& o = ray.origin;
+    const auto& d = ray.direction;
+
+    // distance to the plane of the triangle
+    const auto po = madd(m[8], o.x, madd(m[9], o.y, madd(m[10], o.z, m[11])));
+    const auto pd = madd(m[8], d.x, madd(m[9], d.y, mul(m[10], d.z)));
+    ds = div(sub(zero, po), pd);
+
+    // the barycentric coordinates of the hit point
+    const auto px = madd(ds, d.x, o.x);
+    const auto py = madd(ds, d.y, o.y);
+    const auto pz = madd(ds, d.z, o.z);
+
+    us = madd(m[0], px, madd(m[1], py, madd(m[2], pz, m[3])));
+    vs = madd(m[4], px, madd(m[5], py, madd(m[6], pz, m[7])));
+
+    const auto umask = gte(us, zero);
+    const auto vmask = mand(gte(vs, zero), lte(add(us, vs), one));
+    const auto dmask = mand(gt(ds, zero), lt(ds, ray.d));
+
+    return mand(mand(umask, vmask), dmask);
+  }
+
+  template<typename T>
+  inline bool intersect(traversal_ray_t<T, N>& ray) const {
+    using namespace simd;
+
+    typename wide::float_t ds, us, vs;
+    auto mask = movemask(test(ray, ds, us, vs));
+
+    bool ret = false;
+
+    if (mask != 0) {
+
+      __aligned(64) float dists[N];
+      float closest = ray.segment->d;
+
+      store(ds, dists);
+
+      int idx = -1;
+      while(mask != 0) {
+	auto x = __bscf(mask);
+	if (dists[x] < closest && x < num) {
+	  closest = dists[x];
+	  idx = x;
+	}
+      }
+
+      if (idx != -1) {
+	if (T::shade) {
+	  __aligned(64) float u[N];
+	  __aligned(64) float v[N];
+	  store(us, u);
+	  store(vs, v);
+
+	  ray.segment->shading(u[idx], v[idx], meshid[idx], faceid[idx]);
+	}
+
+	ray.segment->d = closest;
+	ray.d          = wide::load(closest);
+
+	ret = true;
+      }
+    }
+
+    return ret;
+  }
+
+  // whether the ray hits any triangle before its end
+  template<typename T>
+  inline bool occluded(const traversal_ray_t<T, N>& ray) const {
+    typename wide::float_t ds, us, vs;
+    return (simd::movemask(test(ray, ds, us, vs)) & valid()) != 0;
+  }
+};
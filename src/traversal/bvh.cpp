@@ -1,374 +1,521 @@
 #include "bvh.hpp"
-#include "precision.hpp"
 #include "shading.hpp"
-#include "math/aabb.hpp"
-#include "util/compiler.hpp"
+#include "things/instance.hpp"
 
-#include "aabb.hpp"
-#include "ray.hpp"
-#include "triangles.hpp"
-
-#include "bvh/node.hpp"
-#include "bvh/build.hpp"
-#include "bvh/stacks.hpp"
+#include "bvh/impl.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+
+uint32_t bvh_width(const bvh_options_t& options) {
+  if (options.width != 0) {
+    return options.width;
+  }
 
-#include <string.h>
+  // every extension the wider backends are compiled for, see
+  // AVX2_TARGET and AVX512_TARGET
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512dq") &&
+      __builtin_cpu_supports("avx512vl") &&
+      __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma")) {
+    return 16;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return 8;
+  }
+  return 4;
+}
 
+// an empty hierarchy of N wide nodes with the triangle test the options
+// ask for
+template<typename T, int N>
+struct backends_t {
+  static typename bvh_t<T>::impl_t* make(const bvh_options_t& options) {
+    switch (options.intersector) {
+    case bvh_options_t::WATERTIGHT:
+      return make_backend<T, N, bvh_options_t::WATERTIGHT>();
+    case bvh_options_t::BALDWIN_WEBER:
+      return make_backend<T, N, bvh_options_t::BALDWIN_WEBER>();
+    default:
+      return make_backend<T, N, bvh_options_t::MOELLER_TRUMBORE>();
+    }
+  }
+};
+
+// spheres are intersected the same way with every triangle test, so
+// there is one backend per width
+template<int N>
+struct backends_t<sphere_t, N> {
+  static bvh_t<sphere_t>::impl_t* make(const bvh_options_t&) {
+    return make_backend<sphere_t, N, bvh_options_t::MOELLER_TRUMBORE>();
+  }
+};
+
+/**
+ * Create an empty hierarchy of the width the options ask for, or the
+ * widest the processor supports
+ *
+ */
 template<typename T>
-struct accelerator_t
-{};
+typename bvh_t<T>::impl_t* make_impl(const bvh_options_t& options) {
+  switch (bvh_width(options)) {
+  case 4:
+    return backends_t<T, 4>::make(options);
+  case 8:
+    return backends_t<T, 8>::make(options);
+  case 16:
+    return backends_t<T, 16>::make(options);
+  default:
+    throw std::runtime_error("BVH width has to be 4, 8 or 16");
+  }
+}
 
-template<>
-struct accelerator_t<triangle_t> {
-  typedef moeller_trumbore_t<build::MAX_PRIMS_IN_NODE> triangles_t;
-  typedef std::vector<triangles_t> storage_t;
+/**
+ * Trace a fixed set of random rays through the bounds of a hierarchy,
+ * one by one and in streams. Returns the time both took in 'single' and
+ * 'streams'
+ *
+ */
+template<typename Impl>
+void trace_random_rays(const Impl& impl, double& single, double& streams) {
+  typedef std::chrono::duration<double> seconds_t;
+
+  static const uint32_t NUM_STREAMS = 256;
+
+  const auto& bounds = impl.bounds;
+  const auto  center = bounds.centroid();
+  const auto  extent = bounds.max - bounds.min;
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float_t> u(0.0f, 1.0f);
+
+  auto inside = [&](float_t scale) {
+    return center + vector_t(
+      (u(rng) - 0.5f) * extent.x * scale,
+      (u(rng) - 0.5f) * extent.y * scale,
+      (u(rng) - 0.5f) * extent.z * scale);
+  };
+
+  // rays start around the hierarchy and point to a point inside of it.
+  // they are incoherent like secondary rays, so they aren't packed
+  std::vector<segment_t> segments(NUM_STREAMS * 256);
+  for (auto& segment: segments) {
+    segment.p     = inside(2.0f);
+    segment.wi    = normalize(inside(1.0f) - segment.p);
+    segment.depth = 1;
+  }
 
-  template<typename U>
-  static inline bool intersect(traversal_ray_t<U>& ray, const triangles_t& tris) {
-    return tris.intersect(ray);
+  auto start = std::chrono::steady_clock::now();
+  for (const auto& s: segments) {
+    segment_t segment(s);
+    impl.intersect(segment, segment.wi, false);
   }
+  single = seconds_t(std::chrono::steady_clock::now() - start).count();
 
-  static inline uint32_t insert_things(
-    uint32_t start
-  , uint32_t end
-  , const std::vector<build::primitive_t>& primitives
-  , const std::vector<typename triangle_t::p>& unsorted
-  , storage_t& things)
-  {
-    auto index = things.size();
-    for (auto i=0; i<(end-start); i+=build::MAX_PRIMS_IN_NODE) {
-      auto size = std::min(end-start, (uint32_t) build::MAX_PRIMS_IN_NODE);
-
-      triangle_t::p tris[build::MAX_PRIMS_IN_NODE];
-      for (auto j=0; j<size; ++j) {
-	tris[j] = unsorted[primitives[start+i+j].index];
-      }
+  active_t active;
+  active.num = 256;
+  for (auto i=0; i<256; ++i) {
+    active.segment[i] = i;
+  }
 
-      things.emplace_back(tris, size);
-    }
-    return index;
+  std::vector<segment_t> stream(256);
+
+  start = std::chrono::steady_clock::now();
+  for (auto i=0; i<NUM_STREAMS; ++i) {
+    std::copy(&segments[i*256], &segments[i*256] + 256, stream.begin());
+    impl.intersect(stream.data(), active);
   }
-};
+  streams = seconds_t(std::chrono::steady_clock::now() - start).count();
+}
 
-template<typename T>
-struct bvh_t<T>::impl_t {
-  typedef typename accelerator_t<T>::storage_t storage_t;
-  typedef octa_node_t node_t;
+/**
+ * Trace the camera rays of a 256x256 image of the hierarchy, in streams
+ * of 16x16 pixel patches like the camera does. Returns the time it took
+ *
+ */
+template<typename Impl>
+double trace_camera_rays(const Impl& impl) {
+  typedef std::chrono::duration<double> seconds_t;
+
+  static const uint32_t SIZE  = 256;
+  static const uint32_t PATCH = 16;
+
+  const auto& bounds = impl.bounds;
+  const auto  center = bounds.centroid();
+  const auto  extent = bounds.max - bounds.min;
+  const auto  radius = std::max(extent.x, std::max(extent.y, extent.z));
+
+  // look along z at the hierarchy from twice its size away
+  const vector_t eye(center.x, center.y, center.z - 2.0f * radius);
+
+  std::vector<segment_t> segments;
+  segments.reserve(SIZE * SIZE);
+  for (auto py=0; py<SIZE; py+=PATCH) {
+    for (auto px=0; px<SIZE; px+=PATCH) {
+      for (auto y=py; y<py+PATCH; ++y) {
+	for (auto x=px; x<px+PATCH; ++x) {
+	  const vector_t target(
+	    center.x + ((x + 0.5f) / SIZE - 0.5f) * radius,
+	    center.y + ((y + 0.5f) / SIZE - 0.5f) * radius,
+	    bounds.min.z);
+
+	  segment_t segment;
+	  segment.p  = eye;
+	  segment.wi = normalize(target - eye);
+	  segments.push_back(segment);
+	}
+      }
+    }
+  }
 
-  storage_t           things;
-  std::vector<node_t> nodes;
+  active_t active;
+  active.num = PATCH * PATCH;
+  for (auto i=0; i<active.num; ++i) {
+    active.segment[i] = i;
+  }
 
-  aabb_t   bounds;
-  uint32_t node_width;
+  std::vector<segment_t> stream(active.num);
 
-  impl_t()
-    : node_width(8)
-  {}
+  auto start = std::chrono::steady_clock::now();
+  for (auto i=0; i<segments.size(); i+=active.num) {
+    std::copy(&segments[i], &segments[i] + active.num, stream.begin());
+    impl.intersect(stream.data(), active);
+  }
+  return seconds_t(std::chrono::steady_clock::now() - start).count();
+}
 
-  template<typename... Args>
-  uint32_t make_node(const Args& ...args) {
-    nodes.emplace_back(args...);
-    return nodes.size()-1;
+// the same key for both directions of an edge
+inline uint64_t edge_key(vector_t a, vector_t b) {
+  if (std::lexicographical_compare(b.v, b.v + 3, a.v, a.v + 3)) {
+    std::swap(a, b);
   }
 
-  inline const node_t* resolve(uint32_t node) const {
-    return &nodes[node];
+  // 64 bit FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (const auto& v: { a, b }) {
+    auto bytes = (const unsigned char*) v.v;
+    for (size_t i=0; i<sizeof(v.v); ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
   }
+  return hash;
+}
 
-  inline node_t* resolve(uint32_t node) {
-    return &nodes[node];
+/**
+ * Aim rays from around the hierarchy at random points on edges, that two
+ * triangles share. Returns the number of rays, that weren't blocked in
+ * front of the edge, in 'reached', and the number of those, that passed
+ * the edge without hitting either triangle. Rays grazing an edge on the
+ * silhouette may pass it with any test, so even watertight tests leak a
+ * few of them
+ *
+ */
+template<typename Impl>
+uint32_t trace_edge_rays(const Impl& impl, const std::vector<triangle_t::p>& things, uint32_t& reached) {
+  static const uint32_t NUM_RAYS = 65536;
+
+  const auto& bounds = impl.bounds;
+  const auto  center = bounds.centroid();
+  const auto  extent = bounds.max - bounds.min;
+  // rays start in a cube around the hierarchy, so flat scenes aren't
+  // only hit at grazing angles
+  const auto  radius = std::max(extent.x, std::max(extent.y, extent.z));
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float_t> u(0.0f, 1.0f);
+
+  // pick random edges, and count the triangles with each of them
+  struct edge_t {
+    vector_t a, b;
+    uint64_t key;
+  };
+
+  std::vector<edge_t> edges(things.empty() ? 0 : NUM_RAYS);
+  std::unordered_map<uint64_t, uint32_t> shared;
+  for (auto& edge: edges) {
+    const auto& triangle = *things[rng() % things.size()];
+    const vector_t v[] = { triangle.v0(), triangle.v1(), triangle.v2() };
+
+    const auto k = rng() % 3;
+    edge.a   = v[k];
+    edge.b   = v[(k + 1) % 3];
+    edge.key = edge_key(edge.a, edge.b);
+    shared[edge.key] = 0;
   }
 
-  uint32_t insert_things(
-      uint32_t start
-    , uint32_t end
-    , const std::vector<build::primitive_t>& primitives
-    , const std::vector<typename T::p>& unsorted) {
-    return accelerator_t<T>::insert_things(start, end, primitives, unsorted, things);
+  for (const auto& triangle: things) {
+    const vector_t v[] = { triangle->v0(), triangle->v1(), triangle->v2() };
+    for (auto k=0; k<3; ++k) {
+      auto i = shared.find(edge_key(v[k], v[(k + 1) % 3]));
+      if (i != shared.end()) {
+	i->second++;
+      }
+    }
   }
 
-  void build(const std::vector<typename T::p>& unsorted) {
-    std::vector<build::primitive_t> primitives(unsorted.size());
-    for (uint32_t i=0; i<unsorted.size(); ++i) {
-      primitives[i] = {i, unsorted[i]->bounds()};
+  uint32_t leaks = 0;
+  reached = 0;
+  for (const auto& edge: edges) {
+    // rays through open edges leak with any test
+    const auto target = edge.a + u(rng) * (edge.b - edge.a);
+    if (shared[edge.key] < 2) {
+      continue;
     }
 
-    build::geometry_t geometry(primitives, 0, primitives.size());
-    build::from(geometry, unsorted, *this);
+    segment_t segment;
+    segment.p = center + vector_t(
+      (u(rng) - 0.5f) * radius * 2.0f,
+      (u(rng) - 0.5f) * radius * 2.0f,
+      (u(rng) - 0.5f) * radius * 2.0f);
+    segment.wi    = normalize(target - segment.p);
+    segment.depth = 1;
+
+    // hits this close to the edge hit one of its triangles
+    const auto d       = (target - segment.p).length();
+    const auto epsilon = radius * 0.001f;
+
+    impl.intersect(segment, segment.wi, false);
+    if (segment.d < d - epsilon) {
+      continue;
+    }
+
+    reached++;
+    if (segment.d > d + epsilon) {
+      leaks++;
+    }
   }
+  return leaks;
+}
 
-  bool intersect(segment_t& segment, const vector_t& dir, bool occlusion_query) {
-    static thread_local node_ref_t stack[128];
+/**
+ * Trace random rays and rays at shared edges with hierarchies over the
+ * same triangles, but with each of the triangle intersection tests.
+ * Hierarchies over instances have no triangles of their own to compare
+ *
+ */
+template<typename Impl, typename Things>
+void compare_intersectors(const Impl&, const Things&, const bvh_options_t&)
+{}
 
-    uint32_t indices[] = {
-      0, 8, 16, 24, 32, 40
-    };
+void compare_intersectors(
+  const bvh_t<triangle_t>::impl_t& impl
+, const std::vector<triangle_t::p>& things
+, const bvh_options_t& options)
+{
+  static const std::pair<bvh_options_t::intersector_t, const char*> intersectors[] = {
+    { bvh_options_t::MOELLER_TRUMBORE, "moeller trumbore" },
+    { bvh_options_t::WATERTIGHT,       "watertight" },
+    { bvh_options_t::BALDWIN_WEBER,    "baldwin weber" }
+  };
+
+  std::clog << "Triangle tests, single rays/s and leaks through shared edges:";
+  for (const auto& i: intersectors) {
+    bvh_options_t other(options);
+    other.intersector = i.first;
+    other.report      = false;
+
+    std::unique_ptr<bvh_t<triangle_t>::impl_t> reference;
+    if (i.first != options.intersector) {
+      reference.reset(make_impl<triangle_t>(other));
+      reference->build(things, other);
+    }
+    const auto& tested = reference ? *reference : impl;
 
-    //if (dir.x < 0.0) { std::swap(indices[0], indices[3]); }
-    //if (dir.y < 0.0) { std::swap(indices[1], indices[4]); }
-    //if (dir.z < 0.0) { std::swap(indices[2], indices[5]); }
+    double single, streams;
+    trace_random_rays(tested, single, streams);
 
-    traversal_ray_t<segment_t> tray(segment.p, dir, &segment);
+    uint32_t reached;
+    auto leaks = trace_edge_rays(tested, things, reached);
 
-    bool hit_anything = false;
+    std::clog
+      << (i.first == 0 ? " " : ", ") << i.second << ": "
+      << 65536 / single / 1e6 << "M, "
+      << leaks << " of " << reached;
+  }
+  std::clog << std::endl;
+}
 
-    auto top = 1;
-    stack[0].offset = 0;
-    stack[0].flags  = 0;
-    stack[0].d = std::numeric_limits<float>::lowest();
+template<typename T>
+bvh_t<T>::bvh_t()
+  : impl(make_impl<T>(options_t()))
+{}
 
-    while (top > 0) {
-      auto cur = stack[--top];
-      if (cur.d > segment.d) {
-	continue;
-      }
+template<typename T>
+void bvh_t<T>::build(const std::vector<typename T::p>& things) {
+  typedef std::chrono::duration<double> seconds_t;
 
-      while (cur.flags == 0) {
-	auto node = resolve(cur.offset);
-	__aligned(64) auto bounds = bounds::load<8>(node->bounds, indices);
-	
-	float8_t dist;
-	auto mask = float8::movemask(bounds::intersect_all<8>(
-          tray.origin, tray.ood, tray.d,
-	  bounds, dist));
-
-	if (mask == 0) {
-	  break;
-	}
-	
-	float dists[8];
-	float8::store(dist, dists);
-	
-	auto a = __bscf(mask);
-	if (likely(mask == 0)) {
-	  cur.offset = node->offset[a];
-	  cur.flags  = node->num[a];
-	  cur.d      = dists[a];
-	  continue;
-	}
+  // start from an empty hierarchy, in case this is a rebuild
+  impl.reset(make_impl<T>(options));
 
-	auto b = __bscf(mask);
-	if (likely(mask == 0)) {
-	  if (dists[a] < dists[b]) {
-	    cur.offset = node->offset[a];
-	    cur.flags  = node->num[a];
-	    cur.d      = dists[a];
-
-	    push(stack, top, dists, node, b);
-	  }
-	  else {
-	    cur.offset = node->offset[b];
-	    cur.flags  = node->num[b];
-	    cur.d      = dists[b];
-
-	    push(stack, top, dists, node, a);
-	  }
-	  continue;
-	}
+  auto start = std::chrono::steady_clock::now();
+  impl->build(things, options);
+  seconds_t elapsed = std::chrono::steady_clock::now() - start;
 
-	auto c = __bscf(mask);
-	if (likely(mask == 0)) {
-	  if (dists[b] < dists[a]) std::swap(b, a);
-	  if (dists[c] < dists[b]) std::swap(c, b);
-	  if (dists[b] < dists[a]) std::swap(b, a);
+  std::clog
+    << "Finished building BVH."
+    << impl->bounds
+    << std::endl
+    << "With number of nodes: " << impl->blocks()
+    << std::endl
+    << "Build time: " << elapsed.count() << "s using "
+    << options.threads << " threads, " << impl->width << " wide nodes"
+    << std::endl
+    << "Stream traversal scratch: " << impl->stream_memory() / 1024 << "kb per thread"
+    << std::endl;
 
-	  push(stack, top, dists, node, c);
-	  push(stack, top, dists, node, b);
-	}
-	else {
-	  auto d = __bscf(mask);
-	  if (mask == 0) {
-	  
-	    if (dists[b] < dists[a]) std::swap(b, a);
-	    if (dists[d] < dists[c]) std::swap(d, c);
-	    if (dists[c] < dists[a]) std::swap(c, a);
-	    if (dists[d] < dists[b]) std::swap(d, b);
-	    if (dists[c] < dists[b]) std::swap(c, b);
-
-	    push(stack, top, dists, node, d);
-	    push(stack, top, dists, node, c);
-	    push(stack, top, dists, node, b);
-	  }
-	  else {
-	    size_t indices[8] = {a,b,c,d,0,0,0,0};
-	    int index = 4;
-	    while (mask != 0) {
-	      indices[index++] = __bscf(mask);
-	    }
-	    std::sort(indices, indices+index, [dists](size_t l, size_t r){
-	      return dists[l] < dists[r];
-	    });
-	    for (auto i=1;i<index; ++i) {
-	      push(stack, top, dists, node, indices[i]);
-	    }
-
-	    a = indices[0];
-	  }    
-	}
+  if (options.report && options.builder == options_t::SAH && options.threads > 0) {
+    // build the same hierarchy with the serial builder, to report
+    // the speedup and check that both builds are identical
+    options_t serial(options);
+    serial.threads = 0;
 
-	cur.offset = node->offset[a];
-	cur.flags  = node->num[a];
-	cur.d      = dists[a];
-      }
+    std::unique_ptr<impl_t> reference(make_impl<T>(serial));
 
-      if (cur.flags > 0) {
-	if (accelerator_t<T>::intersect(tray, things[cur.offset])) {
-	  hit_anything = true;
-	}
-      }
+    auto start = std::chrono::steady_clock::now();
+    reference->build(things, serial);
+    seconds_t serial_elapsed = std::chrono::steady_clock::now() - start;
 
-      if (hit_anything && occlusion_query) {
-	// stop traversal if this is an occlusion query. we just want to
-	// know if anything got hit
-	break;
-      }
-    }
-    
-    return hit_anything;
+    std::clog
+      << "Serial build time: " << serial_elapsed.count() << "s, "
+      << "speedup: " << serial_elapsed.count() / elapsed.count()
+      << (impl->same_as(*reference) ? "" : " (hierarchies differ)")
+      << std::endl;
   }
 
-  template<typename Stream>
-  void intersect(Stream* stream, const active_t& active) const {
-    static thread_local stream::lanes_t lanes;
-    static thread_local stream::task_t  tasks[256];
-
-    static thread_local __attribute__((aligned (64))) traversal_ray_t<Stream> rays[256];
-
-    auto ray = rays;
-    for (auto i=0; i<active.num; ++i, ++ray) {
-      auto  index   = active.segment[i];
-      auto& segment = stream[index];
-      if (!segment.masked()) {
-	segment.miss();
-	// avoid copying of data and call constructor directly
-	new(ray) traversal_ray_t<Stream>(segment.p, segment.wi, &segment);
-	push(lanes, 0, i);
-      }
-    }
+  if (options.report && options.quantize) {
+    // compare against the same hierarchy with full precision nodes
+    options_t full(options);
+    full.quantize = false;
+
+    std::unique_ptr<impl_t> reference(make_impl<T>(full));
+    reference->build(things, full);
+
+    double single, streams, reference_single, reference_streams;
+    trace_random_rays(*impl, single, streams);
+    trace_random_rays(*reference, reference_single, reference_streams);
+
+    std::clog
+      << "Quantized nodes: " << impl->node_memory() / 1024 << "kb, "
+      << "full precision nodes: " << reference->node_memory() / 1024 << "kb ("
+      << (double) reference->node_memory() / impl->node_memory() << "x)"
+      << std::endl
+      << "Single rays: " << single << "s vs " << reference_single << "s, "
+      << "streams: " << streams << "s vs " << reference_streams << "s"
+      << std::endl;
+  }
 
-    // all rays were masked
-    if (lanes.num[0] == 0) {
-      return;
-    }
+  if (options.report) {
+    // trace incoherent streams with different thresholds for continuing
+    // rays on their own
+    impl->interleave = 0;
+
+    std::clog << "Stream rays/s by single ray threshold:";
+    for (uint32_t threshold: { 0, 2, 4, 8, 16, 32, 64 }) {
+      impl->single_ray_threshold = threshold;
 
-    auto zero = float8::load(0.0f);
+      double single, streams;
+      trace_random_rays(*impl, single, streams);
+      std::clog << " " << threshold << ": " << 65536 / streams / 1e6 << "M";
+    }
+    std::clog << std::endl;
 
-    auto top = 0;
-    push(tasks, top, lanes.num[0]);
+    impl->single_ray_threshold = options.single_ray_threshold;
 
-    while (top > 0) {
-      auto& cur = tasks[--top];
+    // trace the same streams ray by ray with several rays in flight. this
+    // pays off, once the nodes don't fit into the last level cache
+    double single, streams;
+    trace_random_rays(*impl, single, streams);
 
-      if (!cur.is_leaf()) {
-	auto node = resolve(cur.offset);
-	auto todo = pop(lanes, cur.lane, cur.num_rays);
+    std::clog
+      << "Interleaved rays/s by rays in flight, with "
+      << impl->node_memory() / (1 << 20) << "mb of nodes: single: "
+      << 65536 / single / 1e6 << "M, streams: " << 65536 / streams / 1e6 << "M";
+    for (uint32_t interleave: { 1, 2, 4, 8, 16 }) {
+      impl->interleave = interleave;
 
-	uint32_t indices[] = {
-	  0, 8, 16, 24, 32, 40
-	};
+      trace_random_rays(*impl, single, streams);
+      std::clog << " " << interleave << ": " << 65536 / streams / 1e6 << "M";
+    }
+    std::clog << std::endl;
 
-	uint32_t num_active[8] = {[0 ... 7] = 0};
+    impl->interleave = options.interleave;
 
-	__aligned(64) auto bounds = bounds::load<8>(node->bounds, indices);
+    // trace camera rays in packets and in streams
+    impl->packets = true;
+    auto packets = trace_camera_rays(*impl);
+    impl->packets = false;
+    auto camera_streams = trace_camera_rays(*impl);
+    impl->packets = options.packets;
 
-	auto length = zero;
-	auto end    = todo + cur.num_rays;
-	while (todo != end) {
-	  const auto& ray = rays[*todo];
+    std::clog
+      << "Camera rays/s in packets: " << 65536 / packets / 1e6 << "M, "
+      << "in streams: " << 65536 / camera_streams / 1e6 << "M"
+      << std::endl;
 
-	  if (Stream::stop_on_first_hit && ray.segment->is_hit()) {
-	    ++todo;
-	    continue;
-	  }
+    compare_intersectors(*impl, things, options);
+  }
+}
 
-	  float8_t dist;
+template<typename T>
+bool bvh_t<T>::refit(const std::vector<mesh_t::p>& meshes) {
+  typedef std::chrono::duration<double> seconds_t;
 
-	  auto hits = bounds::intersect_all<8>(
-            ray.origin, ray.ood, ray.d,
-	    bounds, dist);
+  if (impl->quantized()) {
+    // quantized nodes have lost the precision to be updated in place
+    return false;
+  }
 
-	  length = float8::add(length, float8::mand(dist, hits));
+  auto start = std::chrono::steady_clock::now();
+  impl->refit(meshes);
+  seconds_t elapsed = std::chrono::steady_clock::now() - start;
 
-	  auto mask = float8::movemask(hits);
+  auto growth = impl->cost() / impl->build_cost;
 
-	  // push ray into lanes for intersected nodes
-	  while(mask != 0) {
-	    auto x = __bscf(mask);
-	    num_active[x]++;
-	    push(lanes, x, *todo);
-	  }
+  std::clog
+    << "Refitted BVH in " << elapsed.count() << "s, "
+    << "SAH cost grew by a factor of " << growth
+    << std::endl;
 
-	  ++todo;
-	}
-	
-	uint32_t ids[8];
-
-	float dists[8];
-	float8::store(length, dists);
-	
-	// TODO: collect stats on lane utilization to see if efficiently sorting
-	// for smaller 'n' makes sense
-
-	auto n=0;
-	for (auto i=0; i<8; ++i) {
-	  auto num = num_active[i];
-	  if (num > 0) {
-	    auto d = dists[i];
-	    ids[n] = i;
-	    for(auto j=n; j>0; --j) {
-	      if (d < dists[ids[j]]) {
-		auto& a = ids[j], &b = ids[j-1];
-		a = a ^ b;
-		b = a ^ b;
-		a = a ^ b;
-	      }
-	    }
-	    ++n;
-	  }
-	}
+  return growth <= options.max_refit_cost;
+}
 
-	for (auto i=0; i<n; ++i) {
-	  push(tasks, top, node, ids[i], num_active[ids[i]]);
-	}
-      }
-      else {
-	auto todo = pop(lanes, cur.lane, cur.num_rays);
-	auto end  = todo + cur.num_rays;
-	do {
-	  auto index = cur.offset;
-	  do {
-	    if (accelerator_t<T>::intersect(
-	          rays[*todo]
-	        , things[index])) {
-	      rays[*todo].segment->hit();
-	    }
-	    index += build::MAX_PRIMS_IN_NODE;
-	  } while(index < cur.prims);
-	} while(++todo != end);
-      }
-    }
-  }
-};
+// only hierarchies over triangles can be stored. their leaves refer to
+// meshes by id, while instances are referenced by pointer
+template<>
+void bvh_t<triangle_t>::write(std::ostream& out) const {
+  impl->write(out);
+}
 
-template<typename T>
-bvh_t<T>::bvh_t()
-  : impl(new impl_t())
-{}
+template<>
+void bvh_t<triangle_t>::map(char*& cursor, const char* end) {
+  // the cache key covers the width, so the mapped nodes have the width
+  // the options resolve to
+  impl.reset(make_impl<triangle_t>(options));
+  impl->map(cursor, end);
 
-template<typename T>
-void bvh_t<T>::build(const std::vector<triangle_t::p>& things) {
-  impl->build(things);
+  impl->single_ray_threshold = options.single_ray_threshold;
+  impl->packets              = options.packets;
+  impl->interleave           = options.interleave;
 
   std::clog
-    << "Finished building BVH."
+    << "Mapped BVH."
     << impl->bounds
     << std::endl
-    << "With number of nodes: " << impl->things.size()
+    << "With number of nodes: " << impl->blocks()
     << std::endl;
 }
 
+template<typename T>
+aabb_t bvh_t<T>::bounds() const {
+  return impl->bounds;
+}
+
 template<typename T>
 bool bvh_t<T>::intersect(segment_t& segment, float_t& d) const {
   segment.d = d;
@@ -394,3 +541,5 @@ void bvh_t<T>::occluded(occlusion_query_t* stream, const active_t& active) const
 }
 
 template class bvh_t<triangle_t>;
+template class bvh_t<sphere_t>;
+template class bvh_t<instance_t>;
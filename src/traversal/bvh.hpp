@@ -1,17 +1,108 @@
 #pragma once
 
 #include "shading.hpp"
+#include "things/sphere.hpp"
 #include "things/triangle.hpp"
 
 #include <memory>
+#include <ostream>
+#include <vector>
+
+struct instance_t;
+
+struct bvh_options_t {
+  enum builder_t {
+    // binned SAH with object splits
+    SAH,
+    // binned SAH with object and spatial splits
+    SBVH,
+    // linear BVH over the Morton codes of the primitive centroids. builds
+    // fastest, but traces slower than the SAH builders
+    LBVH
+  };
+
+  enum intersector_t {
+    // Moeller Trumbore, the smallest leaf blocks
+    MOELLER_TRUMBORE,
+    // Woop et al., rays can't slip through edges shared by triangles
+    WATERTIGHT,
+    // Baldwin Weber, a transformation into a unit triangle precomputed
+    // per triangle
+    BALDWIN_WEBER
+  };
+
+  builder_t builder;
+  // number of threads used to build the hierarchy. builds share the
+  // process wide pool, which the first build creates unless it exists
+  // already. with 0 threads the hierarchy is built by the serial
+  // builder on the calling thread
+  uint32_t threads;
+  // additionally run the serial builder and report the speedup of the
+  // parallel build
+  bool report;
+  // number of references the spatial split builder may duplicate,
+  // relative to the number of primitives in the scene
+  float spatial_budget;
+  // a refitted hierarchy needs to be rebuilt, once its SAH cost grew by
+  // more than this factor over the cost right after the build
+  float max_refit_cost;
+  // store child bounds quantized to 8 bits. this cuts the size of the
+  // nodes to less than a third, but the hierarchy can't be refitted
+  bool quantize;
+  // reorder nodes and leaves after the build for fewer cache misses
+  bool reorder;
+  // stream traversal continues each ray of a stream on its own, once
+  // fewer rays than this visit a node together
+  uint32_t single_ray_threshold;
+  // traverse streams of camera rays in packets, that are culled against
+  // nodes as a whole
+  bool packets;
+  // trace incoherent streams ray by ray, with this many rays in flight
+  // whose traversal steps are interleaved. while one ray is tested
+  // against a node, the nodes of the others are prefetched. with 0
+  // incoherent streams are traversed as streams
+  uint32_t interleave;
+  // children per node, 4 (SSE4.2), 8 (AVX2) or 16 (AVX-512). with 0 the
+  // widest the processor supports is picked at runtime
+  uint32_t width;
+  // the test triangles in leaves are intersected with
+  intersector_t intersector;
+
+  inline bvh_options_t()
+    : builder(SAH)
+    , threads(0)
+    , report(false)
+    , spatial_budget(0.3f)
+    , max_refit_cost(1.5f)
+    , quantize(false)
+    , reorder(true)
+    , single_ray_threshold(8)
+    , packets(true)
+    , interleave(0)
+    , width(0)
+    , intersector(MOELLER_TRUMBORE)
+  {}
+};
+
+/**
+ * The width of the nodes of hierarchies built with 'options'
+ *
+ */
+uint32_t bvh_width(const bvh_options_t& options);
 
 template<typename T>
 struct bvh_t {
   typedef std::shared_ptr<bvh_t> p;
-  
+
+  // the options do not depend on the things in the hierarchy, so the
+  // bottom and top levels of instanced scenes can share them
+  typedef bvh_options_t options_t;
+
   struct impl_t;
   std::shared_ptr<impl_t> impl;
 
+  options_t options;
+
   bvh_t();
 
   /**
@@ -19,7 +110,36 @@ struct bvh_t {
    * hierarchy
    *
    */
-  void build(const std::vector<triangle_t::p>& things);
+  void build(const std::vector<typename T::p>& things);
+
+  /**
+   * Update the hierarchy to moved vertices of the meshes it was built
+   * from, keeping its topology. Returns false if the quality of the
+   * refitted hierarchy degraded so much, that it should be rebuilt
+   *
+   */
+  bool refit(const std::vector<mesh_t*>& meshes);
+
+  /**
+   * The bounds of all things in the hierarchy
+   *
+   */
+  aabb_t bounds() const;
+
+  /**
+   * Write the hierarchy to a stream, so map() can use it from a memory
+   * mapped file later
+   *
+   */
+  void write(std::ostream& out) const;
+
+  /**
+   * Use a hierarchy written by write() at 'cursor' in a page aligned
+   * mapping, without copying it. Advances the cursor past the hierarchy.
+   * Throws if the hierarchy would reach past 'end'
+   *
+   */
+  void map(char*& cursor, const char* end);
 
   /**
    * Find intersection for one segment. Returns the hitpoint distance
@@ -49,3 +169,5 @@ struct bvh_t {
 };
 
 typedef bvh_t<triangle_t> mesh_bvh_t;
+typedef bvh_t<sphere_t>   sphere_bvh_t;
+typedef bvh_t<instance_t> instance_bvh_t;
@@ -0,0 +1,1452 @@
+#pragma once
+
+#include "common.hpp"
+
+#include "traversal/aabb.hpp"
+#include "traversal/ray.hpp"
+#include "traversal/baldwin_weber.hpp"
+#include "traversal/spheres.hpp"
+#include "traversal/triangles.hpp"
+#include "traversal/watertight.hpp"
+
+#include "packet.hpp"
+#include "quantized.hpp"
+
+template<typename T, int N, int I>
+struct accelerator_t
+{};
+
+// the leaf blocks of each triangle intersection test
+template<int N, int I>
+struct triangles_of_t
+{};
+
+template<int N>
+struct triangles_of_t<N, bvh_options_t::MOELLER_TRUMBORE> {
+  typedef moeller_trumbore_t<N> type;
+};
+
+template<int N>
+struct triangles_of_t<N, bvh_options_t::WATERTIGHT> {
+  typedef watertight_t<N> type;
+};
+
+template<int N>
+struct triangles_of_t<N, bvh_options_t::BALDWIN_WEBER> {
+  typedef baldwin_weber_t<N> type;
+};
+
+/**
+ * Hierarchies, whose leaves hold blocks of N things of type 'T', each
+ * block intersected as a whole by the leaf block type 'Block'
+ *
+ */
+template<typename T, int N, typename Block>
+struct block_accelerator_t {
+  typedef Block blocks_t;
+  typedef buffer_t<blocks_t> storage_t;
+
+  // the closest hit, or any hit for occlusion queries
+  template<typename U>
+  static inline bool intersect(traversal_ray_t<U, N>& ray, const blocks_t& block, bool occlusion_query) {
+    return occlusion_query ? block.occluded(ray) : block.intersect(ray);
+  }
+
+  // intersect all rays with the given ids in a stream with one leaf block
+  template<typename U>
+  static inline void intersect(
+    traversal_ray_t<U, N>* rays
+  , const uint32_t* ids
+  , uint32_t num
+  , const blocks_t& block)
+  {
+    for (auto i=0; i<num; ++i) {
+      auto& ray = rays[ids[i]];
+      if (block.intersect(ray)) {
+	ray.segment->hit();
+      }
+    }
+  }
+
+  // test the occlusion queries with the given ids against one leaf block.
+  // occluded queries are removed from 'ids', returns how many are left
+  template<typename U>
+  static inline uint32_t occlude(
+    traversal_ray_t<U, N>* rays
+  , uint32_t* ids
+  , uint32_t num
+  , const blocks_t& block)
+  {
+    auto out = 0;
+    for (auto i=0; i<num; ++i) {
+      auto& ray = rays[ids[i]];
+      if (block.occluded(ray)) {
+	ray.segment->hit();
+      }
+      else {
+	ids[out++] = ids[i];
+      }
+    }
+    return out;
+  }
+
+  static inline uint32_t insert_things(
+    uint32_t start
+  , uint32_t end
+  , const std::vector<build::primitive_t>& primitives
+  , const std::vector<typename T::p>& unsorted
+  , storage_t& things)
+  {
+    auto index = things.size();
+    for (auto i=0; i<(end-start); i+=N) {
+      auto size = std::min(end-start-i, (uint32_t) N);
+
+      typename T::p block[N];
+      for (auto j=0; j<size; ++j) {
+	block[j] = unsorted[primitives[start+i+j].index];
+      }
+
+      things.emplace_back(block, size);
+    }
+    return index;
+  }
+
+  static inline aabb_t refit(blocks_t& block, const std::vector<mesh_t::p>& meshes) {
+    return block.refit(meshes);
+  }
+
+  static inline void write(const storage_t& things, std::ostream& out) {
+    things.write(out);
+  }
+
+  static inline void map(storage_t& things, char*& cursor, const char* end) {
+    things.map(cursor, end);
+  }
+};
+
+template<int N, int I>
+struct accelerator_t<triangle_t, N, I>
+  : public block_accelerator_t<triangle_t, N, typename triangles_of_t<N, I>::type>
+{};
+
+// spheres are intersected the same way with every triangle test
+template<int N, int I>
+struct accelerator_t<sphere_t, N, I>
+  : public block_accelerator_t<sphere_t, N, spheres_t<N>>
+{};
+
+// spatial splits clip triangles, other things are only split by objects
+template<int N, typename BVH>
+inline void build_spatial(
+  build::geometry_t& geometry
+, float_t budget
+, const std::vector<triangle_t::p>& things
+, BVH& bvh)
+{
+  build::spatial::from<N>(geometry, budget, things, bvh);
+}
+
+template<int N, typename Things, typename BVH>
+inline void build_spatial(
+  build::geometry_t& geometry
+, float_t
+, const Things& things
+, BVH& bvh)
+{
+  build::from<N>(geometry, things, bvh);
+}
+
+/**
+ * A hierarchy of N wide nodes, whose leaves are blocks of up to N
+ * primitives. Every function, that touches nodes or rays, is compiled
+ * for the instruction set of its width. Triangles are intersected with
+ * the test 'I', each of which lays out its blocks differently
+ *
+ */
+template<typename T, int N, int I>
+struct backend_t : public bvh_t<T>::impl_t {
+  typedef typename bvh_t<T>::impl_t   base_t;
+  typedef typename bvh_t<T>::options_t options_t;
+
+  typedef typename accelerator_t<T, N, I>::storage_t storage_t;
+  typedef mbvh_node_t<N> node_t;
+  typedef simd_t<N>      wide;
+
+  // only eight wide nodes can be quantized
+  typedef std::integral_constant<bool, N == 8> quantizable_t;
+
+  // stacks deep enough for the children of a node on every level
+  static const uint32_t STACK_SIZE  = 16 * N;
+  static const uint32_t PACKET_SIZE = 64 * N;
+  // most rays interleaved traversal keeps in flight
+  static const uint32_t MAX_IN_FLIGHT = 16;
+
+  storage_t        things;
+  buffer_t<node_t> nodes;
+  // the nodes of a quantized hierarchy. the full precision nodes are
+  // released after quantization
+  buffer_t<quantized_node_t> qnodes;
+  // levels of inner nodes, which bound the lanes of stream traversal
+  uint32_t depth;
+
+  backend_t()
+    : base_t(N, I), depth(0)
+  {}
+
+  // offsets of the six bound planes in the bounds of a node
+  static inline const uint32_t* indices() {
+    static const uint32_t out[] = {
+      0, N, 2*N, 3*N, 4*N, 5*N
+    };
+    return out;
+  }
+
+  // leaf blocks of a leaf with 'num' primitives
+  static inline uint32_t blocks(uint32_t num) {
+    return (num + N - 1) / N;
+  }
+
+  template<typename... Args>
+  uint32_t make_node(const Args& ...args) {
+    nodes.emplace_back(args...);
+    return nodes.size()-1;
+  }
+
+  inline const node_t* resolve(uint32_t node) const {
+    return &nodes[node];
+  }
+
+  inline node_t* resolve(uint32_t node) {
+    return &nodes[node];
+  }
+
+  uint32_t insert_things(
+      uint32_t start
+    , uint32_t end
+    , const std::vector<build::primitive_t>& primitives
+    , const std::vector<typename T::p>& unsorted) {
+    return accelerator_t<T, N, I>::insert_things(start, end, primitives, unsorted, things);
+  }
+
+  void build(const std::vector<typename T::p>& unsorted, const options_t& options) override {
+    this->single_ray_threshold = options.single_ray_threshold;
+    this->packets              = options.packets;
+    this->interleave           = options.interleave;
+
+    std::vector<build::primitive_t> primitives(unsorted.size());
+    for (uint32_t i=0; i<unsorted.size(); ++i) {
+      primitives[i] = {i, unsorted[i]->bounds()};
+    }
+
+    build::geometry_t geometry(primitives, 0, primitives.size());
+    this->bounds = geometry.bounds;
+
+    if (options.builder == options_t::SBVH) {
+      build_spatial<N>(geometry, options.spatial_budget, unsorted, *this);
+    }
+    else if (options.builder == options_t::LBVH) {
+      // without threads, a pool of none runs all chunks on this thread
+      thread_pool_t serial(0);
+      auto& pool = options.threads > 0 ? thread_pool_t::shared(options.threads) : serial;
+      build::morton::from<N>(pool, geometry, unsorted, *this);
+    }
+    else if (options.threads > 0) {
+      build::parallel::from<N>(thread_pool_t::shared(options.threads), geometry, unsorted, *this);
+    }
+    else {
+      build::from<N>(geometry, unsorted, *this);
+    }
+
+    // too few things to split, e.g. a handful of instances. traversal
+    // always starts at a node, so put them into a leaf below the root
+    if (nodes.empty() && geometry.count() > 0) {
+      auto node = resolve(make_node());
+      node->set_bounds(0, geometry.bounds);
+      node->set_leaf(0, insert_things(geometry.start, geometry.end, primitives, unsorted), geometry.count());
+    }
+
+    this->build_cost = cost();
+
+    for (auto& node: nodes) {
+      node.update_order();
+    }
+
+    // quantization lays out the nodes itself
+    if (options.quantize && !nodes.empty()) {
+      quantize(options, quantizable_t());
+    }
+    else if (options.reorder) {
+      build::reorder(nodes, things);
+    }
+
+    depth = levels();
+  }
+
+  static inline bool is_inner(const node_t* node, uint32_t i) {
+    return !node->is_leaf(i) && !node->is_empty(i);
+  }
+
+  static inline bool is_inner(const quantized_node_t* node, uint32_t i) {
+    return node->is_inner(i);
+  }
+
+  // levels of inner nodes from the inner node 'node' down
+  template<typename Node>
+  static uint32_t levels(const Node* nodes, uint32_t node) {
+    uint32_t out = 0;
+    for (auto i=0; i<N; ++i) {
+      if (is_inner(&nodes[node], i)) {
+	out = std::max(out, levels(nodes, nodes[node].get_offset(i)));
+      }
+    }
+    return out + 1;
+  }
+
+  inline uint32_t levels() const {
+    if (nodes.empty() && qnodes.empty()) {
+      return 0;
+    }
+
+    return visit([&](const auto* nodes) {
+      return levels(nodes, 0);
+    });
+  }
+
+  /**
+   * Check that the children of all nodes follow their parent within the
+   * nodes, and that leaves lie within the leaf blocks, so a mapped
+   * hierarchy can be walked safely. Throws otherwise
+   *
+   */
+  template<typename Node>
+  static void check(const Node* nodes, uint32_t num_nodes, uint32_t num_blocks) {
+    for (uint32_t node=0; node<num_nodes; ++node) {
+      for (auto i=0; i<N; ++i) {
+	const auto offset = nodes[node].get_offset(i);
+	if (is_inner(&nodes[node], i)) {
+	  if (offset <= node || offset >= num_nodes) {
+	    throw std::runtime_error("BVH node refers to an unknown child");
+	  }
+	}
+	else if (nodes[node].is_leaf(i)) {
+	  if ((uint64_t) offset + blocks(nodes[node].get_num(i)) > num_blocks) {
+	    throw std::runtime_error("BVH leaf exceeds the leaf blocks");
+	  }
+	}
+      }
+    }
+  }
+
+  void quantize(const options_t&, std::true_type) {
+    build::quantize(nodes, things, qnodes);
+    buffer_t<node_t>().swap(nodes);
+  }
+
+  void quantize(const options_t& options, std::false_type) {
+    std::clog
+      << "Only BVH8 nodes can be quantized, keeping full precision BVH"
+      << N << " nodes" << std::endl;
+
+    if (options.reorder) {
+      build::reorder(nodes, things);
+    }
+  }
+
+  inline bool quantized() const override {
+    return !qnodes.empty();
+  }
+
+  inline size_t node_memory() const override {
+    return nodes.size() * sizeof(node_t) + qnodes.size() * sizeof(quantized_node_t);
+  }
+
+  inline size_t blocks() const override {
+    return things.size();
+  }
+
+  inline size_t stream_memory() const override {
+    stream::lanes_t<N> lanes;
+    lanes.reserve(depth);
+    return lanes.memory();
+  }
+
+  /**
+   * The SAH cost of the hierarchy, with the same unit costs for
+   * traversing a node and intersecting a primitive as the builders
+   *
+   */
+  float_t cost() const override {
+    if (nodes.empty()) {
+      return 0.0f;
+    }
+
+    const auto root_area = nodes[0].merged_bounds().area();
+
+    float_t out = 1.0f;
+    for (const auto& node: nodes) {
+      for (auto i=0; i<N; ++i) {
+	if (node.is_empty(i)) {
+	  continue;
+	}
+
+	auto area = node.get_bounds(i).area() / root_area;
+	out += area * (node.is_leaf(i) ? node.num[i] : 1.0f);
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Update all bounds of the hierarchy to the current vertices of the
+   * meshes. Nodes are allocated before their children, so walking them
+   * backwards visits every child before its parent
+   *
+   */
+  void refit(const std::vector<mesh_t::p>& meshes) override {
+    for (int32_t n=nodes.size()-1; n>=0; --n) {
+      auto& node = nodes[n];
+
+      for (auto i=0; i<N; ++i) {
+	if (node.is_empty(i)) {
+	  continue;
+	}
+
+	aabb_t b;
+	if (node.is_leaf(i)) {
+	  for (auto j=0; j<blocks(node.num[i]); ++j) {
+	    b = bounds::merge(b, accelerator_t<T, N, I>::refit(things[node.offset[i] + j], meshes));
+	  }
+	}
+	else {
+	  b = nodes[node.offset[i]].merged_bounds();
+	}
+
+	node.set_bounds(i, b);
+      }
+
+      node.update_order();
+    }
+
+    if (!nodes.empty()) {
+      this->bounds = nodes[0].merged_bounds();
+    }
+  }
+
+  inline bool same_as(const base_t& base) const override {
+    if (base.width != N || base.intersector != I) {
+      return false;
+    }
+
+    const auto& other = static_cast<const backend_t&>(base);
+    return
+      nodes.size() == other.nodes.size() &&
+      qnodes.size() == other.qnodes.size() &&
+      things.size() == other.things.size() &&
+      memcmp(nodes.begin(), other.nodes.begin(), nodes.size() * sizeof(node_t)) == 0 &&
+      memcmp(qnodes.begin(), other.qnodes.begin(), qnodes.size() * sizeof(quantized_node_t)) == 0;
+  }
+
+  void write(std::ostream& out) const override {
+    out.write((const char*) &this->bounds, sizeof(this->bounds));
+    out.write((const char*) &this->build_cost, sizeof(this->build_cost));
+
+    nodes.write(out);
+    qnodes.write(out);
+    accelerator_t<T, N, I>::write(things, out);
+  }
+
+  void map(char*& cursor, const char* end) override {
+    map_value(cursor, end, this->bounds);
+    map_value(cursor, end, this->build_cost);
+
+    nodes.map(cursor, end);
+    qnodes.map(cursor, end);
+    accelerator_t<T, N, I>::map(things, cursor, end);
+
+    visit([&](const auto* begin) {
+      check(begin, quantized() ? qnodes.size() : nodes.size(), things.size());
+    });
+    depth = levels();
+  }
+
+  /**
+   * Call 'f' with the nodes of the hierarchy, quantized or full
+   * precision. Only eight wide hierarchies can be quantized, so other
+   * widths never instantiate their traversal with quantized nodes
+   *
+   */
+  template<typename F>
+  inline auto visit(const F& f) const {
+    return visit(f, quantizable_t());
+  }
+
+  template<typename F>
+  inline auto visit(const F& f, std::true_type) const {
+    return quantized() ? f(qnodes.begin()) : f(nodes.begin());
+  }
+
+  template<typename F>
+  inline auto visit(const F& f, std::false_type) const {
+    return f(nodes.begin());
+  }
+
+  static inline bounds::bounds_t<N> load_bounds(const node_t* node, const uint32_t* indices) {
+    return bounds::load<N>(node->bounds, indices);
+  }
+
+  static inline bounds::bounds_t<8> load_bounds(const quantized_node_t* node, const uint32_t*) {
+    return bounds::load(*node);
+  }
+
+  /**
+   * Push all children in 'mask' but the nearest, the farthest first, and
+   * return the nearest. Full precision nodes know the order of their
+   * children for every octant
+   *
+   */
+  static inline uint32_t push_children(
+    node_ref_t* stack
+  , int32_t& top
+  , const float* dists
+  , const node_t* node
+  , uint32_t octant
+  , size_t mask)
+  {
+    uint32_t nearest = 0;
+    bool     first   = true;
+    for (int32_t k=N-1; k>=0; --k) {
+      auto x = node->get_child(octant, k);
+      if ((mask & (1 << x)) == 0) {
+	continue;
+      }
+
+      if (!first) {
+	push(stack, top, dists, node, nearest);
+      }
+      nearest = x;
+      first   = false;
+    }
+    return nearest;
+  }
+
+  // quantized nodes have no room for orders, so their children are
+  // sorted by distance
+  static inline uint32_t push_children(
+    node_ref_t* stack
+  , int32_t& top
+  , const float* dists
+  , const quantized_node_t* node
+  , uint32_t
+  , size_t mask)
+  {
+    uint32_t ids[8];
+    auto n = 0;
+    while (mask != 0) {
+      auto x = __bscf(mask);
+
+      auto j = n++;
+      for (; j>0 && dists[ids[j-1]] < dists[x]; --j) {
+	ids[j] = ids[j-1];
+      }
+      ids[j] = x;
+    }
+
+    for (auto i=0; i<n-1; ++i) {
+      push(stack, top, dists, node, ids[i]);
+    }
+    return ids[n-1];
+  }
+
+  bool intersect(segment_t& segment, const vector_t& dir, bool occlusion_query) const override {
+    traversal_ray_t<segment_t, N> tray(segment.p, dir, &segment);
+    return traverse(tray, occlusion_query);
+  }
+
+  void intersect(segment_t* stream, const active_t& active) const override {
+    intersect_stream(stream, active);
+  }
+
+  void intersect(occlusion_query_t* stream, const active_t& active) const override {
+    intersect_stream(stream, active);
+  }
+
+  /**
+   * Traverse the hierarchy with a single ray, from the inner node 'root'
+   * down
+   *
+   */
+  template<typename U>
+  bool traverse(traversal_ray_t<U, N>& tray, bool occlusion_query, uint32_t root = 0) const {
+    static thread_local node_ref_t stack[STACK_SIZE];
+
+    return visit([&](const auto* nodes) {
+      return this->traverse(nodes, stack, tray, occlusion_query, root);
+    });
+  }
+
+  template<typename Node, typename U>
+  bool traverse(
+    const Node* nodes
+  , node_ref_t* stack
+  , traversal_ray_t<U, N>& tray
+  , bool occlusion_query
+  , uint32_t root) const
+  {
+    auto& segment = *tray.segment;
+
+    const auto octant = tray.octant();
+
+    bool hit_anything = false;
+
+    TRAVERSAL_STAT(auto& stats = traversal_stats());
+    TRAVERSAL_STAT(stats.single_rays += root == 0);
+
+    auto top = 1;
+    stack[0].offset = root;
+    stack[0].prims  = 0;
+    stack[0].d = std::numeric_limits<float>::lowest();
+
+    while (top > 0) {
+      auto cur = stack[--top];
+      if (cur.d > segment.d) {
+	continue;
+      }
+
+      while (cur.prims == 0) {
+	auto node = &nodes[cur.offset];
+	__aligned(64) auto bounds = load_bounds(node, indices());
+
+	TRAVERSAL_STAT(stats.nodes++);
+	TRAVERSAL_STAT(stats.node_tests++);
+	TRAVERSAL_STAT(segment.nodes++);
+
+	typename wide::float_t dist;
+	auto mask = simd::movemask(bounds::intersect_all<N>(
+	  tray.origin, tray.ood, tray.d,
+	  bounds, dist));
+
+	if (mask == 0) {
+	  break;
+	}
+
+	__aligned(64) float dists[N];
+	simd::store(dist, dists);
+
+	auto a = (mask & (mask - 1)) == 0
+	  ? __bsf(mask)
+	  : push_children(stack, top, dists, node, octant, mask);
+
+	cur.offset = node->get_offset(a);
+	cur.prims  = node->get_num(a);
+	cur.d      = dists[a];
+
+	TRAVERSAL_STAT(stats.depth(top));
+      }
+
+      if (cur.prims > 0) {
+	TRAVERSAL_STAT(stats.leaves++);
+	TRAVERSAL_STAT(stats.primitive_tests += cur.prims);
+	TRAVERSAL_STAT(segment.primitives += cur.prims);
+
+	for (auto j=0; j<blocks(cur.prims); ++j) {
+	  if (accelerator_t<T, N, I>::intersect(tray, things[cur.offset + j], occlusion_query)) {
+	    hit_anything = true;
+
+	    if (occlusion_query) {
+	      break;
+	    }
+	  }
+	}
+      }
+
+      if (hit_anything && occlusion_query) {
+	// stop traversal if this is an occlusion query. we just want to
+	// know if anything got hit
+	break;
+      }
+    }
+
+    return hit_anything;
+  }
+
+  template<typename Stream>
+  void intersect_stream(Stream* stream, const active_t& active) const {
+    static thread_local __attribute__((aligned (64))) traversal_ray_t<Stream, N> rays[256];
+
+    auto num = 0;
+    for (auto i=0; i<active.num; ++i) {
+      auto  index   = active.segment[i];
+      auto& segment = stream[index];
+      if (!segment.masked()) {
+	segment.miss();
+	// avoid copying of data and call constructor directly
+	new(rays + num++) traversal_ray_t<Stream, N>(segment.p, segment.wi, &segment);
+      }
+    }
+
+    if (this->packets && num > 0 && rays[0].segment->coherent()) {
+      traverse_packets(rays, num);
+    }
+    else if (this->interleave > 0) {
+      traverse_interleaved(rays, num);
+    }
+    else {
+      traverse(rays, num);
+    }
+  }
+
+  /**
+   * Traverse the hierarchy with a coherent stream in packets of
+   * consecutive rays. Packets, that can't be bounded well, are traversed
+   * as streams
+   *
+   */
+  template<typename Stream>
+  void traverse_packets(traversal_ray_t<Stream, N>* rays, uint32_t num) const {
+    static thread_local node_ref_t stack[PACKET_SIZE];
+
+    for (uint32_t first=0; first<num; first+=packet::SIZE) {
+      auto size = std::min(num - first, packet::SIZE);
+
+      packet::interval_t packet;
+      if (size < packet::MIN_RAYS || !packet.bound(rays + first, size)) {
+	traverse(rays + first, size);
+	continue;
+      }
+
+      visit([&](const auto* nodes) {
+	this->traverse(nodes, stack, packet, rays + first, size);
+      });
+    }
+  }
+
+  /**
+   * Traverse the hierarchy with a packet of rays. Nodes are culled for
+   * the whole packet, and visited by all of its rays front to back with
+   * a single stack. Only the children of a node, that are leaves, are
+   * tested against each ray
+   *
+   */
+  template<typename Node, typename Stream>
+  void traverse(
+    const Node* nodes
+  , node_ref_t* stack
+  , const packet::interval_t& packet
+  , traversal_ray_t<Stream, N>* rays
+  , uint32_t num) const
+  {
+    // the farthest any ray of the packet may still hit something
+    auto farthest = [&]() {
+      auto out = 0.0f;
+      for (auto i=0; i<num; ++i) {
+	out = std::max(out, rays[i].segment->d);
+      }
+      return out;
+    };
+
+    TRAVERSAL_STAT(auto& stats = traversal_stats());
+    TRAVERSAL_STAT(stats.packets++);
+    TRAVERSAL_STAT(stats.packet_rays += num);
+
+    auto max_d = farthest();
+
+    auto top = 1;
+    stack[0].offset = 0;
+    stack[0].prims  = 0;
+    stack[0].d      = 0.0f;
+
+    while (top > 0) {
+      const auto cur = stack[--top];
+      if (cur.d > max_d) {
+	continue;
+      }
+
+      auto node = &nodes[cur.offset];
+      __aligned(64) auto bounds = load_bounds(node, indices());
+
+      TRAVERSAL_STAT(stats.nodes++);
+      TRAVERSAL_STAT(stats.node_tests++);
+
+      typename wide::float_t entry;
+      auto mask = packet.intersect(bounds, max_d, entry);
+
+      size_t leaves = 0;
+      for (auto i=0; i<N; ++i) {
+	if ((mask & (1 << i)) != 0 && node->is_leaf(i)) {
+	  leaves |= 1 << i;
+	}
+      }
+
+      if (leaves != 0) {
+	// every ray tests the leaves it actually enters
+	for (auto i=0; i<num; ++i) {
+	  auto& ray = rays[i];
+	  if (Stream::stop_on_first_hit && ray.segment->is_hit()) {
+	    continue;
+	  }
+
+	  TRAVERSAL_STAT(ray.segment->nodes++);
+
+	  typename wide::float_t dist;
+	  auto hits = leaves & simd::movemask(bounds::intersect_all<N>(
+	    ray.origin, ray.ood, ray.d,
+	    bounds, dist));
+
+	  while (hits != 0) {
+	    auto x = __bscf(hits);
+
+	    TRAVERSAL_STAT(stats.leaves++);
+	    TRAVERSAL_STAT(stats.primitive_tests += node->get_num(x));
+	    TRAVERSAL_STAT(ray.segment->primitives += node->get_num(x));
+
+	    for (auto j=0; j<blocks(node->get_num(x)); ++j) {
+	      if (accelerator_t<T, N, I>::intersect(ray, things[node->get_offset(x) + j], Stream::stop_on_first_hit)) {
+		ray.segment->hit();
+
+		if (Stream::stop_on_first_hit) {
+		  hits = 0;
+		  break;
+		}
+	      }
+	    }
+	  }
+	}
+
+	max_d = farthest();
+      }
+
+      // push the inner children far to near, so the nearest is visited
+      // next
+      __aligned(64) float dists[N];
+      simd::store(entry, dists);
+
+      uint32_t ids[N];
+      auto n = 0;
+
+      mask &= ~leaves;
+      while (mask != 0) {
+	auto x = __bscf(mask);
+	if (dists[x] > max_d) {
+	  continue;
+	}
+
+	auto j = n++;
+	for (; j>0 && dists[ids[j-1]] < dists[x]; --j) {
+	  ids[j] = ids[j-1];
+	}
+	ids[j] = x;
+      }
+
+      for (auto i=0; i<n; ++i) {
+	stack[top].offset = node->get_offset(ids[i]);
+	stack[top].prims  = 0;
+	stack[top].d      = dists[ids[i]];
+	++top;
+      }
+
+      TRAVERSAL_STAT(stats.depth(top));
+    }
+  }
+
+  /**
+   * A ray of an interleaved traversal, with its own stack and the node
+   * or leaf it visits next
+   *
+   */
+  template<typename Stream>
+  struct flight_t {
+    traversal_ray_t<Stream, N>* ray;
+    uint32_t   octant;
+    int32_t    top;
+    node_ref_t cur;
+    node_ref_t stack[STACK_SIZE];
+  };
+
+  // fetch the cache lines of the node or leaf blocks 'ref' points to,
+  // while other rays are stepped
+  template<typename Node>
+  inline void prefetch(const Node* nodes, const node_ref_t& ref) const {
+    auto first = ref.prims == 0
+      ? (const char*) &nodes[ref.offset]
+      : (const char*) &things[ref.offset];
+    auto size = ref.prims == 0
+      ? sizeof(Node)
+      : sizeof(things[0]) * blocks(ref.prims);
+
+    for (size_t line=0; line<size; line+=64) {
+      __builtin_prefetch(first + line);
+    }
+  }
+
+  /**
+   * Traverse the hierarchy with the rays of an incoherent stream one by
+   * one, but with several rays in flight. Each ray visits one node or
+   * leaf per step, and the steps of the rays in flight take turns. The
+   * node or leaf a ray visits next is prefetched after each step, so it
+   * arrives in cache while the other rays are stepped
+   *
+   */
+  template<typename Stream>
+  void traverse_interleaved(traversal_ray_t<Stream, N>* rays, uint32_t num) const {
+    static thread_local flight_t<Stream> flights[MAX_IN_FLIGHT];
+
+    visit([&](const auto* nodes) {
+      this->traverse(nodes, flights, rays, num);
+    });
+  }
+
+  template<typename Node, typename Stream>
+  void traverse(
+    const Node* nodes
+  , flight_t<Stream>* flights
+  , traversal_ray_t<Stream, N>* rays
+  , uint32_t num) const
+  {
+    TRAVERSAL_STAT(traversal_stats().single_rays += num);
+
+    uint32_t next = 0;
+
+    // start the next ray of the stream at the root
+    auto start = [&](flight_t<Stream>& f) {
+      if (next == num) {
+	return false;
+      }
+
+      f.ray        = &rays[next++];
+      f.octant     = f.ray->octant();
+      f.top        = 0;
+      f.cur.offset = 0;
+      f.cur.prims  = 0;
+      f.cur.d      = std::numeric_limits<float>::lowest();
+      return true;
+    };
+
+    flight_t<Stream>* live[MAX_IN_FLIGHT];
+
+    uint32_t in_flight = 0;
+    while (in_flight < std::min(this->interleave, MAX_IN_FLIGHT) && start(flights[in_flight])) {
+      live[in_flight] = &flights[in_flight];
+      ++in_flight;
+    }
+
+    while (in_flight > 0) {
+      for (uint32_t i=0; i<in_flight;) {
+	auto& f = *live[i];
+	if (step(nodes, f)) {
+	  prefetch(nodes, f.cur);
+	  ++i;
+	}
+	else if (start(f)) {
+	  ++i;
+	}
+	else {
+	  // no rays left to start, so the last ray in flight takes over
+	  std::swap(live[i], live[--in_flight]);
+	}
+      }
+    }
+  }
+
+  /**
+   * Visit the node or leaf a ray in flight is at, and move it to the one
+   * it visits next. Returns false, once the ray is done
+   *
+   */
+  template<typename Node, typename Stream>
+  inline bool step(const Node* nodes, flight_t<Stream>& f) const {
+    auto& ray     = *f.ray;
+    auto& segment = *ray.segment;
+    auto& cur     = f.cur;
+
+    TRAVERSAL_STAT(auto& stats = traversal_stats());
+
+    if (cur.prims == 0) {
+      auto node = &nodes[cur.offset];
+      __aligned(64) auto bounds = load_bounds(node, indices());
+
+      TRAVERSAL_STAT(stats.nodes++);
+      TRAVERSAL_STAT(stats.node_tests++);
+      TRAVERSAL_STAT(segment.nodes++);
+
+      typename wide::float_t dist;
+      auto mask = simd::movemask(bounds::intersect_all<N>(
+	ray.origin, ray.ood, ray.d,
+	bounds, dist));
+
+      if (mask != 0) {
+	__aligned(64) float dists[N];
+	simd::store(dist, dists);
+
+	auto a = (mask & (mask - 1)) == 0
+	  ? __bsf(mask)
+	  : push_children(f.stack, f.top, dists, node, f.octant, mask);
+
+	cur.offset = node->get_offset(a);
+	cur.prims  = node->get_num(a);
+	cur.d      = dists[a];
+
+	TRAVERSAL_STAT(stats.depth(f.top));
+	return true;
+      }
+    }
+    else {
+      TRAVERSAL_STAT(stats.leaves++);
+      TRAVERSAL_STAT(stats.primitive_tests += cur.prims);
+      TRAVERSAL_STAT(segment.primitives += cur.prims);
+
+      for (auto j=0; j<blocks(cur.prims); ++j) {
+	if (accelerator_t<T, N, I>::intersect(ray, things[cur.offset + j], Stream::stop_on_first_hit)) {
+	  segment.hit();
+
+	  if (Stream::stop_on_first_hit) {
+	    return false;
+	  }
+	}
+      }
+    }
+
+    // continue with the nearest node on the stack, that is still in
+    // front of the closest hit
+    while (f.top > 0) {
+      cur = f.stack[--f.top];
+      if (cur.d <= segment.d) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Traverse the hierarchy with a stream of up to 256 rays
+   *
+   */
+  template<typename Stream>
+  void traverse(traversal_ray_t<Stream, N>* rays, uint32_t num) const {
+    auto& l = lanes();
+    l.reserve(depth);
+
+    visit([&](const auto* nodes) {
+      this->traverse(nodes, l, rays, num);
+    });
+  }
+
+  /**
+   * The lanes of the calling thread, shared by both kinds of streams and
+   * all hierarchies of this type. They grow to the deepest hierarchy
+   * traversed, so only the width picked at runtime takes memory
+   *
+   */
+  static inline stream::lanes_t<N>& lanes() {
+    static thread_local stream::lanes_t<N> out;
+    return out;
+  }
+
+  /**
+   * Test the rays of the task 'cur' against the children of its node, and
+   * push a task for each child with the rays entering it. The rays of the
+   * new tasks take the place of the rays of 'cur', in the order the tasks
+   * are pushed. With 'sorted' the children are pushed far to near, by the
+   * summed distances the rays enter them at
+   *
+   */
+  template<typename Node, typename Stream>
+  inline void split(
+    const Node* node
+  , const stream::task_t& cur
+  , stream::lanes_t<N>& lanes
+  , int32_t& top
+  , const traversal_ray_t<Stream, N>* rays
+  , bool sorted) const
+  {
+    const auto todo = &lanes.rays[cur.first];
+
+    uint32_t ids[stream::MAX_RAYS];
+    uint32_t masks[stream::MAX_RAYS];
+    uint32_t num_active[N] = { 0 };
+
+    __aligned(64) auto bounds = load_bounds(node, indices());
+
+    auto length = wide::load(0.0f);
+    for (auto i=0; i<cur.num_rays; ++i) {
+      const auto& ray = rays[todo[i]];
+
+      TRAVERSAL_STAT(ray.segment->nodes++);
+
+      typename wide::float_t dist;
+
+      auto hits = bounds::intersect_all<N>(
+	ray.origin, ray.ood, ray.d,
+	bounds, dist);
+
+      length = simd::add(length, simd::mand(dist, hits));
+
+      auto mask = simd::movemask(hits);
+      ids[i]    = todo[i];
+      masks[i]  = mask;
+
+      while(mask != 0) {
+	num_active[__bscf(mask)]++;
+      }
+    }
+
+    uint32_t order[N];
+
+    __aligned(64) float dists[N];
+    simd::store(length, dists);
+
+    auto n=0;
+    for (auto i=0; i<N; ++i) {
+      if (num_active[i] > 0) {
+	auto j = n++;
+	for (; sorted && j>0 && dists[i] > dists[order[j-1]]; --j) {
+	  order[j] = order[j-1];
+	}
+	order[j] = i;
+      }
+    }
+
+    // the rays of each child follow the rays of the child pushed before
+    uint32_t next[N];
+    auto first = cur.first;
+    for (auto i=0; i<n; ++i) {
+      next[order[i]] = first;
+      push(lanes.tasks.data(), top, node, order[i], num_active[order[i]], first);
+      first += num_active[order[i]];
+    }
+
+    for (auto i=0; i<cur.num_rays; ++i) {
+      size_t mask = masks[i];
+      while(mask != 0) {
+	lanes.rays[next[__bscf(mask)]++] = ids[i];
+      }
+    }
+  }
+
+  template<typename Node, typename Stream>
+  void traverse(
+    const Node* nodes
+  , stream::lanes_t<N>& lanes
+  , traversal_ray_t<Stream, N>* rays
+  , uint32_t num) const
+  {
+    // all rays were masked
+    if (num == 0) {
+      return;
+    }
+
+    for (auto i=0; i<num; ++i) {
+      lanes.rays[i] = i;
+    }
+
+    auto top = 0;
+    push(lanes.tasks.data(), top, num);
+
+    TRAVERSAL_STAT(auto& stats = traversal_stats());
+    TRAVERSAL_STAT(stats.streams++);
+    TRAVERSAL_STAT(stats.stream_rays += num);
+
+    while (top > 0) {
+      const auto cur  = lanes.tasks[--top];
+      const auto todo = &lanes.rays[cur.first];
+
+      if (!cur.is_leaf() && cur.num_rays < this->single_ray_threshold) {
+	// too few rays left to share the nodes below, so each of them
+	// continues on its own
+	for (auto i=0; i<cur.num_rays; ++i) {
+	  auto& ray = rays[todo[i]];
+
+	  TRAVERSAL_STAT(stats.hybrid_rays++);
+	  if (traverse(ray, false, cur.offset)) {
+	    ray.segment->hit();
+	  }
+	}
+      }
+      else if (!cur.is_leaf()) {
+	TRAVERSAL_STAT(stats.nodes++);
+	TRAVERSAL_STAT(stats.node_tests += cur.num_rays);
+	TRAVERSAL_STAT(stats.task(cur.num_rays));
+
+	split(&nodes[cur.offset], cur, lanes, top, rays, true);
+
+	TRAVERSAL_STAT(stats.depth(top));
+      }
+      else {
+	TRAVERSAL_STAT(stats.leaves++);
+	TRAVERSAL_STAT(stats.primitive_tests += cur.prims * cur.num_rays);
+
+#ifdef TRAVERSAL_STATS
+	for (auto i=0; i<cur.num_rays; ++i) {
+	  rays[todo[i]].segment->primitives += cur.prims;
+	}
+#endif
+
+	for (auto j=0; j<blocks(cur.prims); ++j) {
+	  accelerator_t<T, N, I>::intersect(rays, todo, cur.num_rays, things[cur.offset + j]);
+	}
+      }
+    }
+  }
+
+  /**
+   * Traverse the hierarchy with a stream of up to 256 occlusion queries.
+   * A query is done with its first hit, so occluded queries are dropped
+   * from the rays of every task when it is popped, and from the rays of a
+   * leaf after each block. Tasks without unoccluded rays are skipped, and
+   * the traversal ends once all queries are occluded. Any hit will do, so
+   * children are visited in the order of the node
+   *
+   */
+  template<typename Node>
+  void traverse(
+    const Node* nodes
+  , stream::lanes_t<N>& lanes
+  , traversal_ray_t<occlusion_query_t, N>* rays
+  , uint32_t num) const
+  {
+    // all rays were masked
+    if (num == 0) {
+      return;
+    }
+
+    for (auto i=0; i<num; ++i) {
+      lanes.rays[i] = i;
+    }
+
+    // queries, that haven't hit anything yet
+    auto unoccluded = num;
+
+    auto top = 0;
+    push(lanes.tasks.data(), top, num);
+
+    TRAVERSAL_STAT(auto& stats = traversal_stats());
+    TRAVERSAL_STAT(stats.streams++);
+    TRAVERSAL_STAT(stats.stream_rays += num);
+
+    while (top > 0 && unoccluded > 0) {
+      auto cur  = lanes.tasks[--top];
+      auto todo = &lanes.rays[cur.first];
+
+      uint32_t n = 0;
+      for (auto i=0; i<cur.num_rays; ++i) {
+	if (!rays[todo[i]].segment->is_hit()) {
+	  todo[n++] = todo[i];
+	}
+      }
+      cur.num_rays = n;
+
+      if (n == 0) {
+	continue;
+      }
+
+      if (!cur.is_leaf() && n < this->single_ray_threshold) {
+	for (auto i=0; i<n; ++i) {
+	  auto& ray = rays[todo[i]];
+
+	  TRAVERSAL_STAT(stats.hybrid_rays++);
+	  if (traverse(ray, true, cur.offset)) {
+	    ray.segment->hit();
+	    --unoccluded;
+	  }
+	}
+      }
+      else if (!cur.is_leaf()) {
+	TRAVERSAL_STAT(stats.nodes++);
+	TRAVERSAL_STAT(stats.node_tests += n);
+	TRAVERSAL_STAT(stats.task(n));
+
+	split(&nodes[cur.offset], cur, lanes, top, rays, false);
+
+	TRAVERSAL_STAT(stats.depth(top));
+      }
+      else {
+	TRAVERSAL_STAT(stats.leaves++);
+
+	auto left = n;
+	for (auto j=0; j<blocks(cur.prims) && left > 0; ++j) {
+	  TRAVERSAL_STAT(stats.primitive_tests += std::min<uint32_t>(cur.prims - j * N, N) * left);
+	  left = accelerator_t<T, N, I>::occlude(rays, todo, left, things[cur.offset + j]);
+	}
+
+	unoccluded -= n - left;
+      }
+    }
+  }
+};
+
+/**
+ * Instances are intersected by transforming rays into the object space
+ * of the instanced mesh or particles, and traversing its bottom level
+ * hierarchy. The bottom level hierarchies have the same width as the top
+ * level. Hierarchies over spheres are built with the same backend for
+ * every triangle test
+ *
+ */
+template<int N, int I>
+struct accelerator_t<instance_t, N, I> {
+  struct instances_t {
+    uint32_t        num;
+    instance_t::p   instances[N];
+  };
+
+  typedef std::vector<instances_t, aligned_allocator_t<instances_t, 64>> storage_t;
+
+  typedef backend_t<triangle_t, N, I> mesh_backend_t;
+  typedef backend_t<sphere_t, N, bvh_options_t::MOELLER_TRUMBORE> sphere_backend_t;
+
+  // the closest or any hit in the bottom level hierarchy of an instance
+  template<typename U>
+  static inline bool traverse(const instance_t& instance, traversal_ray_t<U, N>& ray, bool occlusion_query) {
+    return instance.spheres
+      ? static_cast<const sphere_backend_t&>(*instance.spheres->impl).traverse(ray, occlusion_query)
+      : static_cast<const mesh_backend_t&>(*instance.bvh->impl).traverse(ray, occlusion_query);
+  }
+
+  template<typename U>
+  static inline void traverse(const instance_t& instance, traversal_ray_t<U, N>* rays, uint32_t num) {
+    if (instance.spheres) {
+      static_cast<const sphere_backend_t&>(*instance.spheres->impl).traverse(rays, num);
+    }
+    else {
+      static_cast<const mesh_backend_t&>(*instance.bvh->impl).traverse(rays, num);
+    }
+  }
+
+  template<typename U>
+  static inline bool intersect(traversal_ray_t<U, N>& ray, const instances_t& block, bool occlusion_query) {
+    bool hit = false;
+    for (auto i=0; i<block.num; ++i) {
+      const auto& instance = *block.instances[i];
+
+      traversal_ray_t<U, N> local(instance.to_object, ray);
+      if (traverse(instance, local, occlusion_query)) {
+	ray.segment->instanced(instance.id);
+	ray.d = local.d;
+	hit   = true;
+
+	if (occlusion_query) {
+	  break;
+	}
+      }
+    }
+    return hit;
+  }
+
+  template<typename U>
+  static inline void intersect(
+    traversal_ray_t<U, N>* rays
+  , const uint32_t* ids
+  , uint32_t num
+  , const instances_t& block)
+  {
+    static thread_local __attribute__((aligned (64))) traversal_ray_t<U, N> local[256];
+
+    float_t d[256];
+    for (auto i=0; i<num; ++i) {
+      d[i] = rays[ids[i]].segment->d;
+    }
+
+    for (auto j=0; j<block.num; ++j) {
+      const auto& instance = *block.instances[j];
+
+      for (auto i=0; i<num; ++i) {
+	new(local + i) traversal_ray_t<U, N>(instance.to_object, rays[ids[i]]);
+      }
+
+      traverse(instance, local, num);
+
+      // rays with a closer hit than before hit this instance
+      for (auto i=0; i<num; ++i) {
+	auto& ray = rays[ids[i]];
+	if (ray.segment->d < d[i]) {
+	  d[i]  = ray.segment->d;
+	  ray.d = simd_t<N>::load(d[i]);
+	  ray.segment->instanced(instance.id);
+	}
+      }
+    }
+  }
+
+  template<typename U>
+  static inline uint32_t occlude(
+    traversal_ray_t<U, N>* rays
+  , uint32_t* ids
+  , uint32_t num
+  , const instances_t& block)
+  {
+    static thread_local __attribute__((aligned (64))) traversal_ray_t<U, N> local[256];
+
+    for (auto j=0; j<block.num && num > 0; ++j) {
+      const auto& instance = *block.instances[j];
+
+      for (auto i=0; i<num; ++i) {
+	new(local + i) traversal_ray_t<U, N>(instance.to_object, rays[ids[i]]);
+      }
+
+      traverse(instance, local, num);
+
+      auto out = 0;
+      for (auto i=0; i<num; ++i) {
+	if (!rays[ids[i]].segment->is_hit()) {
+	  ids[out++] = ids[i];
+	}
+      }
+      num = out;
+    }
+    return num;
+  }
+
+  static inline uint32_t insert_things(
+    uint32_t start
+  , uint32_t end
+  , const std::vector<build::primitive_t>& primitives
+  , const std::vector<instance_t::p>& unsorted
+  , storage_t& things)
+  {
+    auto index = things.size();
+    for (auto i=start; i<end; i+=N) {
+      instances_t block;
+      block.num = std::min(end-i, (uint32_t) N);
+
+      for (auto j=0; j<block.num; ++j) {
+	block.instances[j] = unsorted[primitives[i+j].index];
+
+	// rays are handed to the bottom level without conversion
+	const auto& instance = *block.instances[j];
+	if (instance.spheres) {
+	  if (instance.spheres->impl->width != N) {
+	    throw std::runtime_error("instanced particles need hierarchies of the same width as the scene");
+	  }
+	}
+	else if (instance.bvh->impl->width != N || instance.bvh->impl->intersector != I) {
+	  throw std::runtime_error("instanced meshes need hierarchies of the same width and triangle test as the scene");
+	}
+      }
+
+      things.push_back(block);
+    }
+    return index;
+  }
+
+  // the bottom level hierarchies are refitted by the scene
+  static inline aabb_t refit(const instances_t& block, const std::vector<mesh_t::p>&) {
+    aabb_t out;
+    for (auto i=0; i<block.num; ++i) {
+      out = bounds::merge(out, block.instances[i]->bounds());
+    }
+    return out;
+  }
+
+  // instances refer to their meshes by pointer, so they can't be stored
+  static inline void write(const storage_t&, std::ostream&) {
+    throw std::runtime_error("hierarchies over instances can't be stored");
+  }
+
+  static inline void map(storage_t&, char*&, const char*) {
+    throw std::runtime_error("hierarchies over instances can't be mapped");
+  }
+};
+
+template<typename T, int N, int I>
+typename bvh_t<T>::impl_t* make_backend() {
+  return new backend_t<T, N, I>();
+}
@@ -12,6 +12,11 @@
 
 namespace build {
   static const uint8_t MAX_PRIMS_IN_NODE = 8;
+  // most primitives in a leaf, as many as the nodes can count
+  static const uint32_t MAX_PRIMS_IN_LEAF = 255;
+  // children of the widest nodes, which bounds the children a node may be
+  // split into
+  static const uint32_t MAX_WIDTH = 16;
   static const uint8_t NUM_SPLIT_BINS    = 12;
 
   struct primitive_t {
@@ -110,6 +115,11 @@ namespace build {
       bounds = bounds::merge(bounds, p.bounds);
       count++;
     }
+
+    inline void merge(const bin_t& b) {
+      bounds = bounds::merge(bounds, b.bounds);
+      count += b.count;
+    }
   };
 
   template<int N>
@@ -124,6 +134,12 @@ namespace build {
       bins[find(bounds, p, axis)].add(p);
     }
 
+    inline void merge(const bins_t& b) {
+      for (auto i=0; i<N; ++i) {
+	bins[i].merge(b.bins[i]);
+      }
+    }
+
     static inline uint32_t find(const aabb_t& bounds, const primitive_t& p, uint8_t axis) {
       auto offset = bounds::offset(bounds, p.centroid).v[axis];
       return std::min((int) (N * offset), N-1);
@@ -142,26 +158,62 @@ namespace build {
     return g.count() < MAX_PRIMS_IN_NODE;
   }
 
+  inline bool too_large_for_leaf(const geometry_t& g) {
+    return g.count() > MAX_PRIMS_IN_LEAF;
+  }
+
   inline float leaf_cost(const split_t& s, const geometry_t& g) {
     return g.count();
   }
 
-  split_t find(const geometry_t& geometry) {
+  /**
+   * Split bins for all three axes
+   *
+   */
+  struct binning_t {
+    bins_t<NUM_SPLIT_BINS> axis[3];
+
+    inline void merge(const binning_t& b) {
+      for (auto i=0; i<3; ++i) {
+	axis[i].merge(b.axis[i]);
+      }
+    }
+  };
+
+  /**
+   * Sort the primitives [begin, end) of a geometry into the split bins
+   * of all three axes
+   *
+   */
+  inline void bin(const geometry_t& geometry, uint32_t begin, uint32_t end, binning_t& bins) {
+    for (auto axis=0; axis<3; ++axis) {
+      if (geometry.centroid_bounds.empty_on(axis)) {
+	continue;
+      }
+
+      for (auto i=begin; i<end; ++i) {
+	bins.axis[axis].add(geometry.centroid_bounds, geometry.primitive(i), axis);
+      }
+    }
+  }
+
+  /**
+   * Find the split with the lowest SAH cost, given the binned primitives
+   * of a geometry
+   *
+   */
+  inline split_t find(const geometry_t& geometry, const binning_t& binned) {
     auto best_axis = 0;
     auto best_bin  = 0;
     auto best_cost = std::numeric_limits<float_t>::max();
 
     for (auto axis=0; axis<3; ++axis) {
-      bins_t<NUM_SPLIT_BINS> bins;
+      const auto& bins = binned.axis[axis];
 
       if (geometry.centroid_bounds.empty_on(axis)) {
 	continue;
       }
 
-      for (auto i=0; i<geometry.count(); ++i) {
-	bins.add(geometry.centroid_bounds, geometry.primitive(i), axis);
-      }
-
       auto split_cost = std::numeric_limits<float_t>::max();
       auto split_bin  = 0;
 
@@ -194,23 +246,65 @@ namespace build {
     return split_t(best_axis, best_bin, best_cost);
   }
 
-  void split(const split_t& split, geometry_t& parent, geometry_t& l, geometry_t& r) {
+  inline split_t find(const geometry_t& geometry) {
+    binning_t bins;
+    bin(geometry, 0, geometry.count(), bins);
+    return find(geometry, bins);
+  }
+
+  inline void split(const split_t& split, geometry_t& parent, geometry_t& l, geometry_t& r) {
     parent.partition([&](const primitive_t& p) {
 	auto bin = bins_t<NUM_SPLIT_BINS>::find(parent.centroid_bounds, p, split.axis);
 	return bin <= split.bin; 
       }, l, r);
   }
 
-  int32_t largest_node(const geometry_t* node, uint32_t n) {
+  /**
+   * Split a geometry in half at the median of its centroids, along the
+   * axis they spread most along. This divides geometries no binned split
+   * can, e.g. primitives sharing their centroid
+   *
+   */
+  inline void median_split(geometry_t& parent, geometry_t& l, geometry_t& r) {
+    const auto axis = parent.centroid_bounds.dominant_axis();
+    const auto mid  = parent.start + parent.count() / 2;
+
+    std::nth_element(
+      parent.primitives.begin() + parent.start,
+      parent.primitives.begin() + mid,
+      parent.primitives.begin() + parent.end,
+      [axis](const primitive_t& a, const primitive_t& b) {
+	return a.centroid.v[axis] < b.centroid.v[axis];
+      });
+
+    l = {parent.primitives, parent.start, mid};
+    r = {parent.primitives, mid, parent.end};
+  }
+
+  // split at the median instead, if the split leaves a side empty
+  inline void split_or_median(const split_t& s, geometry_t& parent, geometry_t& l, geometry_t& r) {
+    split(s, parent, l, r);
+    if (l.count() == 0 || r.count() == 0) {
+      median_split(parent, l, r);
+    }
+  }
+
+  /**
+   * The child with the largest surface area among those with enough
+   * primitives to be split, or -1 if there is none. Splitting it first
+   * takes the most area off the children rays have to enter
+   *
+   */
+  inline int32_t largest_node(const geometry_t* node, uint32_t n) {
     int32_t out = -1;
-    float   a   = std::numeric_limits<float>::max(); 
+    float   a   = std::numeric_limits<float>::lowest();
     for (auto i=0; i<n; ++i) {
       if (node[i].count() < MAX_PRIMS_IN_NODE) {
 	continue;
       }
 
       auto node_area = node[i].bounds.area();
-      if (node_area < a) {
+      if (node_area > a) {
 	out = i;
 	a   = node_area;
       }
@@ -218,21 +312,27 @@ namespace build {
     return out;
   }
 
-  template<typename Things, typename BVH>
-  uint32_t from(geometry_t& geometry, const Things& things, BVH& bvh) {
-    auto n = geometry.count();
+  /**
+   * Split a geometry into up to N children, using the split finder
+   * 'find'. Returns the number of children, or 0 if the geometry should
+   * become a leaf. Geometries with more primitives than a leaf holds are
+   * always split
+   *
+   */
+  template<int N, typename Find>
+  uint32_t subdivide(geometry_t& geometry, geometry_t* children, const Find& find) {
     auto s = find(geometry);
 
-    if (too_small_to_split(geometry) || leaf_cost(s, geometry) <= 1.0f + s.cost) {
+    if (too_small_to_split(geometry) ||
+	(leaf_cost(s, geometry) <= 1.0f + s.cost && !too_large_for_leaf(geometry))) {
       return 0;
     }
 
     auto num_children = 2;
-    geometry_t children[8] = { [0 ... 7] = { geometry } };
 
-    split(s, geometry, children[0], children[1]);
+    split_or_median(s, geometry, children[0], children[1]);
 
-    while (num_children < 8) {
+    while (num_children < N) {
       auto split_child = largest_node(children, num_children);
       if (split_child == -1) {
 	break;
@@ -240,18 +340,38 @@ namespace build {
       auto s = find(children[split_child]);
       // check sha heuristic?
       geometry_t tmp(geometry);
-      split(s, children[split_child], tmp, children[num_children]);
+      split_or_median(s, children[split_child], tmp, children[num_children]);
       children[split_child] = tmp;
 
       ++num_children;
     }
 
+    return num_children;
+  }
+
+  /**
+   * Build a BVH of N wide nodes, starting with the root at the first free
+   * node
+   *
+   */
+  template<int N, typename Things, typename BVH>
+  uint32_t from(geometry_t& geometry, const Things& things, BVH& bvh) {
+    geometry_t children[MAX_WIDTH] = { [0 ... 15] = { geometry } };
+
+    auto num_children = subdivide<N>(geometry, children, [](const geometry_t& g) {
+      return find(g);
+    });
+
+    if (num_children == 0) {
+      return 0;
+    }
+
     // make a new node in the BVH
     auto node_index = bvh.make_node();
 
     int32_t child_indices[num_children];
     for (int i=0; i<num_children; ++i) {
-      child_indices[i] = from(children[i], things, bvh);
+      child_indices[i] = from<N>(children[i], things, bvh);
     }
 
     auto node = bvh.resolve(node_index);
@@ -0,0 +1,39 @@
+#pragma once
+
+/**
+ * Everything the backends of all widths share. The wider backends
+ * include this before they switch to their instruction set, so the
+ * inline functions in here are compiled for SSE4.2 in every object, and
+ * it does not matter which copy the linker keeps
+ *
+ */
+#include "impl.hpp"
+
+#include "precision.hpp"
+#include "shading.hpp"
+#include "math/aabb.hpp"
+#include "math/simd.hpp"
+#include "util/buffer.hpp"
+#include "util/compiler.hpp"
+#include "util/stats.hpp"
+#include "things/instance.hpp"
+
+#include "node.hpp"
+#include "build.hpp"
+#include "morton.hpp"
+#include "parallel.hpp"
+#include "layout.hpp"
+#include "spatial.hpp"
+#include "stacks.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <string.h>
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "things/mesh.hpp"
+#include "traversal/bvh.hpp"
+
+#include <ostream>
+#include <vector>
+
+/**
+ * The part of a hierarchy, that depends on the width of its nodes. Each
+ * width is compiled for its own instruction set, and the width is picked
+ * at runtime from what the processor supports
+ *
+ */
+template<typename T>
+struct bvh_t<T>::impl_t {
+  aabb_t   bounds;
+  // children per node, and primitives per leaf block
+  uint32_t width;
+  // the triangle intersection test, one of bvh_options_t::intersector_t
+  uint32_t intersector;
+  // SAH cost of the hierarchy right after it was built
+  float_t  build_cost;
+  // stream tasks with fewer rays continue each ray on its own
+  uint32_t single_ray_threshold;
+  // trace coherent streams in packets
+  bool     packets;
+  // rays in flight for interleaved traversal of incoherent streams
+  uint32_t interleave;
+
+  impl_t(uint32_t width, uint32_t intersector)
+    : width(width), intersector(intersector), build_cost(0), single_ray_threshold(0), packets(false), interleave(0)
+  {}
+
+  virtual ~impl_t()
+  {}
+
+  virtual void build(const std::vector<typename T::p>& unsorted, const options_t& options) = 0;
+
+  virtual void refit(const std::vector<mesh_t::p>& meshes) = 0;
+
+  virtual float_t cost() const = 0;
+
+  virtual bool quantized() const = 0;
+
+  // size of all nodes in bytes
+  virtual size_t node_memory() const = 0;
+
+  // number of leaf blocks
+  virtual size_t blocks() const = 0;
+
+  // scratch memory each thread needs to traverse streams
+  virtual size_t stream_memory() const = 0;
+
+  virtual bool same_as(const impl_t& other) const = 0;
+
+  virtual void write(std::ostream& out) const = 0;
+
+  virtual void map(char*& cursor, const char* end) = 0;
+
+  virtual bool intersect(segment_t& segment, const vector_t& dir, bool occlusion_query) const = 0;
+
+  virtual void intersect(segment_t* stream, const active_t& active) const = 0;
+
+  virtual void intersect(occlusion_query_t* stream, const active_t& active) const = 0;
+};
+
+/**
+ * Create an empty hierarchy of N wide nodes, intersecting triangles with
+ * the test 'I'. Each width is instantiated in the translation unit
+ * compiled for its instruction set
+ *
+ */
+template<typename T, int N, int I>
+typename bvh_t<T>::impl_t* make_backend();
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "build.hpp"
+#include "node.hpp"
+
+#include "util/buffer.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace build {
+  // levels of the hierarchy stored breadth first at the start of the
+  // nodes. every traversal touches them, so they stay in cache together
+  static const uint32_t LAYOUT_TOP_LEVELS = 3;
+
+  /**
+   * Reorder the nodes of a hierarchy for traversal. The top levels are
+   * stored breadth first, every subtree below them depth first with the
+   * children in order of their surface area. The child a ray most
+   * likely visits then follows its parent, and the nodes of a subtree
+   * share pages. Leaf blocks of up to N primitives are stored in the
+   * order of their nodes, so the blocks of all leaves of a node follow
+   * each other.
+   *
+   * Parents still precede their children, which refitting relies on
+   *
+   */
+  template<int N, typename Storage>
+  void reorder(buffer_t<mbvh_node_t<N>>& nodes, Storage& things) {
+    if (nodes.empty()) {
+      return;
+    }
+
+    // source node of every node in the new order
+    std::vector<uint32_t> order = { 0 };
+    order.reserve(nodes.size());
+
+    // the children of a node, the largest first
+    auto children = [&](uint32_t n, uint32_t* out) {
+      const auto& node = nodes[n];
+
+      uint32_t num = 0;
+      for (auto i=0; i<N; ++i) {
+	if (!node.is_empty(i) && !node.is_leaf(i)) {
+	  out[num++] = i;
+	}
+      }
+
+      std::sort(out, out + num, [&](uint32_t a, uint32_t b) {
+	return node.get_bounds(a).area() > node.get_bounds(b).area();
+      });
+      return num;
+    };
+
+    uint32_t slots[N];
+
+    // breadth first through the top levels
+    size_t level_start = 0;
+    for (uint32_t level=1; level<LAYOUT_TOP_LEVELS; ++level) {
+      const auto level_end = order.size();
+      for (auto q=level_start; q<level_end; ++q) {
+	const auto num = children(order[q], slots);
+	for (auto i=0; i<num; ++i) {
+	  order.push_back(nodes[order[q]].offset[slots[i]]);
+	}
+      }
+      level_start = level_end;
+    }
+
+    // and depth first below every node of the last top level
+    std::vector<uint32_t> stack;
+    for (auto q=level_start, level_end=order.size(); q<level_end; ++q) {
+      const auto num = children(order[q], slots);
+      for (int32_t i=num-1; i>=0; --i) {
+	stack.push_back(nodes[order[q]].offset[slots[i]]);
+      }
+
+      while (!stack.empty()) {
+	const auto n = stack.back();
+	stack.pop_back();
+	order.push_back(n);
+
+	const auto num = children(n, slots);
+	for (int32_t i=num-1; i>=0; --i) {
+	  stack.push_back(nodes[n].offset[slots[i]]);
+	}
+      }
+    }
+
+    std::vector<uint32_t> position(nodes.size());
+    for (uint32_t i=0; i<order.size(); ++i) {
+      position[order[i]] = i;
+    }
+
+    buffer_t<mbvh_node_t<N>> sorted_nodes;
+    Storage sorted_things;
+
+    for (const auto n: order) {
+      auto node = nodes[n];
+
+      for (auto i=0; i<N; ++i) {
+	if (node.is_empty(i)) {
+	  continue;
+	}
+
+	if (node.is_leaf(i)) {
+	  auto first = sorted_things.size();
+	  auto num_blocks = (node.num[i] + N - 1) / N;
+	  for (auto j=0; j<num_blocks; ++j) {
+	    sorted_things.push_back(things[node.offset[i] + j]);
+	  }
+	  node.set_offset(i, first);
+	}
+	else {
+	  node.set_offset(i, position[node.offset[i]]);
+	}
+      }
+
+      sorted_nodes.push_back(node);
+    }
+
+    nodes.swap(sorted_nodes);
+    things.swap(sorted_things);
+  }
+}
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "build.hpp"
+#include "parallel.hpp"
+
+#include "util/algo.hpp"
+#include "util/thread_pool.hpp"
+
+#include <vector>
+
+/**
+ * A linear BVH builder (Lauterbach et al. 2009). Primitives are sorted
+ * along a Morton curve through their centroids, and nodes are split at
+ * the highest bit in which the codes of their primitives differ. This
+ * builds much faster than the SAH builders, but produces a tree that is
+ * slower to trace
+ *
+ */
+namespace build {
+  namespace morton {
+    static const uint32_t BITS_PER_AXIS = 10;
+    static const uint32_t RADIX_BITS    = 8;
+    static const uint32_t NUM_BUCKETS   = 1 << RADIX_BITS;
+    // number of primitives per task when computing and sorting codes
+    static const uint32_t CHUNK_SIZE    = 1<<16;
+
+    struct entry_t {
+      uint32_t code;
+      uint32_t index;
+    };
+
+    // spread the lower ten bits of v, so there are two zero bits
+    // between each of them
+    inline uint32_t expand(uint32_t v) {
+      v = (v * 0x00010001u) & 0xFF0000FFu;
+      v = (v * 0x00000101u) & 0x0F00F00Fu;
+      v = (v * 0x00000011u) & 0xC30C30C3u;
+      v = (v * 0x00000005u) & 0x49249249u;
+      return v;
+    }
+
+    inline uint32_t encode(const aabb_t& bounds, const vector_t& p) {
+      static const float_t scale = (1 << BITS_PER_AXIS) - 1;
+
+      auto o = bounds::offset(bounds, p);
+      auto x = (uint32_t) clamp(o.x * scale, 0.0f, scale);
+      auto y = (uint32_t) clamp(o.y * scale, 0.0f, scale);
+      auto z = (uint32_t) clamp(o.z * scale, 0.0f, scale);
+
+      return (expand(x) << 2) | (expand(y) << 1) | expand(z);
+    }
+
+    template<typename F>
+    inline void for_each_chunk(thread_pool_t& pool, uint32_t n, const F& f) {
+      auto num_chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+      task_group_t tasks(pool);
+      for (uint32_t i=0; i<num_chunks; ++i) {
+	tasks.spawn([&f, i, n]() {
+	  f(i, i * CHUNK_SIZE, std::min(n, (i + 1) * CHUNK_SIZE));
+	});
+      }
+      tasks.wait();
+    }
+
+    /**
+     * Parallel least significant digit radix sort of the entries by
+     * their Morton codes. Each chunk of entries is histogrammed and
+     * scattered by its own task. The sort is stable
+     *
+     */
+    inline void sort(thread_pool_t& pool, std::vector<entry_t>& entries) {
+      const uint32_t n = entries.size();
+      const uint32_t num_chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+      std::vector<entry_t>  tmp(n);
+      std::vector<uint32_t> offsets(num_chunks * NUM_BUCKETS);
+
+      for (auto shift=0; shift<BITS_PER_AXIS*3; shift+=RADIX_BITS) {
+	std::fill(offsets.begin(), offsets.end(), 0);
+
+	for_each_chunk(pool, n, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+	  auto histogram = &offsets[chunk * NUM_BUCKETS];
+	  for (auto i=begin; i<end; ++i) {
+	    histogram[(entries[i].code >> shift) & (NUM_BUCKETS-1)]++;
+	  }
+	});
+
+	// turn the histograms into the output offsets of each chunk
+	uint32_t offset = 0;
+	for (auto bucket=0; bucket<NUM_BUCKETS; ++bucket) {
+	  for (auto chunk=0; chunk<num_chunks; ++chunk) {
+	    auto& o = offsets[chunk * NUM_BUCKETS + bucket];
+	    auto count = o;
+	    o = offset;
+	    offset += count;
+	  }
+	}
+
+	for_each_chunk(pool, n, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+	  auto scatter = &offsets[chunk * NUM_BUCKETS];
+	  for (auto i=begin; i<end; ++i) {
+	    tmp[scatter[(entries[i].code >> shift) & (NUM_BUCKETS-1)]++] = entries[i];
+	  }
+	});
+
+	entries.swap(tmp);
+      }
+    }
+
+    // number of leading bits two codes have in common
+    inline int32_t common_prefix(uint32_t a, uint32_t b) {
+      return a == b ? 32 : __builtin_clz(a ^ b);
+    }
+
+    /**
+     * Find the position at which to split a range of sorted codes, which
+     * is the first code, that differs from the first code of the range in
+     * its highest differing bit
+     *
+     */
+    inline uint32_t split(const std::vector<uint32_t>& codes, uint32_t start, uint32_t end) {
+      auto first = codes[start];
+      auto last  = codes[end-1];
+
+      if (first == last) {
+	return (start + end) / 2;
+      }
+
+      auto prefix = common_prefix(first, last);
+
+      // binary search for the last code sharing more than 'prefix' bits
+      // with the first code
+      auto position = start;
+      auto step     = end - 1 - start;
+      do {
+	step = (step + 1) / 2;
+	auto next = position + step;
+	if (next < end - 1 && common_prefix(first, codes[next]) > prefix) {
+	  position = next;
+	}
+      } while (step > 1);
+
+      return position + 1;
+    }
+
+    inline void split(
+      const std::vector<uint32_t>& codes
+    , const geometry_t& parent
+    , geometry_t& l
+    , geometry_t& r)
+    {
+      auto mid = split(codes, parent.start, parent.end);
+
+      l = {parent.primitives, parent.start, mid};
+      r = {parent.primitives, mid, parent.end};
+    }
+
+    inline int32_t most_primitives(const geometry_t* node, uint32_t n) {
+      int32_t  out   = -1;
+      uint32_t count = MAX_PRIMS_IN_NODE;
+      for (auto i=0; i<n; ++i) {
+	if (node[i].count() > count) {
+	  out   = i;
+	  count = node[i].count();
+	}
+      }
+      return out;
+    }
+
+    /**
+     * Split a geometry into up to N children, by repeatedly splitting the
+     * child with the most primitives at its highest Morton bit
+     *
+     */
+    template<int N>
+    inline uint32_t subdivide(
+      const std::vector<uint32_t>& codes
+    , geometry_t& geometry
+    , geometry_t* children)
+    {
+      if (geometry.count() <= MAX_PRIMS_IN_NODE) {
+	return 0;
+      }
+
+      auto num_children = 2;
+
+      split(codes, geometry, children[0], children[1]);
+
+      while (num_children < N) {
+	auto split_child = most_primitives(children, num_children);
+	if (split_child == -1) {
+	  break;
+	}
+	geometry_t tmp(geometry);
+	split(codes, children[split_child], tmp, children[num_children]);
+	children[split_child] = tmp;
+
+	++num_children;
+      }
+
+      return num_children;
+    }
+
+    template<int N, typename Things, typename BVH>
+    uint32_t from(thread_pool_t& pool, geometry_t& geometry, const Things& things, BVH& bvh) {
+      const auto n = geometry.count();
+      const auto primitives = &geometry.primitives[geometry.start];
+
+      std::vector<entry_t> entries(n);
+
+      for_each_chunk(pool, n, [&](uint32_t, uint32_t begin, uint32_t end) {
+	for (auto i=begin; i<end; ++i) {
+	  entries[i].code  = encode(geometry.centroid_bounds, primitives[i].centroid);
+	  entries[i].index = i;
+	}
+      });
+
+      sort(pool, entries);
+
+      // bring primitives into Morton order, and keep the codes in the same
+      // order, so nodes can be split on their ranges
+      std::vector<primitive_t> unsorted(primitives, primitives + n);
+      std::vector<uint32_t>    codes(geometry.end);
+
+      for_each_chunk(pool, n, [&](uint32_t, uint32_t begin, uint32_t end) {
+	for (auto i=begin; i<end; ++i) {
+	  primitives[i] = unsorted[entries[i].index];
+	  codes[geometry.start + i] = entries[i].code;
+	}
+      });
+
+      return parallel::from(pool, geometry, things, bvh, [&codes](geometry_t& g, geometry_t* children) {
+	return subdivide<N>(codes, g, children);
+      });
+    }
+  }
+}
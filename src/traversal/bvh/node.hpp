@@ -1,17 +1,36 @@
 #pragma once
 
+#include <algorithm>
+#include <type_traits>
+
+/**
+ * A node with N children. Nodes are aligned to cache lines, so the
+ * bounds of an eight wide node fill three lines and its child offsets
+ * and visiting orders one more
+ *
+ */
 template<int N>
-struct mbvh_node_t {
+struct alignas(64) mbvh_node_t {
   enum flags_t {
     LEAF = 1
   };
 
+  // the visiting orders hold the index of each child in as few bits as
+  // possible, so they fit into the padding of the node
+  typedef typename std::conditional<(N > 8), uint64_t,
+    typename std::conditional<(N > 4), uint32_t, uint8_t>::type>::type order_t;
+  static const uint32_t ORDER_BITS = N > 8 ? 4 : (N > 4 ? 3 : 2);
+  static const order_t  ORDER_MASK = (1 << ORDER_BITS) - 1;
+
   // child node boundaries
   float    bounds[2*N*3];
   // offsts into child nodes, or pointers to primitives
   uint32_t offset[N];
   uint8_t  num[N];
-  uint32_t flags[N];
+  uint8_t  flags[N];
+  // children near to far for rays into the octants with positive x.
+  // rays into the opposite octant visit them in reverse
+  order_t  order[4];
 
   inline mbvh_node_t() {
     memset(bounds, 0, 2*N*3*4);
@@ -23,16 +42,38 @@ struct mbvh_node_t {
 
     memset(offset, 0, N*sizeof(uint32_t));
     memset(num, 0, N*sizeof(uint8_t));
-    memset(flags, 0, N*sizeof(uint32_t));
+    memset(flags, 0, N*sizeof(uint8_t));
+
+    for (auto o=0; o<4; ++o) {
+      order[o] = 0;
+      for (auto k=0; k<N; ++k) {
+	order[o] |= (order_t) k << (ORDER_BITS*k);
+      }
+    }
   }
 
   inline void set_bounds(uint32_t i, const aabb_t& b) {
-    bounds[i     ] = b.min.x;
-    bounds[i +  8] = b.min.y;
-    bounds[i + 16] = b.min.z;
-    bounds[i + 24] = b.max.x;
-    bounds[i + 32] = b.max.y;
-    bounds[i + 40] = b.max.z;
+    bounds[i      ] = b.min.x;
+    bounds[i +   N] = b.min.y;
+    bounds[i + 2*N] = b.min.z;
+    bounds[i + 3*N] = b.max.x;
+    bounds[i + 4*N] = b.max.y;
+    bounds[i + 5*N] = b.max.z;
+  }
+
+  inline aabb_t get_bounds(uint32_t i) const {
+    return aabb_t(
+      vector_t(bounds[i      ], bounds[i +   N], bounds[i + 2*N]),
+      vector_t(bounds[i + 3*N], bounds[i + 4*N], bounds[i + 5*N]));
+  }
+
+  // the bounds of all children of this node
+  inline aabb_t merged_bounds() const {
+    aabb_t out;
+    for (auto i=0; i<N; ++i) {
+      out = bounds::merge(out, get_bounds(i));
+    }
+    return out;
   }
 
   inline void set_leaf(uint32_t i, uint32_t index, uint32_t prims) {
@@ -45,6 +86,14 @@ struct mbvh_node_t {
     return (flags[i] & LEAF) != 0;
   }
 
+  inline uint32_t get_offset(uint32_t i) const {
+    return offset[i];
+  }
+
+  inline uint32_t get_num(uint32_t i) const {
+    return num[i];
+  }
+
   inline bool is_empty(uint32_t i) const {
     return (num[i] == 0) && (offset[i] == 0);
   }
@@ -56,7 +105,45 @@ struct mbvh_node_t {
   inline void set_leaf_size(uint32_t i, uint8_t size) {
     num[i] = size;
   }
+
+  /**
+   * Update the visiting orders to the bounds of the children. Children
+   * are ordered by their centers along the diagonal of each octant, which
+   * orders boxes along any direction in the octant well enough
+   *
+   */
+  inline void update_order() {
+    for (uint32_t o=0; o<4; ++o) {
+      const vector_t diagonal(1.0f, (o & 2) ? -1.0f : 1.0f, (o & 1) ? -1.0f : 1.0f);
+
+      uint32_t ids[N];
+      float_t  keys[N];
+      for (auto i=0; i<N; ++i) {
+	ids[i]  = i;
+	keys[i] = is_empty(i)
+	  ? std::numeric_limits<float_t>::max()
+	  : dot(get_bounds(i).centroid(), diagonal);
+      }
+
+      std::sort(ids, ids + N, [&](uint32_t l, uint32_t r) {
+	return keys[l] < keys[r];
+      });
+
+      order[o] = 0;
+      for (auto k=0; k<N; ++k) {
+	order[o] |= (order_t) ids[k] << (ORDER_BITS*k);
+      }
+    }
+  }
+
+  // the child visited 'k'-th for rays into 'octant', the nearest first
+  inline uint32_t get_child(uint32_t octant, uint32_t k) const {
+    return octant < 4
+      ? (order[octant] >> (ORDER_BITS*k)) & ORDER_MASK
+      : (order[7 - octant] >> (ORDER_BITS*(N-1-k))) & ORDER_MASK;
+  }
 };
 
 typedef mbvh_node_t<4> quad_node_t;
 typedef mbvh_node_t<8> octa_node_t;
+typedef mbvh_node_t<16> hexa_node_t;
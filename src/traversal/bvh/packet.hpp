@@ -0,0 +1,104 @@
+#pragma once
+
+#include "traversal/aabb.hpp"
+#include "traversal/ray.hpp"
+
+#include <cmath>
+#include <limits>
+
+/**
+ * Packets of coherent rays, e.g. camera rays through neighbouring
+ * pixels, are culled against nodes as a whole with interval arithmetic
+ * (Boulos et al. 2006). The origins and reciprocal directions of all rays
+ * of a packet are bounded by intervals, so a single test per node tells
+ * if no ray of the packet can hit a child
+ *
+ */
+namespace packet {
+  // rays per packet, four rows of a patch
+  static const uint32_t SIZE     = 64;
+  // smaller packets are traced as streams
+  static const uint32_t MIN_RAYS = 16;
+
+  struct interval_t {
+    float_t o_min[3], o_max[3];
+    float_t r_min[3], r_max[3];
+    bool    positive[3];
+
+    /**
+     * Bound the rays of a packet. Returns false if their directions
+     * point into different octants, which intervals can't cull well
+     *
+     */
+    template<typename Stream, int N>
+    inline bool bound(const traversal_ray_t<Stream, N>* rays, uint32_t num) {
+      static const float_t huge = 1e30f;
+
+      for (auto a=0; a<3; ++a) {
+	o_min[a] = r_min[a] = std::numeric_limits<float_t>::max();
+	o_max[a] = r_max[a] = std::numeric_limits<float_t>::lowest();
+	positive[a] = rays[0].segment->wi.v[a] >= 0.0f;
+      }
+
+      for (auto i=0; i<num; ++i) {
+	const auto& p = rays[i].segment->p;
+	const auto& d = rays[i].segment->wi;
+
+	for (auto a=0; a<3; ++a) {
+	  if ((d.v[a] >= 0.0f) != positive[a]) {
+	    return false;
+	  }
+
+	  // axis parallel rays have an infinite reciprocal
+	  auto r = d.v[a] != 0.0f ? 1.0f / d.v[a] : huge;
+	  r = std::max(std::min(r, huge), -huge);
+
+	  o_min[a] = std::min(o_min[a], p.v[a]);
+	  o_max[a] = std::max(o_max[a], p.v[a]);
+	  r_min[a] = std::min(r_min[a], r);
+	  r_max[a] = std::max(r_max[a], r);
+	}
+      }
+      return true;
+    }
+
+    /**
+     * Test the packet against the bounds of all children of a node. A
+     * child is culled, if no ray of the packet can enter it before
+     * 'max_d'. Returns the smallest distance any ray enters a child at
+     * in 'entry'
+     *
+     */
+    template<int N>
+    inline size_t intersect(
+      const bounds::bounds_t<N>& b
+    , float_t max_d
+    , typename simd_t<N>::float_t& entry) const
+    {
+      using namespace simd;
+      typedef simd_t<N> wide;
+
+      auto lo = wide::load(0.0f);
+      auto hi = wide::load(max_d);
+
+      for (auto a=0; a<3; ++a) {
+	const auto& near = positive[a] ? b.min[a] : b.max[a];
+	const auto& far  = positive[a] ? b.max[a] : b.min[a];
+
+	const auto rmin = wide::load(r_min[a]);
+	const auto rmax = wide::load(r_max[a]);
+
+	// the closest plane offset over all rays enters first, the
+	// farthest leaves last
+	const auto n = sub(near, wide::load(positive[a] ? o_max[a] : o_min[a]));
+	const auto f = sub(far,  wide::load(positive[a] ? o_min[a] : o_max[a]));
+
+	lo = max(lo, min(mul(n, rmin), mul(n, rmax)));
+	hi = min(hi, max(mul(f, rmin), mul(f, rmax)));
+      }
+
+      entry = lo;
+      return movemask(lte(lo, hi));
+    }
+  };
+}
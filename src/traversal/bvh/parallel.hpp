@@ -0,0 +1,179 @@
+#pragma once
+
+#include "build.hpp"
+
+#include "util/thread_pool.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace build {
+  namespace parallel {
+    // nodes with fewer primitives are split on the thread that found them
+    static const uint32_t MIN_PRIMS_PER_TASK = 4096;
+    // nodes with more primitives sort them into split bins in parallel
+    static const uint32_t MIN_PRIMS_PER_BINNING_TASK = 1<<16;
+
+    /**
+     * An inner node of the build tree. The build tree is created in
+     * parallel and flattened into the BVH afterwards, in the same order
+     * the serial builder creates nodes and leaves in. This keeps the
+     * resulting hierarchy identical to the one of the serial build
+     *
+     */
+    struct node_t {
+      geometry_t children[MAX_WIDTH];
+      std::unique_ptr<node_t> next[MAX_WIDTH];
+      uint32_t num;
+
+      inline node_t(const geometry_t& geometry, const geometry_t* split, uint32_t num)
+	: children{ [0 ... 15] = { geometry } }
+	, num(num)
+      {
+	for (auto i=0; i<num; ++i) {
+	  children[i] = split[i];
+	}
+      }
+    };
+
+    /**
+     * Find the best split for a geometry. Large geometries are binned in
+     * chunks on all threads of the pool. Bins are merged in chunk order,
+     * which yields the same bins as binning all primitives serially
+     *
+     */
+    inline split_t find(thread_pool_t& pool, const geometry_t& geometry) {
+      if (geometry.count() < MIN_PRIMS_PER_BINNING_TASK) {
+	return build::find(geometry);
+      }
+
+      const auto chunk = MIN_PRIMS_PER_BINNING_TASK / 4;
+      const auto num_chunks = (geometry.count() + chunk - 1) / chunk;
+
+      std::vector<binning_t> bins(num_chunks);
+      {
+	task_group_t tasks(pool);
+	for (uint32_t i=0; i<num_chunks; ++i) {
+	  tasks.spawn([&, i]() {
+	    auto begin = i * chunk;
+	    auto end   = std::min(begin + chunk, geometry.count());
+	    bin(geometry, begin, end, bins[i]);
+	  });
+	}
+	tasks.wait();
+      }
+
+      binning_t merged;
+      for (const auto& b: bins) {
+	merged.merge(b);
+      }
+
+      return build::find(geometry, merged);
+    }
+
+    template<typename Split>
+    void subdivide(
+      task_group_t& tasks
+    , geometry_t& geometry
+    , std::unique_ptr<node_t>& out
+    , const Split& split)
+    {
+      geometry_t children[MAX_WIDTH] = { [0 ... 15] = { geometry } };
+
+      auto num_children = split(geometry, children);
+      if (num_children == 0) {
+	return;
+      }
+
+      out.reset(new node_t(geometry, children, num_children));
+
+      auto node = out.get();
+      for (auto i=0; i<num_children; ++i) {
+	auto& child = node->children[i];
+	auto& next  = node->next[i];
+
+	if (child.count() >= MIN_PRIMS_PER_TASK) {
+	  tasks.spawn([&tasks, &child, &next, &split]() {
+	    subdivide(tasks, child, next, split);
+	  });
+	}
+	else {
+	  subdivide(tasks, child, next, split);
+	}
+      }
+    }
+
+    /**
+     * Write the build tree into the BVH. This mirrors the node and leaf
+     * allocation order of the serial builder
+     *
+     */
+    template<typename Things, typename BVH>
+    uint32_t emit(const node_t* build, const Things& things, BVH& bvh) {
+      auto node_index = bvh.make_node();
+
+      uint32_t child_indices[MAX_WIDTH] = { 0 };
+      for (auto i=0; i<build->num; ++i) {
+	if (build->next[i]) {
+	  child_indices[i] = emit(build->next[i].get(), things, bvh);
+	}
+      }
+
+      auto node = bvh.resolve(node_index);
+      for (auto i=0; i<build->num; ++i) {
+	const auto& child = build->children[i];
+
+	node->set_bounds(i, child.bounds);
+
+	if (child_indices[i]) {
+	  node->offset[i] = child_indices[i];
+	}
+	else {
+	  auto index =
+	    bvh.insert_things(
+	      child.start, child.end,
+	      child.primitives,
+	      things);
+	  node->set_leaf(i, index, child.count());
+	}
+      }
+
+      return node_index;
+    }
+
+    /**
+     * Build a BVH in parallel. 'split' divides a geometry into up to as
+     * many children as the nodes of the BVH have, and returns their
+     * number, or 0 if the geometry should become a leaf
+     *
+     */
+    template<typename Things, typename BVH, typename Split>
+    uint32_t from(
+      thread_pool_t& pool
+    , geometry_t& geometry
+    , const Things& things
+    , BVH& bvh
+    , const Split& split)
+    {
+      std::unique_ptr<node_t> root;
+      {
+	task_group_t tasks(pool);
+	subdivide(tasks, geometry, root, split);
+	tasks.wait();
+      }
+
+      return root ? emit(root.get(), things, bvh) : 0;
+    }
+
+    template<int N, typename Things, typename BVH>
+    uint32_t from(thread_pool_t& pool, geometry_t& geometry, const Things& things, BVH& bvh) {
+      auto find = [&pool](const geometry_t& g) {
+	return parallel::find(pool, g);
+      };
+
+      return from(pool, geometry, things, bvh, [&find](geometry_t& g, geometry_t* children) {
+	return build::subdivide<N>(g, children, find);
+      });
+    }
+  }
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include "build.hpp"
+#include "node.hpp"
+
+#include "traversal/aabb.hpp"
+#include "util/buffer.hpp"
+
+#include <cmath>
+#include <vector>
+
+/**
+ * A node with eight children, whose bounds are quantized to 8 bits
+ * relative to the bounds of the node (Ylitie et al. 2017). The children
+ * of a node are stored next to each other, as are the leaf blocks of all
+ * leaves of a node, so a node only stores where they start. This cuts
+ * the size of a node from 264 to 80 bytes
+ *
+ */
+struct quantized_node_t {
+  // minimum of the bounds of the node, and the power of two each
+  // quantization step spans per axis
+  float_t  origin[3];
+  int8_t   exponent[3];
+  // bit mask of the children, that are inner nodes
+  uint8_t  inner;
+  uint32_t child_base;
+  uint32_t thing_base;
+  // number of primitives of leaf children
+  uint8_t  num[8];
+  uint8_t  lo[3][8];
+  uint8_t  hi[3][8];
+
+  inline quantized_node_t()
+    : origin{ 0, 0, 0 }
+    , exponent{ 0, 0, 0 }
+    , inner(0)
+    , child_base(0)
+    , thing_base(0)
+  {
+    memset(num, 0, sizeof(num));
+    // empty children have inverted bounds, which no ray intersects
+    memset(lo, 255, sizeof(lo));
+    memset(hi, 0, sizeof(hi));
+  }
+
+  inline quantized_node_t(const aabb_t& bounds)
+    : quantized_node_t()
+  {
+    for (auto axis=0; axis<3; ++axis) {
+      origin[axis] = bounds.min.v[axis];
+
+      auto extent = bounds.max.v[axis] - bounds.min.v[axis];
+      auto e = extent > 0.0f ? (int32_t) std::ceil(std::log2(extent / 255.0f)) : -126;
+      e = std::min(std::max(e, -126), 127);
+
+      // rounding may leave the largest step short of the node bounds
+      while (e < 127 && dequantize(axis, e, 255) < bounds.max.v[axis]) {
+	++e;
+      }
+      exponent[axis] = e;
+    }
+  }
+
+  static inline float_t pow2(int32_t e) {
+    union {
+      uint32_t i;
+      float    f;
+    } bits = { (uint32_t) (e + 127) << 23 };
+    return bits.f;
+  }
+
+  inline float_t scale(uint32_t axis) const {
+    return pow2(exponent[axis]);
+  }
+
+  inline float_t dequantize(uint32_t axis, int32_t e, uint32_t q) const {
+    return std::fma((float_t) q, pow2(e), origin[axis]);
+  }
+
+  /**
+   * Quantize the bounds of a child conservatively, so the dequantized
+   * bounds always contain them
+   *
+   */
+  inline void set_bounds(uint32_t i, const aabb_t& b) {
+    for (auto axis=0; axis<3; ++axis) {
+      const auto e = exponent[axis];
+      const auto s = pow2(e);
+
+      int32_t l = std::floor((b.min.v[axis] - origin[axis]) / s);
+      int32_t h = std::ceil((b.max.v[axis] - origin[axis]) / s);
+
+      l = std::min(std::max(l, 0), 255);
+      h = std::min(std::max(h, 0), 255);
+
+      while (l > 0 && dequantize(axis, e, l) > b.min.v[axis]) {
+	--l;
+      }
+      while (h < 255 && dequantize(axis, e, h) < b.max.v[axis]) {
+	++h;
+      }
+
+      lo[axis][i] = l;
+      hi[axis][i] = h;
+    }
+  }
+
+  inline aabb_t get_bounds(uint32_t i) const {
+    return aabb_t(
+      vector_t(
+	dequantize(0, exponent[0], lo[0][i]),
+	dequantize(1, exponent[1], lo[1][i]),
+	dequantize(2, exponent[2], lo[2][i])),
+      vector_t(
+	dequantize(0, exponent[0], hi[0][i]),
+	dequantize(1, exponent[1], hi[1][i]),
+	dequantize(2, exponent[2], hi[2][i])));
+  }
+
+  inline bool is_inner(uint32_t i) const {
+    return (inner & (1 << i)) != 0;
+  }
+
+  inline bool is_leaf(uint32_t i) const {
+    return !is_inner(i) && num[i] > 0;
+  }
+
+  inline uint32_t get_num(uint32_t i) const {
+    return num[i];
+  }
+
+  // inner children follow each other from 'child_base', and leaf blocks
+  // from 'thing_base' in the order of the children
+  inline uint32_t get_offset(uint32_t i) const {
+    if (is_inner(i)) {
+      return child_base + __builtin_popcount(inner & ((1 << i) - 1));
+    }
+
+    auto out = thing_base;
+    for (auto j=0; j<i; ++j) {
+      if (!is_inner(j)) {
+	out += (num[j] + build::MAX_PRIMS_IN_NODE - 1) / build::MAX_PRIMS_IN_NODE;
+      }
+    }
+    return out;
+  }
+};
+
+namespace bounds {
+  // dequantize the bounds of all children of a node
+  inline bounds_t<8> load(const quantized_node_t& node) {
+    bounds_t<8> out;
+    for (auto axis=0; axis<3; ++axis) {
+      const auto scale  = float8::load(node.scale(axis));
+      const auto origin = float8::load(node.origin[axis]);
+
+      out.min[axis] = float8::madd(float8::load(node.lo[axis]), scale, origin);
+      out.max[axis] = float8::madd(float8::load(node.hi[axis]), scale, origin);
+    }
+    return out;
+  }
+}
+
+namespace build {
+  /**
+   * Convert a hierarchy to quantized nodes. Nodes are laid out breadth
+   * first, which stores the children of each node next to each other.
+   * The leaf blocks are reordered, so the blocks of all leaves of a node
+   * follow each other as well
+   *
+   */
+  template<typename Storage>
+  void quantize(
+    const buffer_t<octa_node_t>& nodes
+  , Storage& things
+  , buffer_t<quantized_node_t>& out)
+  {
+    Storage sorted;
+
+    // source node of every quantized node, in the order of the output
+    std::vector<uint32_t> queue = { 0 };
+
+    for (size_t q=0; q<queue.size(); ++q) {
+      const auto& src = nodes[queue[q]];
+
+      quantized_node_t node(src.merged_bounds());
+      node.child_base = queue.size();
+      node.thing_base = sorted.size();
+
+      for (auto i=0; i<8; ++i) {
+	if (src.is_empty(i) || (src.is_leaf(i) && src.num[i] == 0)) {
+	  continue;
+	}
+
+	node.set_bounds(i, src.get_bounds(i));
+
+	if (src.is_leaf(i)) {
+	  auto num_blocks = (src.num[i] + MAX_PRIMS_IN_NODE - 1) / MAX_PRIMS_IN_NODE;
+	  for (auto j=0; j<num_blocks; ++j) {
+	    sorted.push_back(things[src.offset[i] + j]);
+	  }
+	  node.num[i] = src.num[i];
+	}
+	else {
+	  node.inner |= 1 << i;
+	  queue.push_back(src.offset[i]);
+	}
+      }
+
+      out.push_back(node);
+    }
+
+    things.swap(sorted);
+  }
+}
@@ -0,0 +1,418 @@
+#pragma once
+
+#include "build.hpp"
+
+#include "util/algo.hpp"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * A spatial split BVH builder (Stich et al. 2009). Besides the object
+ * splits of the binned SAH builder, nodes can be split by a plane, which
+ * clips the primitive references that straddle it. This removes most of
+ * the overlap between children in scenes with long, thin triangles, at
+ * the cost of duplicated references in the leaves
+ *
+ */
+namespace build {
+  namespace spatial {
+    static const uint8_t NUM_SPATIAL_BINS = 32;
+    // spatial splits are only tried if the children of the best object
+    // split overlap by more than this fraction of the root surface area
+    static const float_t MIN_OVERLAP = 0.00001f;
+
+    typedef std::vector<primitive_t> references_t;
+
+    struct bin_t {
+      aabb_t   bounds;
+      uint32_t enter;
+      uint32_t exit;
+
+      inline bin_t()
+	: enter(0), exit(0)
+      {}
+    };
+
+    struct split_t {
+      uint32_t axis;
+      float_t  position;
+      float_t  cost;
+      uint32_t duplicates;
+
+      inline split_t()
+	: axis(0)
+	, position(0)
+	, cost(std::numeric_limits<float_t>::max())
+	, duplicates(0)
+      {}
+    };
+
+    inline float_t overlap(const aabb_t& l, const aabb_t& r) {
+      auto o = bounds::clip(l, r);
+      return o.valid() ? o.area() : 0.0f;
+    }
+
+    inline aabb_t bounds_of(const references_t& refs) {
+      aabb_t out;
+      for (const auto& ref: refs) {
+	out = bounds::merge(out, ref.bounds);
+      }
+      return out;
+    }
+
+    /**
+     * Split the part of a triangle inside the bounds of a reference at an
+     * axis aligned plane, and return the bounds of both sides
+     *
+     */
+    template<typename Thing>
+    inline void clip(
+      const Thing& thing
+    , const primitive_t& ref
+    , uint32_t axis
+    , float_t position
+    , aabb_t& l
+    , aabb_t& r)
+    {
+      const vector_t v[3] = { thing->v0(), thing->v1(), thing->v2() };
+
+      l = r = aabb_t();
+
+      for (auto i=0; i<3; ++i) {
+	const auto& a = v[i];
+	const auto& b = v[(i+1)%3];
+
+	if (a.v[axis] <= position) { bounds::merge(l, a); }
+	if (a.v[axis] >= position) { bounds::merge(r, a); }
+
+	if ((a.v[axis] < position && b.v[axis] > position) ||
+	    (a.v[axis] > position && b.v[axis] < position)) {
+	  auto t = (position - a.v[axis]) / (b.v[axis] - a.v[axis]);
+	  auto p = a + (b - a) * t;
+	  p.v[axis] = position;
+
+	  bounds::merge(l, p);
+	  bounds::merge(r, p);
+	}
+      }
+
+      l.max.v[axis] = position;
+      r.min.v[axis] = position;
+
+      l = bounds::clip(l, ref.bounds);
+      r = bounds::clip(r, ref.bounds);
+    }
+
+    template<typename Things>
+    struct builder_t {
+      const Things& things;
+
+      float_t  root_area;
+      // references may be duplicated until this many exist in total
+      size_t   max_references;
+      size_t   num_references;
+
+      inline builder_t(const Things& things, const aabb_t& root, size_t n, float_t budget)
+	: things(things)
+	, root_area(root.area())
+	, max_references(n + (size_t) (n * budget))
+	, num_references(n)
+      {}
+
+      inline uint32_t bin_of(const aabb_t& bounds, uint32_t axis, float_t x) const {
+	auto extent = bounds.max.v[axis] - bounds.min.v[axis];
+	auto bin    = (int32_t) (NUM_SPATIAL_BINS * (x - bounds.min.v[axis]) / extent);
+	return clamp(bin, 0, NUM_SPATIAL_BINS-1);
+      }
+
+      inline float_t plane_of(const aabb_t& bounds, uint32_t axis, uint32_t bin) const {
+	auto extent = bounds.max.v[axis] - bounds.min.v[axis];
+	return bounds.min.v[axis] + extent * (bin + 1) / NUM_SPATIAL_BINS;
+      }
+
+      /**
+       * Find the spatial split with the lowest SAH cost, that does not
+       * duplicate more references than the remaining budget allows
+       *
+       */
+      split_t find(const references_t& refs, const aabb_t& bounds) const {
+	split_t best;
+
+	for (auto axis=0; axis<3; ++axis) {
+	  if (bounds.empty_on(axis)) {
+	    continue;
+	  }
+
+	  bin_t bins[NUM_SPATIAL_BINS];
+
+	  for (const auto& ref: refs) {
+	    auto first = bin_of(bounds, axis, ref.bounds.min.v[axis]);
+	    auto last  = bin_of(bounds, axis, ref.bounds.max.v[axis]);
+
+	    // clip the reference into all bins it straddles
+	    auto rest = ref;
+	    for (auto i=first; i<last; ++i) {
+	      aabb_t l, r;
+	      clip(things[ref.index], rest, axis, plane_of(bounds, axis, i), l, r);
+	      if (l.valid()) {
+		bins[i].bounds = bounds::merge(bins[i].bounds, l);
+	      }
+	      rest.bounds = r;
+	    }
+	    if (rest.bounds.valid()) {
+	      bins[last].bounds = bounds::merge(bins[last].bounds, rest.bounds);
+	    }
+
+	    bins[first].enter++;
+	    bins[last].exit++;
+	  }
+
+	  // sweep from the right to find the bounds of all right sides
+	  aabb_t   right_bounds[NUM_SPATIAL_BINS];
+	  uint32_t right_count[NUM_SPATIAL_BINS];
+
+	  aabb_t   b;
+	  uint32_t c = 0;
+	  for (auto i=NUM_SPATIAL_BINS-1; i>0; --i) {
+	    b = bounds::merge(b, bins[i].bounds);
+	    c += bins[i].exit;
+	    right_bounds[i] = b;
+	    right_count[i]  = c;
+	  }
+
+	  aabb_t   a;
+	  uint32_t left = 0;
+	  for (auto i=0; i<NUM_SPATIAL_BINS-1; ++i) {
+	    a = bounds::merge(a, bins[i].bounds);
+	    left += bins[i].enter;
+
+	    auto right = right_count[i+1];
+	    auto duplicates = left + right - refs.size();
+
+	    if (left == 0 || right == 0 ||
+		left == refs.size() || right == refs.size() ||
+		num_references + duplicates > max_references) {
+	      continue;
+	    }
+
+	    auto cost =
+	      (left * a.area() + right * right_bounds[i+1].area()) / bounds.area();
+	    if (cost < best.cost) {
+	      best.axis       = axis;
+	      best.position   = plane_of(bounds, axis, i);
+	      best.cost       = cost;
+	      best.duplicates = duplicates;
+	    }
+	  }
+	}
+
+	return best;
+      }
+
+      void split(const split_t& s, const references_t& refs, references_t& l, references_t& r) {
+	for (const auto& ref: refs) {
+	  if (ref.bounds.max.v[s.axis] <= s.position) {
+	    l.push_back(ref);
+	  }
+	  else if (ref.bounds.min.v[s.axis] >= s.position) {
+	    r.push_back(ref);
+	  }
+	  else {
+	    aabb_t lb, rb;
+	    clip(things[ref.index], ref, s.axis, s.position, lb, rb);
+
+	    if (lb.valid()) {
+	      l.emplace_back(ref.index, lb);
+	    }
+	    if (rb.valid()) {
+	      r.emplace_back(ref.index, rb);
+	    }
+	    if (lb.valid() && rb.valid()) {
+	      ++num_references;
+	    }
+	  }
+	}
+      }
+
+      /**
+       * Split a set of references in half at the median of their
+       * centroids, along the axis the centroids spread most along. This
+       * divides sets no other split can, e.g. references sharing their
+       * centroid
+       *
+       */
+      float_t median(const references_t& refs, references_t& l, references_t& r) const {
+	aabb_t centroids;
+	for (const auto& ref: refs) {
+	  bounds::merge(centroids, ref.centroid);
+	}
+	const auto axis = centroids.dominant_axis();
+
+	references_t sorted(refs);
+	auto mid = sorted.begin() + sorted.size() / 2;
+	std::nth_element(sorted.begin(), mid, sorted.end(), [axis](const primitive_t& a, const primitive_t& b) {
+	  return a.centroid.v[axis] < b.centroid.v[axis];
+	});
+
+	l.assign(sorted.begin(), mid);
+	r.assign(mid, sorted.end());
+
+	// flat sets can't be split any better, so they make a leaf
+	auto area = bounds_of(refs).area();
+	if (area <= 0.0f) {
+	  return refs.size();
+	}
+	return (l.size() * bounds_of(l).area() + r.size() * bounds_of(r).area()) / area;
+      }
+
+      /**
+       * Split a set of references in two, either by an object split or a
+       * spatial split, whichever has the lower SAH cost. Falls back to a
+       * median split if both leave a side empty. Returns the cost of the
+       * split
+       *
+       */
+      float_t split(references_t& refs, references_t& l, references_t& r) {
+	geometry_t geometry(refs, 0, refs.size());
+
+	auto object = build::find(geometry);
+	auto cost   = object.cost;
+
+	geometry_t gl(geometry), gr(geometry);
+	build::split(object, geometry, gl, gr);
+
+	auto spatial = false;
+	if (gl.count() == 0 || gr.count() == 0 ||
+	    overlap(gl.bounds, gr.bounds) / root_area > MIN_OVERLAP) {
+	  auto s = find(refs, geometry.bounds);
+	  if (s.cost < object.cost) {
+	    split(s, refs, l, r);
+	    cost    = s.cost;
+	    spatial = true;
+	  }
+	}
+
+	if (!spatial) {
+	  l.assign(refs.begin() + gl.start, refs.begin() + gl.end);
+	  r.assign(refs.begin() + gr.start, refs.begin() + gr.end);
+	}
+
+	// a spatial split only duplicates references, if both sides got a
+	// part of them, so there is nothing to give back here
+	if (l.empty() || r.empty()) {
+	  return median(refs, l, r);
+	}
+	return cost;
+      }
+
+      /**
+       * The child with the largest surface area among those with enough
+       * references to be split, or -1 if there is none. Same as
+       * build::largest_node
+       *
+       */
+      inline int32_t largest_node(const references_t* children, const aabb_t* bounds, uint32_t n) {
+	int32_t out = -1;
+	float   a   = std::numeric_limits<float>::lowest();
+	for (auto i=0; i<n; ++i) {
+	  if (children[i].size() < MAX_PRIMS_IN_NODE) {
+	    continue;
+	  }
+
+	  auto node_area = bounds[i].area();
+	  if (node_area > a) {
+	    out = i;
+	    a   = node_area;
+	  }
+	}
+	return out;
+      }
+
+      template<int N, typename BVH>
+      uint32_t from(references_t& refs, BVH& bvh) {
+	references_t children[N];
+	aabb_t       bounds[N];
+
+	if (refs.size() < MAX_PRIMS_IN_NODE) {
+	  return 0;
+	}
+
+	auto cost = split(refs, children[0], children[1]);
+
+	if (refs.size() <= 1.0f + cost && refs.size() <= MAX_PRIMS_IN_LEAF) {
+	  // give the references duplicated by the rejected split back
+	  num_references -= children[0].size() + children[1].size() - refs.size();
+	  return 0;
+	}
+
+	// the references of this node are not needed anymore
+	references_t().swap(refs);
+
+	bounds[0] = bounds_of(children[0]);
+	bounds[1] = bounds_of(children[1]);
+
+	auto num_children = 2;
+
+	while (num_children < N) {
+	  auto split_child = largest_node(children, bounds, num_children);
+	  if (split_child == -1) {
+	    break;
+	  }
+
+	  references_t tmp;
+	  split(children[split_child], tmp, children[num_children]);
+	  children[split_child].swap(tmp);
+
+	  bounds[split_child]  = bounds_of(children[split_child]);
+	  bounds[num_children] = bounds_of(children[num_children]);
+
+	  ++num_children;
+	}
+
+	// make a new node in the BVH
+	auto node_index = bvh.make_node();
+
+	uint32_t child_indices[N];
+	for (int i=0; i<num_children; ++i) {
+	  child_indices[i] = from<N>(children[i], bvh);
+	}
+
+	auto node = bvh.resolve(node_index);
+	for (int i=0; i<num_children; ++i) {
+	  node->set_bounds(i, bounds[i]);
+
+	  if (child_indices[i]) {
+	    node->offset[i] = child_indices[i];
+	  }
+	  else {
+	    auto index =
+	      bvh.insert_things(
+		0, children[i].size(),
+		children[i],
+		things);
+	    node->set_leaf(i, index, children[i].size());
+	  }
+	}
+
+	return node_index;
+      }
+    };
+
+    template<int N, typename Things, typename BVH>
+    uint32_t from(geometry_t& geometry, float_t budget, const Things& things, BVH& bvh) {
+      references_t refs(&geometry.primitives[geometry.start], &geometry.primitives[geometry.end-1]+1);
+
+      builder_t<Things> builder(things, geometry.bounds, refs.size(), budget);
+      auto root = builder.template from<N>(refs, bvh);
+
+      std::clog
+	<< "Spatial splits duplicated "
+	<< builder.num_references - geometry.count()
+	<< " references"
+	<< std::endl;
+
+      return root;
+    }
+  }
+}
@@ -1,33 +1,63 @@
 #pragma once
 
+#include <vector>
+
+/**
+ * A node or leaf on the stack of a single ray traversal. Leaves span
+ * several blocks, so the count holds all primitives a leaf may have
+ *
+ */
 struct node_ref_t {
-  uint32_t offset : 28;
-  uint32_t flags  : 4;
+  uint32_t offset;
+  // primitives of a leaf, 0 for inner nodes
+  uint32_t prims;
   float    d;
 };
 
 namespace stream {
-  static const uint32_t RAYS_PER_LANE = (2<<17)-1;
-  
-  struct lanes_t {
-    uint32_t active[8][RAYS_PER_LANE];
-    uint32_t num[8];
-
-    lanes_t() {
-      memset(num, 0, sizeof(uint32_t) * 8);
-    }
-  };
+  // most rays in a stream
+  static const uint32_t MAX_RAYS = 256;
 
   struct task_t {
     uint32_t offset;
     uint32_t num_rays;
-    uint32_t lane: 8, flags: 8, prims: 16;
-    uint32_t padding;
+    uint32_t flags: 8, prims: 24;
+    // the rays of the task start here in the lanes
+    uint32_t first;
 
     inline bool is_leaf() const {
       return flags == 1;
     }
   };
+
+  /**
+   * The pending tasks of a stream traversal and the ids of their rays.
+   * Tasks are popped in the reverse order they were pushed, so the rays
+   * of each task follow the rays of the task below it, and a popped task
+   * frees the rays on top. A node pushes at most N tasks of up to
+   * MAX_RAYS rays, and leaves at most N-1 of them on the stack while its
+   * first child is visited, so the room needed is bounded by the depth
+   * of the hierarchy
+   *
+   */
+  template<int N>
+  struct lanes_t {
+    std::vector<task_t>   tasks;
+    std::vector<uint32_t> rays;
+
+    // make room for a hierarchy of 'depth' levels of inner nodes
+    inline void reserve(uint32_t depth) {
+      const auto size = (depth + 1) * N;
+      if (tasks.size() < size) {
+	tasks.resize(size);
+	rays.resize(size * MAX_RAYS);
+      }
+    }
+
+    inline size_t memory() const {
+      return tasks.size() * sizeof(task_t) + rays.size() * sizeof(uint32_t);
+    }
+  };
 }
 
 template<typename Node>
@@ -38,8 +68,8 @@ inline void push(
 , const Node* node
 , uint32_t idx)
 {
-  stack[top].offset = node->offset[idx];
-  stack[top].flags  = node->num[idx];
+  stack[top].offset = node->get_offset(idx);
+  stack[top].prims  = node->get_num(idx);
   stack[top].d      = dists[idx];
   ++top;
 }
@@ -47,13 +77,13 @@ inline void push(
 inline void push(
   stream::task_t* stack
 , int32_t& top
-, uint16_t num)
+, uint32_t num)
 {
   stack[top].offset   = 0;
   stack[top].num_rays = num;
-  stack[top].lane     = 0;
   stack[top].flags    = 0;
   stack[top].prims    = 0;
+  stack[top].first    = 0;
 
   ++top;
 }
@@ -63,26 +93,15 @@ inline void push(
   stream::task_t* stack
 , int32_t& top
 , const Node* node
-, uint8_t  lane
-, uint16_t num)
+, uint32_t idx
+, uint32_t num
+, uint32_t first)
 {
-  stack[top].offset   = node->offset[lane];
+  stack[top].offset   = node->get_offset(idx);
   stack[top].num_rays = num;
-  stack[top].lane     = lane;
-  stack[top].flags    = node->flags[lane];
-  stack[top].prims    = node->num[lane];
+  stack[top].flags    = node->is_leaf(idx);
+  stack[top].prims    = node->get_num(idx);
+  stack[top].first    = first;
 
   ++top;
 }
-
-inline void push(stream::lanes_t& lanes, uint8_t lane, uint32_t id) {
-  auto& a = lanes.num[lane];
-  lanes.active[lane][a++] = id;
-}
-
-inline uint32_t* pop(stream::lanes_t& lanes, uint8_t lane, uint32_t num) {
-  auto& a = lanes.num[lane];
-  a -= num;
-
-  return &(lanes.active[lane][a]);
-}
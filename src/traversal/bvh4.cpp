@@ -0,0 +1,10 @@
+#include "bvh/backend.hpp"
+
+// hierarchies of 4 wide nodes, compiled for SSE4.2
+template bvh_t<triangle_t>::impl_t* make_backend<triangle_t, 4, bvh_options_t::MOELLER_TRUMBORE>();
+template bvh_t<triangle_t>::impl_t* make_backend<triangle_t, 4, bvh_options_t::WATERTIGHT>();
+template bvh_t<triangle_t>::impl_t* make_backend<triangle_t, 4, bvh_options_t::BALDWIN_WEBER>();
+template bvh_t<sphere_t>::impl_t* make_backend<sphere_t, 4, bvh_options_t::MOELLER_TRUMBORE>();
+template bvh_t<instance_t>::impl_t* make_backend<instance_t, 4, bvh_options_t::MOELLER_TRUMBORE>();
+template bvh_t<instance_t>::impl_t* make_backend<instance_t, 4, bvh_options_t::WATERTIGHT>();
+template bvh_t<instance_t>::impl_t* make_backend<instance_t, 4, bvh_options_t::BALDWIN_WEBER>();
@@ -0,0 +1,17 @@
+#include "bvh/common.hpp"
+
+// hierarchies of 8 wide nodes, compiled for AVX2 and FMA. the code shared with
+// the other widths is included above, so it stays SSE4.2
+TARGET_BEGIN(AVX2_TARGET)
+
+#include "bvh/backend.hpp"
+
+template bvh_t<triangle_t>::impl_t* make_backend<triangle_t, 8, bvh_options_t::MOELLER_TRUMBORE>();
+template bvh_t<triangle_t>::impl_t* make_backend<triangle_t, 8, bvh_options_t::WATERTIGHT>();
+template bvh_t<triangle_t>::impl_t* make_backend<triangle_t, 8, bvh_options_t::BALDWIN_WEBER>();
+template bvh_t<sphere_t>::impl_t* make_backend<sphere_t, 8, bvh_options_t::MOELLER_TRUMBORE>();
+template bvh_t<instance_t>::impl_t* make_backend<instance_t, 8, bvh_options_t::MOELLER_TRUMBORE>();
+template bvh_t<instance_t>::impl_t* make_backend<instance_t, 8, bvh_options_t::WATERTIGHT>();
+template bvh_t<instance_t>::impl_t* make_backend<instance_t, 8, bvh_options_t::BALDWIN_WEBER>();
+
+TARGET_END
@@ -1,17 +1,23 @@
 #pragma once
 
 #include "shading.hpp"
+#include "math/simd.hpp"
+#include "math/transform.hpp"
 
-#include "math/simd/float8.hpp"
-#include "math/simd/vector4.hpp"
-
-template<typename T>
+/**
+ * A ray with its origin, direction and reciprocal direction broadcast to
+ * all N lanes, to test it against N boxes or triangles at once
+ *
+ */
+template<typename T, int N = 8>
 struct traversal_ray_t {
-  vector8_t  origin;
-  vector8_t  direction;
-  vector8_t  ood;
-  float8_t   d;
-  T*         segment;
+  typedef simd_t<N> wide;
+
+  typename wide::vector_t origin;
+  typename wide::vector_t direction;
+  typename wide::vector_t ood;
+  typename wide::float_t  d;
+  T*                      segment;
 
   inline traversal_ray_t()
   {}
@@ -30,7 +36,47 @@ struct traversal_ray_t {
         1.0f/dir.x,
         1.0f/dir.y,
         1.0f/dir.z))
-    , d(float8::load(segment->d))
+    , d(wide::load(segment->d))
     , segment(segment) 
   {}
+
+  // the ray transformed by 't', e.g. into the object space of an instance.
+  // the direction is not normalized, so hit distances stay the same
+  inline traversal_ray_t(const transform_t& t, const traversal_ray_t& ray)
+    : origin(point(t, ray.origin))
+    , direction(vector(t, ray.direction))
+    , ood(
+	simd::div(wide::load(1.0f), direction.x),
+	simd::div(wide::load(1.0f), direction.y),
+	simd::div(wide::load(1.0f), direction.z))
+    , d(ray.d)
+    , segment(ray.segment)
+  {}
+
+  // bits set for negative x, y and z directions
+  inline uint32_t octant() const {
+    return
+      ((simd::movemask(direction.x) & 1) << 2) |
+      ((simd::movemask(direction.y) & 1) << 1) |
+      (simd::movemask(direction.z) & 1);
+  }
+
+  // transform the points or vectors of all lanes. they live here rather
+  // than in transform_t, so they are compiled for the instruction set of
+  // the traversal using them
+  static inline typename wide::vector_t point(const transform_t& t, const typename wide::vector_t& p) {
+    using namespace simd;
+    return typename wide::vector_t(
+      madd(wide::load(t.m[0][0]), p.x, madd(wide::load(t.m[0][1]), p.y, madd(wide::load(t.m[0][2]), p.z, wide::load(t.m[0][3])))),
+      madd(wide::load(t.m[1][0]), p.x, madd(wide::load(t.m[1][1]), p.y, madd(wide::load(t.m[1][2]), p.z, wide::load(t.m[1][3])))),
+      madd(wide::load(t.m[2][0]), p.x, madd(wide::load(t.m[2][1]), p.y, madd(wide::load(t.m[2][2]), p.z, wide::load(t.m[2][3])))));
+  }
+
+  static inline typename wide::vector_t vector(const transform_t& t, const typename wide::vector_t& v) {
+    using namespace simd;
+    return typename wide::vector_t(
+      madd(wide::load(t.m[0][0]), v.x, madd(wide::load(t.m[0][1]), v.y, mul(wide::load(t.m[0][2]), v.z))),
+      madd(wide::load(t.m[1][0]), v.x, madd(wide::load(t.m[1][1]), v.y, mul(wide::load(t.m[1][2]), v.z))),
+      madd(wide::load(t.m[2][0]), v.x, madd(wide::load(t.m[2][1]), v.y, mul(wide::load(t.m[2][2]), v.z))));
+  }
 };
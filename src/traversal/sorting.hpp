@@ -0,0 +1,103 @@
+#pragma once
+
+#include "shading.hpp"
+
+#include "math/aabb.hpp"
+#include "math/vector.hpp"
+#include "traversal/bvh/morton.hpp"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * Secondary and shadow rays leave the shading stages in the order of
+ * their materials. Sorting the rays of many streams by direction octant,
+ * then along Morton curves through their origins and directions, before
+ * cutting them into streams again, groups rays that visit the same nodes
+ * into the same stream. More rays then share each node a stream visits
+ *
+ */
+namespace stream {
+  static const uint32_t ORIGIN_BITS    = 6;
+  static const uint32_t DIRECTION_BITS = 3;
+
+  inline uint32_t octant(const vector_t& d) {
+    return (d.x < 0 ? 4 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 1 : 0);
+  }
+
+  inline uint32_t sort_key(const aabb_t& bounds, const vector_t& p, const vector_t& d) {
+    using build::morton::expand;
+
+    static const float_t origin_scale    = (1 << ORIGIN_BITS) - 1;
+    static const float_t direction_scale = (1 << DIRECTION_BITS) - 1;
+
+    // origins relative to the bounds of the scene, directions relative
+    // to the unit cube
+    const auto o = bounds::offset(bounds, p);
+    const auto origin =
+      (expand((uint32_t) clamp(o.x * origin_scale, 0.0f, origin_scale)) << 2) |
+      (expand((uint32_t) clamp(o.y * origin_scale, 0.0f, origin_scale)) << 1) |
+      (expand((uint32_t) clamp(o.z * origin_scale, 0.0f, origin_scale)));
+
+    const auto direction =
+      (expand((uint32_t) (std::abs(d.x) * direction_scale + 0.5f)) << 2) |
+      (expand((uint32_t) (std::abs(d.y) * direction_scale + 0.5f)) << 1) |
+      (expand((uint32_t) (std::abs(d.z) * direction_scale + 0.5f)));
+
+    return
+      (octant(d) << (3 * (ORIGIN_BITS + DIRECTION_BITS))) |
+      (origin << (3 * DIRECTION_BITS)) |
+      direction;
+  }
+
+  /**
+   * Trace the rays of several streams with 'trace', which gets one
+   * stream of at most 256 rays at a time. Unless the rays are coherent,
+   * like camera rays, they are sorted and regrouped into new streams
+   * first
+   *
+   */
+  template<typename Stream, typename F>
+  inline void trace_sorted(
+    const aabb_t& bounds
+  , const Stream* stream
+  , const active_t* actives
+  , uint32_t num_streams
+  , bool sort
+  , const F& trace)
+  {
+    static thread_local std::vector<uint64_t> keys;
+    keys.clear();
+
+    for (auto s=0; s<num_streams; ++s) {
+      const auto& active = actives[s];
+      if (active.num == 0) {
+	continue;
+      }
+
+      if (!sort || stream[active.segment[0]].coherent()) {
+	trace(active);
+	continue;
+      }
+
+      for (auto i=0; i<active.num; ++i) {
+	const auto  index   = active.segment[i];
+	const auto& segment = stream[index];
+	if (!segment.masked()) {
+	  keys.push_back(((uint64_t) sort_key(bounds, segment.p, segment.wi) << 32) | index);
+	}
+      }
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    active_t active;
+    for (size_t first=0; first<keys.size(); first+=256) {
+      active.num = std::min(keys.size() - first, (size_t) 256);
+      for (auto i=0; i<active.num; ++i) {
+	active.segment[i] = (uint32_t) keys[first+i];
+      }
+      trace(active);
+    }
+  }
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "ray.hpp"
+#include "math/simd.hpp"
+#include "things/mesh.hpp"
+#include "things/sphere.hpp"
+
+#include <cmath>
+
+/**
+ * Analytic sphere intersection tests. A block tests a ray against N
+ * spheres at once. The spheres are loaded into the lanes in reverse like
+ * moeller_trumbore_t, so lane x holds sphere N-1-x. The distances are solved for
+ * from the point of the ray closest to the center, instead of from the
+ * origin, which keeps the discriminant precise for spheres far smaller
+ * than their distance to the origin, like the particles of a point cloud.
+ * The directions of instanced rays are not normalized, so the quadratic
+ * is scaled by their squared length.
+ *
+ * Empty lanes have a negative squared radius, which no ray hits
+ *
+ */
+template<int N>
+struct spheres_t {
+  typedef simd_t<N> wide;
+
+  typename wide::vector_t centers;
+  typename wide::float_t  radii2;
+
+  uint32_t num;
+
+  uint32_t particlesid[N];
+  uint32_t sphereid[N];
+
+  inline spheres_t(sphere_t::p* spheres, uint32_t num)
+    : num(num) {
+    vector_t c[N];
+    __aligned(64) float r2[N];
+
+    for (int i=0; i<N; ++i) {
+      r2[i] = -1.0f;
+    }
+
+    for (int i=0; i<num; ++i) {
+      const auto& sphere = spheres[i];
+
+      particlesid[i] = sphere->particles->id;
+      sphereid[i]    = sphere->id;
+
+      c[i]      = sphere->center();
+      r2[N-1-i] = sphere->radius() * sphere->radius();
+    }
+    centers = typename wide::vector_t(c);
+    radii2  = wide::load(r2);
+  };
+
+  // particles don't move with the vertices of meshes, so their bounds
+  // stay the same
+  inline aabb_t refit(const std::vector<mesh_t::p>&) const {
+    __aligned(64) float x[N], y[N], z[N], r2[N];
+    simd::store(centers.x, x);
+    simd::store(centers.y, y);
+    simd::store(centers.z, z);
+    simd::store(radii2, r2);
+
+    aabb_t out;
+    for (int i=N-num; i<N; ++i) {
+      const auto c = vector_t(x[i], y[i], z[i]);
+      const auto r = vector_t(std::sqrt(r2[i]));
+      out = bounds::merge(out, aabb_t(c - r, c + r));
+    }
+    return out;
+  }
+
+  // the lanes holding spheres
+  inline size_t valid() const {
+    return ((size_t(1) << num) - 1) << (N - num);
+  }
+
+  /**
+   * Test the ray against all spheres. Returns the lanes hit before the
+   * end of the ray, with the distances to the nearest hit in front of the
+   * origin
+   *
+   */
+  template<typename T>
+  inline typename wide::float_t test(
+    const traversal_ray_t<T, N>& ray
+  , typename wide::float_t& ds) const
+  {
+    using namespace simd;
+
+    const auto zero = wide::load(0.0f);
+
+    const auto& d = ray.direction;
+
+    const auto oc = sub(ray.origin, centers);
+    const auto a  = dot(d, d);
+    // the distance to the point closest to the center, and the squared
+    // distance of that point to the center
+    const auto s  = div(sub(zero, dot(oc, d)), a);
+    const auto lx = madd(s, d.x, oc.x);
+    const auto ly = madd(s, d.y, oc.y);
+    const auto lz = madd(s, d.z, oc.z);
+    const auto l2 = madd(lx, lx, madd(ly, ly, mul(lz, lz)));
+
+    const auto h  = sub(radii2, l2);
+    const auto q  = sqrt(div(h, a));
+
+    // the far hit, if the origin is inside the sphere
+    const auto near = sub(s, q);
+    ds = select(gt(near, zero), add(s, q), near);
+
+    const auto hmask = gte(h, zero);
+    const auto dmask = mand(gt(ds, zero), lt(ds, ray.d));
+
+    return mand(hmask, dmask);
+  }
+
+  template<typename T>
+  inline bool intersect(traversal_ray_t<T, N>& ray) const {
+    using namespace simd;
+
+    typename wide::float_t ds;
+    auto mask = movemask(test(ray, ds));
+
+    bool ret = false;
+
+    if (mask != 0) {
+
+      __aligned(64) float dists[N];
+      float closest = ray.segment->d;
+
+      store(ds, dists);
+
+      int idx = -1;
+      while(mask != 0) {
+	auto x = __bscf(mask);
+	if (dists[x] < closest && ((N-1-x) < num)) {
+	  closest = dists[x];
+	  idx = x;
+	}
+      }
+
+      if (idx != -1) {
+	if (T::shade) {
+	  ray.segment->shading(0.0f, 0.0f, sphere_t::PARTICLES | particlesid[N-1-idx], sphereid[N-1-idx]);
+	}
+
+	ray.segment->d = closest;
+	ray.d          = wide::load(closest);
+
+	ret = true;
+      }
+    }
+
+    return ret;
+  }
+
+  // whether the ray hits any sphere before its end
+  template<typename T>
+  inline bool occluded(const traversal_ray_t<T, N>& ray) const {
+    typename wide::float_t ds;
+    return (simd::movemask(test(ray, ds)) & valid()) != 0;
+  }
+};
@@ -1,19 +1,26 @@
 #pragma once
 
 #include "ray.hpp"
-#include "math/simd/vector8.hpp"
+#include "math/simd.hpp"
 #include "things/mesh.hpp"
 
 /**
  * Moeller Trumbore triangle intersection tests. This serves as a baseline
- * for further experiments with other triangle intersection algorithms
+ * for the other triangle intersection tests, watertight_t and
+ * baldwin_weber_t. Rays aimed at an edge two triangles share can slip
+ * through it, since both triangles round their tests differently.
+ *
+ * A block tests a ray against N triangles at once. The triangles are
+ * loaded into the lanes in reverse, so lane x holds triangle N-1-x
  *
  */
 template<int N>
 struct moeller_trumbore_t {
-  vector8_t e0;
-  vector8_t e1;
-  vector8_t v0;
+  typedef simd_t<N> wide;
+
+  typename wide::vector_t e0;
+  typename wide::vector_t e1;
+  typename wide::vector_t v0;
 
   uint32_t num;
 
@@ -34,21 +41,60 @@ struct moeller_trumbore_t {
       ve1[i] = triangle->v2() - triangle->v0();
       vv0[i] = triangle->v0();
     }
-    e0 = vector8_t(ve0);
-    e1 = vector8_t(ve1);
-    v0 = vector8_t(vv0);
+    e0 = typename wide::vector_t(ve0);
+    e1 = typename wide::vector_t(ve1);
+    v0 = typename wide::vector_t(vv0);
   };
 
+  /**
+   * Recompute the triangle data from the current mesh vertices, and
+   * return the bounds of all triangles
+   *
+   */
+  inline aabb_t refit(const std::vector<mesh_t::p>& meshes) {
+    vector_t ve0[N], ve1[N], vv0[N];
+    aabb_t out;
+
+    for (int i=0; i<num; ++i) {
+      const triangle_t triangle(meshes[meshid[i]], faceid[i]);
+
+      ve0[i] = triangle.v1() - triangle.v0();
+      ve1[i] = triangle.v2() - triangle.v0();
+      vv0[i] = triangle.v0();
+
+      out = bounds::merge(out, triangle.bounds());
+    }
+    e0 = typename wide::vector_t(ve0);
+    e1 = typename wide::vector_t(ve1);
+    v0 = typename wide::vector_t(vv0);
+
+    return out;
+  }
+
+  // the lanes holding triangles
+  inline size_t valid() const {
+    return ((size_t(1) << num) - 1) << (N - num);
+  }
+
+  /**
+   * Test the ray against all triangles. Returns the lanes hit before the
+   * end of the ray, with their distances and barycentric coordinates
+   *
+   */
   template<typename T>
-  inline bool intersect(traversal_ray_t<T>& ray) const {
-    using namespace float8;
-    using namespace vector8;
+  inline typename wide::float_t test(
+    const traversal_ray_t<T, N>& ray
+  , typename wide::float_t& ds
+  , typename wide::float_t& us
+  , typename wide::float_t& vs) const
+  {
+    using namespace simd;
 
     const auto
-      one  = load(1.0f),
-      zero = load(0.0f),
-      peps = load(0.00000001f),
-      meps = load(-0.00000001f);
+      one  = wide::load(1.0f),
+      zero = wide::load(0.0f),
+      peps = wide::load(0.00000001f),
+      meps = wide::load(-0.00000001f);
 
     const auto p   = cross(ray.direction, e1);
     const auto det = dot(e0, p);
@@ -56,53 +102,71 @@ struct moeller_trumbore_t {
     const auto t   = sub(ray.origin, v0);
     const auto q   = cross(t, e0);
 
-    const auto us  = mul(dot(t, p), ood);
-    const auto vs  = mul(dot(ray.direction, q), ood);
-
-    auto ds = mul(dot(e1, q), ood);
+    us = mul(dot(t, p), ood);
+    vs = mul(dot(ray.direction, q), ood);
+    ds = mul(dot(e1, q), ood);
 
     const auto xmask = mor(gt(det, peps), lt(det, meps));
     const auto umask = gte(us, zero);
     const auto vmask = mand(gte(vs, zero), lte(add(us, vs), one));
-    const auto dmask = mand(gte(ds, zero), lt(ds, ray.d));
+    const auto dmask = mand(gt(ds, zero), lt(ds, ray.d));
 
-    auto mask = movemask(mand(mand(mand(vmask, umask), dmask), xmask));
+    return mand(mand(mand(vmask, umask), dmask), xmask);
+  }
+
+  template<typename T>
+  inline bool intersect(traversal_ray_t<T, N>& ray) const {
+    using namespace simd;
+
+    typename wide::float_t ds, us, vs;
+    auto mask = movemask(test(ray, ds, us, vs));
 
     bool ret = false;
 
     if (mask != 0) {
 
-      float dists[N];
+      __aligned(64) float dists[N];
       float closest = ray.segment->d;
 
       store(ds, dists);
 
       int idx = -1;
       while(mask != 0) {
- 	auto x = __bscf(mask);
-    	if (dists[x] > 0.0f && dists[x] < closest && ((7-x) < num)) {
-    	  closest = dists[x];
-    	  idx = x;
-    	}
+	auto x = __bscf(mask);
+	if (dists[x] < closest && ((N-1-x) < num)) {
+	  closest = dists[x];
+	  idx = x;
+	}
       }
 
       if (idx != -1) {
 	if (T::shade) {
-	  float u[N];
-	  float v[N];
+	  __aligned(64) float u[N];
+	  __aligned(64) float v[N];
 	  store(us, u);
 	  store(vs, v);
 
-	  ray.segment->shading(u[idx], v[idx], meshid[7-idx], faceid[7-idx]);
+	  ray.segment->shading(u[idx], v[idx], meshid[N-1-idx], faceid[N-1-idx]);
 	}
 
-    	ray.segment->d = closest;
-    	ray.d          = load(closest);
+	ray.segment->d = closest;
+	ray.d          = wide::load(closest);
 
-    	ret = true;
+	ret = true;
       }
     }
 
     return ret;
   }
+
+  /**
+   * Whether the ray hits any triangle before its end. Occlusion queries
+   * need nothing else, so there is no closest hit to find
+   *
+   */
+  template<typename T>
+  inline bool occluded(const traversal_ray_t<T, N>& ray) const {
+    typename wide::float_t ds, us, vs;
+    return (simd::movemask(test(ray, ds, us, vs)) & valid()) != 0;
+  }
 };
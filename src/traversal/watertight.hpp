@@ -0,0 +1,213 @@
+#pragma once
+
+#include "ray.hpp"
+#include "math/simd.hpp"
+#include "things/mesh.hpp"
+
+#include <cmath>
+#include <utility>
+
+/**
+ * Watertight triangle intersection tests after Woop, Benthin and Wald.
+ * The vertices are translated to the ray origin and sheared, so the ray
+ * runs along z. The edge functions of the sheared triangle are then
+ * computed from the vertices alone, so two triangles sharing an edge
+ * compute it from the same operands, and a ray can't slip through
+ * between them.
+ *
+ * The blocks keep the vertices themselves instead of edges, since edges
+ * computed ahead of time round differently in neighbouring triangles.
+ * The edge functions are computed without fused multiply adds for the
+ * same reason. Rays exactly on an edge hit both triangles, where the
+ * paper falls back to double precision. A block tests a ray against N
+ * triangles at once, loaded into the lanes in reverse like
+ * moeller_trumbore_t
+ *
+ */
+template<int N>
+struct watertight_t {
+  typedef simd_t<N> wide;
+
+  typename wide::vector_t v0;
+  typename wide::vector_t v1;
+  typename wide::vector_t v2;
+
+  uint32_t num;
+
+  uint32_t meshid[N];
+  uint32_t faceid[N];
+
+  inline watertight_t(triangle_t::p* tris, uint32_t num)
+    : num(num) {
+    vector_t vv0[N], vv1[N], vv2[N];
+
+    for (int i=0; i<num; ++i) {
+      const auto& triangle = tris[i];
+
+      faceid[i] = triangle->id;
+      meshid[i] = triangle->mesh->id;
+
+      vv0[i] = triangle->v0();
+      vv1[i] = triangle->v1();
+      vv2[i] = triangle->v2();
+    }
+    v0 = typename wide::vector_t(vv0);
+    v1 = typename wide::vector_t(vv1);
+    v2 = typename wide::vector_t(vv2);
+  };
+
+  inline aabb_t refit(const std::vector<mesh_t::p>& meshes) {
+    vector_t vv0[N], vv1[N], vv2[N];
+    aabb_t out;
+
+    for (int i=0; i<num; ++i) {
+      const triangle_t triangle(meshes[meshid[i]], faceid[i]);
+
+      vv0[i] = triangle.v0();
+      vv1[i] = triangle.v1();
+      vv2[i] = triangle.v2();
+
+      out = bounds::merge(out, triangle.bounds());
+    }
+    v0 = typename wide::vector_t(vv0);
+    v1 = typename wide::vector_t(vv1);
+    v2 = typename wide::vector_t(vv2);
+
+    return out;
+  }
+
+  static inline const typename wide::float_t& axis(const typename wide::vector_t& v, uint32_t k) {
+    return k == 0 ? v.x : (k == 1 ? v.y : v.z);
+  }
+
+  // the lanes holding triangles
+  inline size_t valid() const {
+    return ((size_t(1) << num) - 1) << (N - num);
+  }
+
+  /**
+   * Test the ray against all triangles. Returns the lanes hit before the
+   * end of the ray, with their distances and the weights of the second
+   * and third vertex, like moeller_trumbore_t
+   *
+   */
+  template<typename T>
+  inline typename wide::float_t test(
+    const traversal_ray_t<T, N>& ray
+  , typename wide::float_t& ds
+  , typename wide::float_t& us
+  , typename wide::float_t& vs) const
+  {
+    using namespace simd;
+
+    // the direction is the same in all lanes. the axis it is largest
+    // along becomes z, and x and y are swapped for negative directions
+    // to keep the winding of the triangles
+    __aligned(64) float dir[3][N];
+    store(ray.direction.x, dir[0]);
+    store(ray.direction.y, dir[1]);
+    store(ray.direction.z, dir[2]);
+
+    const auto dx = std::fabs(dir[0][0]), dy = std::fabs(dir[1][0]), dz = std::fabs(dir[2][0]);
+
+    uint32_t kz = dx > dy ? (dx > dz ? 0 : 2) : (dy > dz ? 1 : 2);
+    uint32_t kx = kz == 2 ? 0 : kz + 1;
+    uint32_t ky = kx == 2 ? 0 : kx + 1;
+    if (dir[kz][0] < 0.0f) {
+      std::swap(kx, ky);
+    }
+
+    const auto
+      zero = wide::load(0.0f),
+      sx   = wide::load(dir[kx][0] / dir[kz][0]),
+      sy   = wide::load(dir[ky][0] / dir[kz][0]),
+      sz   = wide::load(1.0f / dir[kz][0]);
+
+    // the vertices relative to the origin, sheared along the ray
+    const auto a = sub(v0, ray.origin);
+    const auto b = sub(v1, ray.origin);
+    const auto c = sub(v2, ray.origin);
+
+    const auto az = axis(a, kz), bz = axis(b, kz), cz = axis(c, kz);
+
+    const auto ax = sub(axis(a, kx), mul(sx, az));
+    const auto ay = sub(axis(a, ky), mul(sy, az));
+    const auto bx = sub(axis(b, kx), mul(sx, bz));
+    const auto by = sub(axis(b, ky), mul(sy, bz));
+    const auto cx = sub(axis(c, kx), mul(sx, cz));
+    const auto cy = sub(axis(c, ky), mul(sy, cz));
+
+    // the edge functions, each weighting the vertex opposite its edge
+    const auto u = sub(mul(cx, by), mul(cy, bx));
+    const auto v = sub(mul(ax, cy), mul(ay, cx));
+    const auto w = sub(mul(bx, ay), mul(by, ax));
+
+    const auto det = add(add(u, v), w);
+    const auto ood = div(wide::load(1.0f), det);
+
+    ds = mul(madd(u, mul(sz, az), madd(v, mul(sz, bz), mul(w, mul(sz, cz)))), ood);
+    us = mul(v, ood);
+    vs = mul(w, ood);
+
+    const auto inside = mor(
+      mand(mand(gte(u, zero), gte(v, zero)), gte(w, zero)),
+      mand(mand(lte(u, zero), lte(v, zero)), lte(w, zero)));
+
+    const auto xmask = mor(gt(det, zero), lt(det, zero));
+    const auto dmask = mand(gt(ds, zero), lt(ds, ray.d));
+
+    return mand(mand(inside, xmask), dmask);
+  }
+
+  template<typename T>
+  inline bool intersect(traversal_ray_t<T, N>& ray) const {
+    using namespace simd;
+
+    typename wide::float_t ds, us, vs;
+    auto mask = movemask(test(ray, ds, us, vs));
+
+    bool ret = false;
+
+    if (mask != 0) {
+
+      __aligned(64) float dists[N];
+      float closest = ray.segment->d;
+
+      store(ds, dists);
+
+      int idx = -1;
+      while(mask != 0) {
+	auto x = __bscf(mask);
+	if (dists[x] < closest && ((N-1-x) < num)) {
+	  closest = dists[x];
+	  idx = x;
+	}
+      }
+
+      if (idx != -1) {
+	if (T::shade) {
+	  __aligned(64) float u[N];
+	  __aligned(64) float v[N];
+	  store(us, u);
+	  store(vs, v);
+
+	  ray.segment->shading(u[idx], v[idx], meshid[N-1-idx], faceid[N-1-idx]);
+	}
+
+	ray.segment->d = closest;
+	ray.d          = wide::load(closest);
+
+	ret = true;
+      }
+    }
+
+    return ret;
+  }
+
+  // whether the ray hits any triangle before its end
+  template<typename T>
+  inline bool occluded(const traversal_ray_t<T, N>& ray) const {
+    typename wide::float_t ds, us, vs;
+    return (simd::movemask(test(ray, ds, us, vs)) & valid()) != 0;
+  }
+};
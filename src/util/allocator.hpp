@@ -1,7 +1,10 @@
 #pragma once
 
+#include <new>
 #include <stdexcept>
 
+#include <stdlib.h>
+
 /**
  * Most allocations in the rendering pipeline are sequential
  * and only last for one pipeline stage, so we organize memory
@@ -50,3 +53,47 @@ inline void* operator new (size_t s, allocator_t& a) {
 inline void* operator new[] (size_t s, allocator_t& a) {
   return a.allocate(s);
 }
+
+/**
+ * Allocates elements of standard containers at an alignment larger than
+ * the one of the heap, e.g. to keep nodes and SIMD data on cache lines
+ *
+ */
+template<typename T, size_t A>
+struct aligned_allocator_t {
+  typedef T value_type;
+
+  template<typename U>
+  struct rebind {
+    typedef aligned_allocator_t<U, A> other;
+  };
+
+  inline aligned_allocator_t()
+  {}
+
+  template<typename U>
+  inline aligned_allocator_t(const aligned_allocator_t<U, A>&)
+  {}
+
+  inline T* allocate(size_t n) {
+    void* out = nullptr;
+    if (posix_memalign(&out, A, n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return (T*) out;
+  }
+
+  inline void deallocate(T* p, size_t) {
+    free(p);
+  }
+
+  template<typename U>
+  inline bool operator==(const aligned_allocator_t<U, A>&) const {
+    return true;
+  }
+
+  template<typename U>
+  inline bool operator!=(const aligned_allocator_t<U, A>&) const {
+    return false;
+  }
+};
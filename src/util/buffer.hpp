@@ -0,0 +1,172 @@
+#pragma once
+
+#include "allocator.hpp"
+
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Copy a single value written raw at 'cursor', and advance the cursor
+ * past it. Throws if the value would reach past 'end'
+ *
+ */
+template<typename T>
+inline void map_value(char*& cursor, const char* end, T& out) {
+  if ((size_t) (end - cursor) < sizeof(T)) {
+    throw std::runtime_error("Mapped value exceeds its file");
+  }
+  memcpy(&out, cursor, sizeof(T));
+  cursor += sizeof(T);
+}
+
+/**
+ * A growable array, that either owns its elements or refers to elements
+ * in memory owned by someone else, like a memory mapped file. Growing a
+ * buffer, that refers to foreign memory, copies its elements first. The
+ * elements are written and mapped as raw bytes, so they must not hold
+ * pointers
+ *
+ */
+template<typename T>
+struct buffer_t {
+  typedef T value_type;
+
+  // owned and mapped elements start on a cache line
+  static const size_t ALIGNMENT = 64;
+
+  std::vector<T, aligned_allocator_t<T, ALIGNMENT>> owned;
+  T*             first;
+  size_t         num;
+
+  inline buffer_t()
+    : first(nullptr), num(0)
+  {}
+
+  inline buffer_t(const buffer_t& cpy)
+    : owned(cpy.begin(), cpy.end())
+  {
+    sync();
+  }
+
+  inline buffer_t& operator=(const buffer_t& cpy) {
+    owned.assign(cpy.begin(), cpy.end());
+    sync();
+    return *this;
+  }
+
+  inline size_t size() const {
+    return num;
+  }
+
+  inline bool empty() const {
+    return num == 0;
+  }
+
+  inline bool mapped() const {
+    return first != owned.data();
+  }
+
+  inline T& operator[](size_t i) {
+    return first[i];
+  }
+
+  inline const T& operator[](size_t i) const {
+    return first[i];
+  }
+
+  inline T* begin() { return first; }
+  inline T* end()   { return first + num; }
+
+  inline const T* begin() const { return first; }
+  inline const T* end()   const { return first + num; }
+
+  inline T& back() {
+    return first[num-1];
+  }
+
+  inline void push_back(const T& v) {
+    own();
+    owned.push_back(v);
+    sync();
+  }
+
+  template<typename... Args>
+  inline void emplace_back(Args&&... args) {
+    own();
+    owned.emplace_back(std::forward<Args>(args)...);
+    sync();
+  }
+
+  inline void resize(size_t n) {
+    own();
+    owned.resize(n);
+    sync();
+  }
+
+  inline void swap(buffer_t& other) {
+    std::swap(owned, other.owned);
+    std::swap(first, other.first);
+    std::swap(num, other.num);
+  }
+
+  inline void clear() {
+    owned.clear();
+    sync();
+  }
+
+  /**
+   * Write the number of elements and the elements, so they can be
+   * mapped by map() from a page aligned mapping of the stream later
+   *
+   */
+  inline void write(std::ostream& out) const {
+    uint64_t n = num;
+    out.write((const char*) &n, sizeof(n));
+
+    static const char zeros[ALIGNMENT] = { 0 };
+    out.write(zeros, (ALIGNMENT - out.tellp() % ALIGNMENT) % ALIGNMENT);
+
+    out.write((const char*) first, n * sizeof(T));
+  }
+
+  /**
+   * Refer to elements written by write() at 'cursor', and advance the
+   * cursor past them. The memory needs to outlive the buffer. Throws if
+   * the elements would reach past 'end', e.g. in a truncated or corrupt
+   * file
+   *
+   */
+  inline void map(char*& cursor, const char* end) {
+    uint64_t n;
+    map_value(cursor, end, n);
+
+    const auto padding = (ALIGNMENT - (uintptr_t) cursor % ALIGNMENT) % ALIGNMENT;
+    if ((uint64_t) (end - cursor) < padding ||
+	n > (uint64_t) (end - cursor - padding) / sizeof(T)) {
+      throw std::runtime_error("Mapped buffer exceeds its file");
+    }
+    cursor += padding;
+
+    decltype(owned)().swap(owned);
+    first  = (T*) cursor;
+    num    = n;
+    cursor += n * sizeof(T);
+  }
+
+  // copy mapped elements, before the buffer grows
+  inline void own() {
+    if (mapped()) {
+      owned.assign(first, first + num);
+    }
+  }
+
+  inline void sync() {
+    first = owned.data();
+    num   = owned.size();
+  }
+};
@@ -3,8 +3,9 @@
 #define likely(x)   __builtin_expect(x, 1)
 #define unlikely(x) __builtin_expect(x, 0)
 
+// tzcnt needs BMI, which not every processor the binary runs on has
 inline size_t __bsf(size_t v) {
-  return _tzcnt_u64(v);
+  return __builtin_ctzll(v);
 }
 
 inline size_t __bscf(size_t& v) {
@@ -15,6 +16,25 @@ inline size_t __bscf(size_t& v) {
 
 #define __aligned(n) __attribute__((aligned (n)))
 
+/**
+ * Functions declared between TARGET_BEGIN and TARGET_END are compiled
+ * for the given instruction sets, whatever the flags of the object they
+ * are in. The binary itself only requires SSE4.2, and calls them after
+ * checking the processor supports them
+ *
+ */
+#define AVX2_TARGET   "avx2,fma"
+#define AVX512_TARGET "avx512f,avx512dq,avx512vl,avx2,fma"
+
+#define PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define TARGET_BEGIN(isa) PRAGMA(clang attribute push (__attribute__((target(isa))), apply_to = function))
+#define TARGET_END        PRAGMA(clang attribute pop)
+#else
+#define TARGET_BEGIN(isa) PRAGMA(GCC push_options) PRAGMA(GCC target(isa))
+#define TARGET_END        PRAGMA(GCC pop_options)
+#endif
+
 #ifdef DEBUG
 #define assert(x)
 #endif
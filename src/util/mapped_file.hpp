@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A file mapped into memory. Pages are read lazily when they are first
+ * touched, and writes go to private copies of the touched pages, so the
+ * file itself is never modified
+ *
+ */
+struct mapped_file_t {
+  typedef std::shared_ptr<mapped_file_t> p;
+
+  char*  data;
+  size_t size;
+
+  inline mapped_file_t(const std::string& path)
+    : data(nullptr), size(0)
+  {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error("Can't open file: " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      size = info.st_size;
+
+      auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (mem != MAP_FAILED) {
+	data = (char*) mem;
+      }
+    }
+    close(fd);
+
+    if (!data) {
+      throw std::runtime_error("Can't map file: " + path);
+    }
+  }
+
+  inline ~mapped_file_t() {
+    munmap(data, size);
+  }
+
+  mapped_file_t(const mapped_file_t&) = delete;
+  mapped_file_t& operator=(const mapped_file_t&) = delete;
+};
@@ -1,15 +1,182 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <memory>
+#include <mutex>
+#include <ostream>
+
+#include <stdint.h>
+
+/**
+ * Traversal statistics are only collected when built with
+ * TRAVERSAL_STATS, since the counters sit in the innermost loops
+ *
+ */
+#ifdef TRAVERSAL_STATS
+#define TRAVERSAL_STAT(x) x
+#else
+#define TRAVERSAL_STAT(x)
+#endif
+
+/**
+ * Counters of one thread traversing hierarchies, e.g. to tell a bad
+ * hierarchy from incoherent ray streams
+ *
+ */
+struct traversal_stats_t {
+  // streams and rays in them, and rays traversed one by one
+  uint64_t streams;
+  uint64_t stream_rays;
+  uint64_t single_rays;
+  // stream rays, that continued on their own below a node
+  uint64_t hybrid_rays;
+  // packets of coherent rays and rays in them
+  uint64_t packets;
+  uint64_t packet_rays;
+  // inner nodes visited, and ray box tests against them
+  uint64_t nodes;
+  uint64_t node_tests;
+  // leaves visited, and ray primitive tests in them
+  uint64_t leaves;
+  uint64_t primitive_tests;
+  // deepest stack of a traversal
+  uint32_t max_depth;
+  // stream tasks of inner nodes by the number of rays in them, in powers
+  // of two from a single ray to 256 rays
+  uint64_t lane_fill[9];
+
+  inline traversal_stats_t() {
+    reset();
+  }
+
+  inline void reset() {
+    streams = stream_rays = single_rays = hybrid_rays = 0;
+    packets = packet_rays = 0;
+    nodes = node_tests = 0;
+    leaves = primitive_tests = 0;
+    max_depth = 0;
+    std::fill(lane_fill, lane_fill + 9, 0);
+  }
+
+  inline void depth(uint32_t d) {
+    max_depth = std::max(max_depth, d);
+  }
+
+  inline void task(uint32_t num_rays) {
+    lane_fill[std::min(31 - __builtin_clz(num_rays), 8)]++;
+  }
+
+  inline traversal_stats_t& operator+=(const traversal_stats_t& s) {
+    streams         += s.streams;
+    stream_rays     += s.stream_rays;
+    single_rays     += s.single_rays;
+    hybrid_rays     += s.hybrid_rays;
+    packets         += s.packets;
+    packet_rays     += s.packet_rays;
+    nodes           += s.nodes;
+    node_tests      += s.node_tests;
+    leaves          += s.leaves;
+    primitive_tests += s.primitive_tests;
+    depth(s.max_depth);
+    for (auto i=0; i<9; ++i) {
+      lane_fill[i] += s.lane_fill[i];
+    }
+    return *this;
+  }
+
+  inline uint64_t rays() const {
+    return stream_rays + single_rays + packet_rays;
+  }
+
+  // average number of rays per stream task of an inner node
+  inline double average_fill() const {
+    return nodes > 0 ? (double) node_tests / nodes : 0.0;
+  }
+
+  inline void print(std::ostream& out) const {
+    const double r = std::max(rays(), (uint64_t) 1);
+
+    out
+      << "Traversed " << rays() << " rays, "
+      << stream_rays << " in " << streams << " streams, "
+      << packet_rays << " in " << packets << " packets" << std::endl
+      << "  continued on their own:  " << hybrid_rays << std::endl
+      << "  node tests per ray:      " << node_tests / r << std::endl
+      << "  primitive tests per ray: " << primitive_tests / r << std::endl
+      << "  nodes visited:           " << nodes << std::endl
+      << "  leaves visited:          " << leaves << std::endl
+      << "  max stack depth:         " << max_depth << std::endl
+      << "  rays per stream task:    " << average_fill() << std::endl;
+
+    for (auto i=0; i<9; ++i) {
+      out << "    " << (1 << i);
+      if (i > 0 && i < 8) {
+	out << "-" << (2 << i) - 1;
+      }
+      out << ": " << lane_fill[i] << std::endl;
+    }
+  }
+
+  inline void json(std::ostream& out) const {
+    out
+      << "{" << std::endl
+      << "  \"streams\": " << streams << "," << std::endl
+      << "  \"stream_rays\": " << stream_rays << "," << std::endl
+      << "  \"single_rays\": " << single_rays << "," << std::endl
+      << "  \"hybrid_rays\": " << hybrid_rays << "," << std::endl
+      << "  \"packets\": " << packets << "," << std::endl
+      << "  \"packet_rays\": " << packet_rays << "," << std::endl
+      << "  \"nodes\": " << nodes << "," << std::endl
+      << "  \"node_tests\": " << node_tests << "," << std::endl
+      << "  \"leaves\": " << leaves << "," << std::endl
+      << "  \"primitive_tests\": " << primitive_tests << "," << std::endl
+      << "  \"max_depth\": " << max_depth << "," << std::endl
+      << "  \"lane_fill\": [";
+
+    for (auto i=0; i<9; ++i) {
+      out << (i > 0 ? ", " : "") << lane_fill[i];
+    }
+
+    out << "]" << std::endl << "}" << std::endl;
+  }
+};
+
+// the traversal counters of the calling thread
+inline traversal_stats_t& traversal_stats() {
+  static thread_local traversal_stats_t s;
+  return s;
+}
 
 struct stats_t {
   typedef std::shared_ptr<stats_t> p;
-  
+
+  // the pass being rendered, its number of patches, and how many of
+  // them are done
+  std::atomic<uint32_t> pass;
+  std::atomic<uint32_t> patches;
   std::atomic<uint32_t> areas;
   std::atomic<uint32_t> rays;
 
+  // traversal counters of all threads, merged when they finish
+  traversal_stats_t traversal;
+  std::mutex        lock;
+
   stats_t()
-    : areas(0), rays(0)
+    : pass(0), patches(0), areas(0), rays(0)
   {}
+
+  // start counting the patches of the next pass
+  inline void start_pass(uint32_t num_patches) {
+    areas   = 0;
+    patches = num_patches;
+    pass++;
+  }
+
+  // add the traversal counters of the calling thread, and reset them
+  inline void merge_traversal() {
+    std::lock_guard<std::mutex> guard(lock);
+    traversal += traversal_stats();
+    traversal_stats().reset();
+  }
 };
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * A fixed set of worker threads, each with its own deque of tasks.
+ * Workers push and pop tasks at the back of their own deque, so nested
+ * tasks run depth first on the thread that spawned them while their data
+ * is still in cache, and steal from the front of the other deques once
+ * their own is empty. Tasks pushed from outside the pool are dealt to the
+ * workers round robin.
+ *
+ * Threads waiting for tasks to finish help executing queued work, so
+ * tasks can spawn and wait for nested tasks without deadlocking the
+ * pool. A pool without threads runs all tasks on the waiting thread.
+ *
+ * The pool is meant to live as long as the process, see shared(), so
+ * repeated renders and builds don't pay for starting threads
+ *
+ */
+struct thread_pool_t {
+  typedef std::shared_ptr<thread_pool_t> p;
+  typedef std::function<void()> task_t;
+
+  struct queue_t {
+    std::mutex         lock;
+    std::deque<task_t> tasks;
+  };
+
+  // the pool and index of the worker running on the calling thread
+  struct worker_t {
+    const thread_pool_t* pool;
+    uint32_t             index;
+  };
+
+  std::vector<std::thread>              threads;
+  std::vector<std::unique_ptr<queue_t>> queues;
+
+  // number of tasks in all queues, waking up sleeping workers. a task
+  // may be taken before its push counted it, so this can drop below 0
+  std::atomic<int>        queued;
+  std::atomic<uint32_t>   next;
+  std::mutex              lock;
+  std::condition_variable wakeup;
+  bool                    done;
+
+  inline thread_pool_t(uint32_t num = std::thread::hardware_concurrency(), bool pin = false)
+    : queued(0)
+    , next(0)
+    , done(false)
+  {
+    for (auto i=0; i<std::max(num, 1u); ++i) {
+      queues.emplace_back(new queue_t);
+    }
+
+    for (auto i=0; i<num; ++i) {
+      threads.emplace_back([this, i]() {
+	current() = { this, (uint32_t) i };
+
+	while (true) {
+	  task_t task;
+	  if (take(task)) {
+	    task();
+	    continue;
+	  }
+
+	  std::unique_lock<std::mutex> guard(lock);
+	  wakeup.wait(guard, [this]() { return done || queued > 0; });
+	  if (done && queued <= 0) {
+	    return;
+	  }
+	}
+      });
+
+      if (pin) {
+	pin_to_core(threads.back(), i);
+      }
+    }
+  }
+
+  inline ~thread_pool_t() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done = true;
+    }
+    wakeup.notify_all();
+
+    for (auto& thread: threads) {
+      thread.join();
+    }
+  }
+
+  /**
+   * The pool shared by the whole process. The first call creates it with
+   * the given number of threads, later calls return the same pool
+   *
+   */
+  static inline thread_pool_t& shared(
+    uint32_t num = std::thread::hardware_concurrency()
+  , bool pin = false)
+  {
+    static thread_pool_t pool(num, pin);
+    return pool;
+  }
+
+  static inline worker_t& current() {
+    static thread_local worker_t worker = { nullptr, 0 };
+    return worker;
+  }
+
+  /**
+   * Restrict a worker to a single core. Only linux lets threads choose
+   * their core, elsewhere this is a no-op
+   *
+   */
+  static inline void pin_to_core(std::thread& thread, uint32_t core) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % std::thread::hardware_concurrency(), &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &set);
+#endif
+  }
+
+  inline uint32_t size() const {
+    return threads.size();
+  }
+
+  /**
+   * Index of the worker running on the calling thread, or size() for
+   * threads outside the pool. Lets tasks keep per thread state in arrays
+   * of size()+1 entries
+   *
+   */
+  inline uint32_t worker() const {
+    const auto& w = current();
+    return w.pool == this ? w.index : size();
+  }
+
+  inline void push(task_t&& task) {
+    const auto& w = current();
+    const auto  i = w.pool == this ? w.index : next++ % queues.size();
+
+    {
+      std::lock_guard<std::mutex> guard(queues[i]->lock);
+      queues[i]->tasks.emplace_back(std::move(task));
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      ++queued;
+    }
+    wakeup.notify_one();
+  }
+
+  /**
+   * Take the newest task of the own deque, or steal the oldest one of
+   * another worker. Threads outside the pool only steal
+   *
+   */
+  inline bool take(task_t& out) {
+    if (queued <= 0) {
+      return false;
+    }
+
+    const auto& w     = current();
+    const auto  owned = w.pool == this;
+    const auto  first = owned ? w.index : next.load();
+
+    if (owned) {
+      auto& q = *queues[first];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (!q.tasks.empty()) {
+	out = std::move(q.tasks.back());
+	q.tasks.pop_back();
+	--queued;
+	return true;
+      }
+    }
+
+    for (auto i=0; i<queues.size(); ++i) {
+      auto& q = *queues[(first + i) % queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (!q.tasks.empty()) {
+	out = std::move(q.tasks.front());
+	q.tasks.pop_front();
+	--queued;
+	return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Run one queued task on the calling thread. Returns false if there
+   * was no work left in the queues
+   *
+   */
+  inline bool run_one() {
+    task_t task;
+    if (!take(task)) {
+      return false;
+    }
+    task();
+    return true;
+  }
+};
+
+/**
+ * Tracks a set of tasks spawned into a pool, so a caller can wait
+ * for all of them to finish
+ *
+ */
+struct task_group_t {
+  thread_pool_t&        pool;
+  std::atomic<uint32_t> pending;
+
+  inline task_group_t(thread_pool_t& pool)
+    : pool(pool), pending(0)
+  {}
+
+  inline ~task_group_t() {
+    wait();
+  }
+
+  template<typename F>
+  inline void spawn(const F& f) {
+    ++pending;
+    pool.push([this, f]() {
+      f();
+      --pending;
+    });
+  }
+
+  inline void wait() {
+    while (pending > 0) {
+      if (!pool.run_one()) {
+	std::this_thread::yield();
+      }
+    }
+  }
+};